@@ -0,0 +1,194 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Copyright (c) 2015 The Transfer developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ARITH_UINT256_H
+#define BITCOIN_ARITH_UINT256_H
+
+#include "uint256.h"
+
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+class uint_error : public std::runtime_error {
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** 256-bit unsigned integer with the arithmetic the consensus code needs:
+ * multiplication, division and the compact target encoding. Fixed width and
+ * on the stack, unlike CBigNum; results wrap modulo 2^256.
+ */
+class arith_uint256
+{
+protected:
+    enum { WIDTH = 256 / 32 };
+    uint32_t pn[WIDTH];
+
+public:
+    arith_uint256()
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+    }
+
+    arith_uint256(uint64_t b)
+    {
+        pn[0] = (unsigned int)b;
+        pn[1] = (unsigned int)(b >> 32);
+        for (int i = 2; i < WIDTH; i++)
+            pn[i] = 0;
+    }
+
+    bool operator!() const
+    {
+        for (int i = 0; i < WIDTH; i++)
+            if (pn[i] != 0)
+                return false;
+        return true;
+    }
+
+    const arith_uint256 operator~() const
+    {
+        arith_uint256 ret;
+        for (int i = 0; i < WIDTH; i++)
+            ret.pn[i] = ~pn[i];
+        return ret;
+    }
+
+    const arith_uint256 operator-() const
+    {
+        arith_uint256 ret = ~*this;
+        ++ret;
+        return ret;
+    }
+
+    arith_uint256& operator^=(const arith_uint256& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] ^= b.pn[i];
+        return *this;
+    }
+
+    arith_uint256& operator&=(const arith_uint256& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] &= b.pn[i];
+        return *this;
+    }
+
+    arith_uint256& operator|=(const arith_uint256& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] |= b.pn[i];
+        return *this;
+    }
+
+    arith_uint256& operator<<=(unsigned int shift);
+    arith_uint256& operator>>=(unsigned int shift);
+
+    arith_uint256& operator+=(const arith_uint256& b)
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64_t n = carry + pn[i] + b.pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    arith_uint256& operator-=(const arith_uint256& b)
+    {
+        *this += -b;
+        return *this;
+    }
+
+    arith_uint256& operator*=(uint32_t b32);
+    arith_uint256& operator*=(const arith_uint256& b);
+    arith_uint256& operator/=(const arith_uint256& b);
+
+    arith_uint256& operator++()
+    {
+        // prefix operator
+        int i = 0;
+        while (i < WIDTH && ++pn[i] == 0)
+            i++;
+        return *this;
+    }
+
+    arith_uint256& operator--()
+    {
+        // prefix operator
+        int i = 0;
+        while (i < WIDTH && --pn[i] == (uint32_t)-1)
+            i++;
+        return *this;
+    }
+
+    int CompareTo(const arith_uint256& b) const
+    {
+        for (int i = WIDTH - 1; i >= 0; i--)
+        {
+            if (pn[i] < b.pn[i])
+                return -1;
+            if (pn[i] > b.pn[i])
+                return 1;
+        }
+        return 0;
+    }
+
+    friend inline const arith_uint256 operator+(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) += b; }
+    friend inline const arith_uint256 operator-(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) -= b; }
+    friend inline const arith_uint256 operator*(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) *= b; }
+    friend inline const arith_uint256 operator/(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) /= b; }
+    friend inline const arith_uint256 operator|(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) |= b; }
+    friend inline const arith_uint256 operator&(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) &= b; }
+    friend inline const arith_uint256 operator^(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) ^= b; }
+    friend inline const arith_uint256 operator>>(const arith_uint256& a, int shift) { return arith_uint256(a) >>= shift; }
+    friend inline const arith_uint256 operator<<(const arith_uint256& a, int shift) { return arith_uint256(a) <<= shift; }
+    friend inline const arith_uint256 operator*(const arith_uint256& a, uint32_t b) { return arith_uint256(a) *= b; }
+    friend inline bool operator==(const arith_uint256& a, const arith_uint256& b) { return a.CompareTo(b) == 0; }
+    friend inline bool operator!=(const arith_uint256& a, const arith_uint256& b) { return a.CompareTo(b) != 0; }
+    friend inline bool operator>(const arith_uint256& a, const arith_uint256& b) { return a.CompareTo(b) > 0; }
+    friend inline bool operator<(const arith_uint256& a, const arith_uint256& b) { return a.CompareTo(b) < 0; }
+    friend inline bool operator>=(const arith_uint256& a, const arith_uint256& b) { return a.CompareTo(b) >= 0; }
+    friend inline bool operator<=(const arith_uint256& a, const arith_uint256& b) { return a.CompareTo(b) <= 0; }
+
+    // Number of significant bits, 0 for zero
+    unsigned int bits() const;
+
+    uint64_t GetLow64() const
+    {
+        return pn[0] | (uint64_t)pn[1] << 32;
+    }
+
+    double getdouble() const;
+
+    std::string GetHex() const;
+    std::string ToString() const { return GetHex(); }
+
+    /**
+     * The "compact" format is a representation of a whole number N using an
+     * unsigned 32bit number similar to a floating point format. The most
+     * significant 8 bits are the unsigned exponent of base 256, the lower 23
+     * bits are the mantissa and bit 24 (0x800000) is the sign, so
+     * N = (-1^sign) * mantissa * 256^(exponent-3). Decoding matches
+     * CBigNum::SetCompact, with the sign and any bits above 2^256 reported
+     * through pfNegative and pfOverflow instead of being represented.
+     */
+    arith_uint256& SetCompact(uint32_t nCompact, bool* pfNegative = NULL, bool* pfOverflow = NULL);
+    uint32_t GetCompact(bool fNegative = false) const;
+
+    friend uint256 ArithToUint256(const arith_uint256& a);
+    friend arith_uint256 UintToArith256(const uint256& a);
+};
+
+uint256 ArithToUint256(const arith_uint256& a);
+arith_uint256 UintToArith256(const uint256& a);
+
+#endif // BITCOIN_ARITH_UINT256_H
@@ -0,0 +1,167 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2015 The Transfer developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "txmempool.h"
+#include "util.h"
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : fHasherReady(false)
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    header.vchBlockSig = block.vchBlockSig;
+    nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+
+    // The coinbase and coinstake are never in the mempool
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+            vPrefilledTxn.push_back(CPrefilledTransaction(i, block.vtx[i]));
+        else
+            vShortTxIds.push_back(GetShortID(block.vtx[i].GetHash()));
+    }
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header.GetHash() << nNonce;
+    uint256 key = Hash(ss.begin(), ss.end());
+
+    shortIdHasher.Reset();
+    shortIdHasher.Write(key.begin(), 32);
+    fHasherReady = true;
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    if (!fHasherReady)
+        FillShortTxIDSelector();
+
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256(shortIdHasher).Write(txhash.begin(), 32).Finalize(hash);
+
+    uint64_t nShortId = 0;
+    for (unsigned int j = 0; j < SHORTTXID_BYTES; j++)
+        nShortId |= (uint64_t)hash[j] << (8 * j);
+    return nShortId;
+}
+
+bool CBlockHeaderAndShortTxIDs::CheckHeader() const
+{
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("CheckHeader() : block timestamp too far in the future");
+
+    // The coinbase and coinstake lead the prefilled transactions, which is all
+    // IsProofOfStake and the block signature look at
+    CBlock block = header;
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, vPrefilledTxn)
+        if (prefilled.nIndex < 2 && prefilled.nIndex == block.vtx.size())
+            block.vtx.push_back(prefilled.tx);
+
+    if (block.IsProofOfWork() && !CheckProofOfWork(block.GetPoWHash(), block.nBits))
+        return header.DoS(50, error("CheckHeader() : proof of work failed"));
+    if (!block.CheckBlockSignature())
+        return header.DoS(100, error("CheckHeader() : bad block signature"));
+
+    return true;
+}
+
+CPartialBlock::ReadStatus CPartialBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool)
+{
+    unsigned int nTxCount = cmpctblock.BlockTxCount();
+    if (cmpctblock.header.hashMerkleRoot == 0 || cmpctblock.vPrefilledTxn.empty())
+        return READ_INVALID;
+    if (nTxCount > MAX_BLOCK_SIZE / ::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION))
+        return READ_INVALID;
+
+    header = cmpctblock.header;
+    vtx.assign(nTxCount, CTransaction());
+    vHave.assign(nTxCount, false);
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        if (prefilled.nIndex >= nTxCount || vHave[prefilled.nIndex])
+            return READ_INVALID;
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // Short IDs fill the remaining positions in order
+    map<uint64_t, unsigned int> mapShortIdIndex;
+    unsigned int nIndex = 0;
+    BOOST_FOREACH(uint64_t nShortId, cmpctblock.vShortTxIds)
+    {
+        while (vHave[nIndex])
+            nIndex++;
+        if (!mapShortIdIndex.insert(make_pair(nShortId, nIndex)).second)
+            return READ_FAILED; // two block transactions share a short ID
+        nIndex++;
+    }
+
+    // Match against the mempool; a short ID hit by two pool transactions is
+    // left missing and asked for, the merkle root check catches the rest
+    set<unsigned int> setAmbiguous;
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTransaction>::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi)
+        {
+            map<uint64_t, unsigned int>::const_iterator it = mapShortIdIndex.find(cmpctblock.GetShortID((*mi).first));
+            if (it == mapShortIdIndex.end())
+                continue;
+            unsigned int i = (*it).second;
+            if (vHave[i])
+                setAmbiguous.insert(i);
+            vtx[i] = (*mi).second;
+            vHave[i] = true;
+        }
+    }
+    BOOST_FOREACH(unsigned int i, setAmbiguous)
+    {
+        vtx[i] = CTransaction();
+        vHave[i] = false;
+    }
+
+    return READ_OK;
+}
+
+void CPartialBlock::GetMissing(std::vector<unsigned int>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+CPartialBlock::ReadStatus CPartialBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vMissing) const
+{
+    block = header;
+    block.vtx = vtx;
+
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nMissing >= vMissing.size())
+            return READ_INVALID;
+        block.vtx[i] = vMissing[nMissing++];
+    }
+    if (nMissing != vMissing.size())
+        return READ_INVALID;
+
+    // A wrong mempool match shows up as a merkle root mismatch
+    if (block.BuildMerkleTree() != header.hashMerkleRoot)
+        return READ_FAILED;
+
+    return READ_OK;
+}
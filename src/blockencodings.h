@@ -0,0 +1,154 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2015 The Transfer developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+#include <vector>
+
+class CTxMemPool;
+
+// Size of a short transaction ID on the wire
+static const unsigned int SHORTTXID_BYTES = 6;
+
+/** Transaction sent in full inside a compact block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex; // position in the block
+    CTransaction tx;
+
+    CPrefilledTransaction() : nIndex(0) {}
+    CPrefilledTransaction(unsigned int nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** Compact block announcement ("cmpctblock"): the signed header, the coinbase and
+ * coinstake in full and a short ID for every other transaction. Short IDs are the
+ * first six bytes of SHA-256(key || txid) with the key derived from the header and
+ * a random nonce, so they differ per announcement and cannot be ground in advance.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable CSHA256 shortIdHasher; // primed with the short ID key
+    mutable bool fHasherReady;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    CBlock header; // header fields and block signature, no transactions
+    uint64_t nNonce;
+    std::vector<uint64_t> vShortTxIds;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs() : fHasherReady(false), nNonce(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    // Context-free checks of the announced header before any reconstruction work:
+    // timestamp, and proof of work or the block signature against the prefilled
+    // coinstake. Failures set header.nDoS.
+    bool CheckHeader() const;
+
+    unsigned int BlockTxCount() const { return vShortTxIds.size() + vPrefilledTxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockHeaderAndShortTxIDs* pthis = const_cast<CBlockHeaderAndShortTxIDs*>(this);
+        READWRITE(header.nVersion);
+        READWRITE(header.hashPrevBlock);
+        READWRITE(header.hashMerkleRoot);
+        READWRITE(header.nTime);
+        READWRITE(header.nBits);
+        READWRITE(header.nNonce);
+        READWRITE(header.vchBlockSig);
+        READWRITE(nNonce);
+
+        std::vector<unsigned char> vchShortIds;
+        if (!fRead)
+        {
+            vchShortIds.resize(vShortTxIds.size() * SHORTTXID_BYTES);
+            for (unsigned int i = 0; i < vShortTxIds.size(); i++)
+                for (unsigned int j = 0; j < SHORTTXID_BYTES; j++)
+                    vchShortIds[i * SHORTTXID_BYTES + j] = (vShortTxIds[i] >> (8 * j)) & 0xff;
+        }
+        READWRITE(vchShortIds);
+        if (fRead)
+        {
+            if (vchShortIds.size() % SHORTTXID_BYTES != 0)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : short ID length mismatch");
+            pthis->vShortTxIds.resize(vchShortIds.size() / SHORTTXID_BYTES);
+            for (unsigned int i = 0; i < vShortTxIds.size(); i++)
+            {
+                uint64_t nShortId = 0;
+                for (unsigned int j = 0; j < SHORTTXID_BYTES; j++)
+                    nShortId |= (uint64_t)vchShortIds[i * SHORTTXID_BYTES + j] << (8 * j);
+                pthis->vShortTxIds[i] = nShortId;
+            }
+            pthis->fHasherReady = false;
+        }
+
+        READWRITE(vPrefilledTxn);
+    )
+};
+
+/** Request for the transactions of a compact block that could not be found ("getblocktxn") */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** Reply to getblocktxn, the requested transactions in request order ("blocktxn") */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+/** A compact block being reconstructed from the mempool */
+class CPartialBlock
+{
+private:
+    CBlock header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+
+public:
+    enum ReadStatus {
+        READ_OK,
+        READ_INVALID, // malformed announcement, the peer misbehaved
+        READ_FAILED,  // short ID collision, fetch the full block instead
+    };
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+    void GetMissing(std::vector<unsigned int>& vIndexes) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vMissing) const;
+    uint256 GetHash() const { return header.GetHash(); }
+};
+
+#endif
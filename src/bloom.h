@@ -0,0 +1,48 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Copyright (c) 2015 The Transfer developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include "protocol.h"
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive
+ * rate. Unlike an mruset it does not allocate per element and lookups touch a
+ * fixed number of words.
+ *
+ * contains(item) will always return true if item was one of the last N to 1.5*N
+ * insert()'ed ... but may also return true for items that were not inserted.
+ *
+ * The hash functions are salted with a random tweak chosen on reset(), so
+ * peers cannot predict which items collide in our filter.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const unsigned char* pData, size_t nLen);
+    bool contains(const unsigned char* pData, size_t nLen) const;
+
+    void insert(const CInv& inv);
+    bool contains(const CInv& inv) const;
+
+    void reset();
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    // Two bits per cell, the generation the bit was last set in (0 = unset)
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
+};
+
+#endif // BITCOIN_BLOOM_H
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,18 @@ public:
     CSHA256& Reset();
 };
 
+/** Pick the fastest SHA-256 code this CPU supports (SHA-NI, or SSE4.1/AVX2
+ *  for batches) and return its name. Until it is called, the portable
+ *  implementation is used.
+ */
+std::string SHA256AutoDetect();
+
+/** Double SHA-256 of each of `blocks` consecutive 64-byte inputs, as needed
+ *  for merkle tree nodes. Writes blocks*32 bytes to out.
+ */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks);
+
+/** Apply the compression function to one chunk, from an arbitrary state. */
+void SHA256Compress(uint32_t state[8], const unsigned char chunk[64]);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -0,0 +1,138 @@
+// Copyright (c) 2015 The Transfer developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// 4-way double SHA-256 of 64-byte inputs using SSE4.1, one input per vector lane.
+
+#include "crypto/common.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(ENABLE_SHA256_X86)
+#include <immintrin.h>
+
+#define SSE41_FUNCTION __attribute__((target("sse4.1")))
+
+namespace
+{
+SSE41_FUNCTION inline __m128i K(uint32_t x) { return _mm_set1_epi32(x); }
+
+SSE41_FUNCTION inline __m128i Add(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
+SSE41_FUNCTION inline __m128i Add(__m128i x, __m128i y, __m128i z) { return Add(Add(x, y), z); }
+SSE41_FUNCTION inline __m128i Add(__m128i x, __m128i y, __m128i z, __m128i w) { return Add(Add(x, y), Add(z, w)); }
+SSE41_FUNCTION inline __m128i Add(__m128i x, __m128i y, __m128i z, __m128i w, __m128i v) { return Add(Add(x, y, z), Add(w, v)); }
+SSE41_FUNCTION inline __m128i Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+SSE41_FUNCTION inline __m128i Xor(__m128i x, __m128i y, __m128i z) { return Xor(Xor(x, y), z); }
+SSE41_FUNCTION inline __m128i Or(__m128i x, __m128i y) { return _mm_or_si128(x, y); }
+SSE41_FUNCTION inline __m128i And(__m128i x, __m128i y) { return _mm_and_si128(x, y); }
+SSE41_FUNCTION inline __m128i ShR(__m128i x, int n) { return _mm_srli_epi32(x, n); }
+SSE41_FUNCTION inline __m128i ShL(__m128i x, int n) { return _mm_slli_epi32(x, n); }
+SSE41_FUNCTION inline __m128i RotR(__m128i x, int n) { return Or(ShR(x, n), ShL(x, 32 - n)); }
+
+SSE41_FUNCTION inline __m128i Ch(__m128i x, __m128i y, __m128i z) { return Xor(z, And(x, Xor(y, z))); }
+SSE41_FUNCTION inline __m128i Maj(__m128i x, __m128i y, __m128i z) { return Or(And(x, y), And(z, Or(x, y))); }
+SSE41_FUNCTION inline __m128i Sigma0(__m128i x) { return Xor(RotR(x, 2), RotR(x, 13), RotR(x, 22)); }
+SSE41_FUNCTION inline __m128i Sigma1(__m128i x) { return Xor(RotR(x, 6), RotR(x, 11), RotR(x, 25)); }
+SSE41_FUNCTION inline __m128i sigma0(__m128i x) { return Xor(RotR(x, 7), RotR(x, 18), ShR(x, 3)); }
+SSE41_FUNCTION inline __m128i sigma1(__m128i x) { return Xor(RotR(x, 17), RotR(x, 19), ShR(x, 10)); }
+
+const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+/** Run the compression function on s for the message words in w[0..15]. */
+SSE41_FUNCTION void Compress(__m128i* s, __m128i* w)
+{
+    __m128i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++)
+    {
+        __m128i wi;
+        if (i < 16)
+            wi = w[i];
+        else
+            wi = w[i & 15] = Add(sigma1(w[(i - 2) & 15]), w[(i - 7) & 15], sigma0(w[(i - 15) & 15]), w[i & 15]);
+        __m128i t1 = Add(h, Sigma1(e), Ch(e, f, g), K(k[i]), wi);
+        __m128i t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = Add(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = Add(t1, t2);
+    }
+    s[0] = Add(s[0], a);
+    s[1] = Add(s[1], b);
+    s[2] = Add(s[2], c);
+    s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e);
+    s[5] = Add(s[5], f);
+    s[6] = Add(s[6], g);
+    s[7] = Add(s[7], h);
+}
+
+/** Gather the big endian word at offset from each of the 4 inputs. */
+SSE41_FUNCTION inline __m128i Read(const unsigned char* in, int offset)
+{
+    return _mm_setr_epi32(
+        ReadBE32(in + 0 + offset),
+        ReadBE32(in + 64 + offset),
+        ReadBE32(in + 128 + offset),
+        ReadBE32(in + 192 + offset));
+}
+
+/** Scatter the words of v to offset in each of the 4 outputs. */
+SSE41_FUNCTION inline void Write(unsigned char* out, int offset, __m128i v)
+{
+    WriteBE32(out + 0 + offset, _mm_extract_epi32(v, 0));
+    WriteBE32(out + 32 + offset, _mm_extract_epi32(v, 1));
+    WriteBE32(out + 64 + offset, _mm_extract_epi32(v, 2));
+    WriteBE32(out + 96 + offset, _mm_extract_epi32(v, 3));
+}
+}
+
+namespace sha256d64_sse41
+{
+SSE41_FUNCTION void Transform_4way(unsigned char* out, const unsigned char* in)
+{
+    __m128i s[8], w[16], t[8];
+
+    // First pass: the 64 bytes of input, then the fixed padding block
+    for (int i = 0; i < 8; i++)
+        s[i] = K(init[i]);
+    for (int i = 0; i < 16; i++)
+        w[i] = Read(in, 4 * i);
+    Compress(s, w);
+    w[0] = K(0x80000000);
+    for (int i = 1; i < 15; i++)
+        w[i] = K(0);
+    w[15] = K(512);
+    Compress(s, w);
+
+    // Second pass over the 32-byte digest
+    for (int i = 0; i < 8; i++)
+    {
+        w[i] = s[i];
+        t[i] = K(init[i]);
+    }
+    w[8] = K(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = K(0);
+    w[15] = K(256);
+    Compress(t, w);
+
+    for (int i = 0; i < 8; i++)
+        Write(out, 4 * i, t[i]);
+}
+}
+#endif
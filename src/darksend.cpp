@@ -398,6 +398,7 @@ void CDarksendPool::SetNull(){
     entries.clear();
     finalTransaction.vin.clear();
     finalTransaction.vout.clear();
+    finalTransaction.InvalidateHash();
     lastTimeChanged = GetTimeMillis();
 
     // -- seed random number generator (used for ordering output lists)
@@ -1086,6 +1087,7 @@ bool CDarksendPool::AddScriptSig(const CTxIn& newVin){
         if(newVin.prevout == vin.prevout && vin.nSequence == newVin.nSequence){
             vin.scriptSig = newVin.scriptSig;
             vin.prevPubKey = newVin.prevPubKey;
+            finalTransaction.InvalidateHash();
             LogPrint("darksend", "CDarksendPool::AddScriptSig -- adding to finalTransaction  %s\n", newVin.scriptSig.ToString().substr(0,24));
         }
     }
@@ -2187,11 +2189,14 @@ bool CDarksendQueue::Sign()
 
 bool CDarksendQueue::Relay()
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << (*this);
+    CSharedMessage msg = MakeSharedMessage("dsq", ss);
 
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes){
         // always relay to everyone
-        pnode->PushMessage("dsq", (*this));
+        pnode->PushSharedMessage(msg);
     }
 
     return true;
@@ -2216,10 +2221,14 @@ bool CDarksendQueue::CheckSignature()
 
 void CDarksendPool::RelayFinalTransaction(const int sessionID, const CTransaction& txNew)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sessionID << txNew;
+    CSharedMessage msg = MakeSharedMessage("dsf", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
-        pnode->PushMessage("dsf", sessionID, txNew);
+        pnode->PushSharedMessage(msg);
     }
 }
 
@@ -2245,16 +2254,24 @@ void CDarksendPool::RelayIn(const std::vector<CTxDSIn>& vin, const int64_t& nAmo
 
 void CDarksendPool::RelayStatus(const int sessionID, const int newState, const int newEntriesCount, const int newAccepted, const std::string error)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sessionID << newState << newEntriesCount << newAccepted << error;
+    CSharedMessage msg = MakeSharedMessage("dssu", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
-        pnode->PushMessage("dssu", sessionID, newState, newEntriesCount, newAccepted, error);
+        pnode->PushSharedMessage(msg);
 }
 
 void CDarksendPool::RelayCompletedTransaction(const int sessionID, const bool error, const std::string errorMessage)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << sessionID << error << errorMessage;
+    CSharedMessage msg = MakeSharedMessage("dsc", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
-        pnode->PushMessage("dsc", sessionID, error, errorMessage);
+        pnode->PushSharedMessage(msg);
 }
 
 //TODO: Rename/move to core
@@ -2287,12 +2304,13 @@ void ThreadCheckDarkSendPool()
             if(c % 60 == 0)
             {
                 mnodeman.CheckAndRemove();
+                mnodeman.SyncList();
                 mnodeman.ProcessMasternodeConnections();
                 masternodePayments.CleanPaymentList();
                 CleanTransactionLocksList();
             }
 
-            //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
+            if(c % MASTERNODES_DUMP_SECONDS == 0) FlushMasternodes();
 
             darkSendPool.CheckTimeout();
             darkSendPool.CheckForCompleteQueue();
@@ -1,5 +1,67 @@
 #include "hash.h"
 
+inline uint32_t ROTL32(uint32_t x, int8_t r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pData, size_t nDataLen)
+{
+    // The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
+    uint32_t h1 = nHashSeed;
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+
+    const int nblocks = nDataLen / 4;
+
+    //----------
+    // body
+    for (int i = 0; i < nblocks; ++i) {
+        uint32_t k1 = (uint32_t)pData[i*4] | ((uint32_t)pData[i*4+1] << 8) |
+                      ((uint32_t)pData[i*4+2] << 16) | ((uint32_t)pData[i*4+3] << 24);
+
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+
+        h1 ^= k1;
+        h1 = ROTL32(h1, 13);
+        h1 = h1 * 5 + 0xe6546b64;
+    }
+
+    //----------
+    // tail
+    const unsigned char* tail = pData + nblocks * 4;
+
+    uint32_t k1 = 0;
+
+    switch (nDataLen & 3) {
+    case 3:
+        k1 ^= tail[2] << 16;
+        // FALLTHROUGH
+    case 2:
+        k1 ^= tail[1] << 8;
+        // FALLTHROUGH
+    case 1:
+        k1 ^= tail[0];
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    //----------
+    // finalization
+    h1 ^= nDataLen;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+
+    return h1;
+}
+
 int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len)
 {
     unsigned char key[128];
@@ -76,6 +76,17 @@ inline uint256 Hash(const T1 pbegin, const T1 pend)
     return hash2;
 }
 
+/** Double SHA-256 of two concatenated hashes, i.e. a merkle tree node. */
+inline uint256 HashMerkleNode(const uint256& left, const uint256& right)
+{
+    unsigned char buf[64];
+    memcpy(buf, left.begin(), 32);
+    memcpy(buf + 32, right.begin(), 32);
+    uint256 hash;
+    SHA256D64(hash.begin(), buf, 1);
+    return hash;
+}
+
 class CHashWriter
 {
 private:
@@ -174,6 +185,13 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pData, size_t nDataLen);
+
+inline unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
+{
+    return MurmurHash3(nHashSeed, vDataToHash.empty() ? NULL : &vDataToHash[0], vDataToHash.size());
+}
+
 typedef struct
 {
     SHA512_CTX ctxInner;
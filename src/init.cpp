@@ -13,6 +13,7 @@
 #include "net.h"
 #include "key.h"
 #include "pubkey.h"
+#include "crypto/sha256.h"
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
@@ -194,6 +195,7 @@ std::string HelpMessage()
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 100)") + "\n";
+    strUsage += "  -par=<n>               " + _("Set the number of threads checking blocks during initial download (default: number of cores minus one, 0 = off)") + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
@@ -217,6 +219,8 @@ std::string HelpMessage()
     strUsage += "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -maxuploadtarget=<n>   " + _("Tries to keep outbound traffic under the given target (in MiB per 24h), historical blocks are cut first, 0 = no limit (default: 0)") + "\n";
+    strUsage += "  -maxpeeruploadrate=<n> " + _("Serve historical blocks to a peer at most at <n> KB/s, 0 = no limit (default: 0)") + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n";
@@ -257,6 +261,8 @@ std::string HelpMessage()
         strUsage += "  -rpcwait               " + _("Wait for RPC server to start") + "\n";
     }
     strUsage += "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n";
+    strUsage += "  -rpcworkqueue=<n>      " + _("Set the depth of the work queue to service RPC calls, further calls get HTTP 503 (default: 16)") + "\n";
+    strUsage += "  -rpcmaxconnections=<n> " + _("Maximum number of open RPC connections (default: 64)") + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
     strUsage += "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n";
     strUsage += "  -confchange            " + _("Require a confirmations for change (default: 0)") + "\n";
@@ -269,6 +275,8 @@ std::string HelpMessage()
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
+    strUsage += "  -addrindex             " + _("Maintain an index of transactions by address (default: 0)") + "\n";
+    strUsage += "  -reindexaddr           " + _("Rebuild the address index from the blk000?.dat files on startup") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
@@ -510,6 +518,9 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
+    // Select the SHA-256 code for this CPU before anything hashes in parallel
+    std::string strSHA256Impl = SHA256AutoDetect();
+
     // Initialize elliptic curve code
     ECC_Start();
     globalVerifyHandle.reset(new ECCVerifyHandle());
@@ -539,6 +550,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("Transfer version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using the '%s' SHA256 implementation\n", strSHA256Impl);
     if (!fLogTimestamps)
         LogPrintf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()));
     LogPrintf("Default data directory %s\n", GetDefaultDataDir().string());
@@ -742,6 +754,11 @@ bool AppInit2(boost::thread_group& threadGroup)
     fDiscover = GetBoolArg("-discover", true);
     fNameLookup = GetBoolArg("-dns", true);
 
+    if (mapArgs.count("-maxuploadtarget"))
+        CNode::SetMaxOutboundTarget(std::max((int64_t)0, GetArg("-maxuploadtarget", 0)) * 1024 * 1024);
+    if (mapArgs.count("-maxpeeruploadrate"))
+        CNode::SetMaxPeerUploadRate(std::max((int64_t)0, GetArg("-maxpeeruploadrate", 0)) * 1000);
+
     bool fBound = false;
     if (!fNoListen)
     {
@@ -1002,20 +1019,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (!strErrors.str().empty())
         return InitError(strErrors.str());
 
-    uiInterface.InitMessage(_("Loading masternode cache..."));
-
-    CMasternodeDB mndb;
-    CMasternodeDB::ReadResult readResult = mndb.Read(mnodeman);
-    if (readResult == CMasternodeDB::FileError)
-        LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok)
-    {
-        LogPrintf("Error reading mncache.dat: ");
-        if(readResult == CMasternodeDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-    }
+    // the masternode cache loads in the background, the list fills in as it goes
+    threadGroup.create_thread(boost::bind(&ThreadLoadMasternodes));
 
 
     fMasterNode = GetBoolArg("-masternode", false);
@@ -1125,21 +1130,56 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     RandAddSeedPerfmon();
 
-    // reindex addresses found in blockchain
-    if(GetBoolArg("-reindexaddr", false))
+    // reindex addresses found in blockchain, also when -addrindex is turned on
+    // over a database whose address index was not kept up to date
     {
-        uiInterface.InitMessage(_("Rebuilding address index..."));
-        CBlockIndex *pblockAddrIndex = pindexBest;
-	CTxDB txdbAddr("rw");
-	while(pblockAddrIndex)
-	{
-	    uiInterface.InitMessage(strprintf("Rebuilding address index, block %i", pblockAddrIndex->nHeight));
-	    bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
-	    CBlock pblockAddr;
-	    if(pblockAddr.ReadFromDisk(pblockAddrIndex, true))
-	        pblockAddr.RebuildAddressIndex(txdbAddr);
-	    pblockAddrIndex = pblockAddrIndex->pprev;
-	}
+        bool fAddrIndex = GetBoolArg("-addrindex", false);
+        CTxDB txdbAddr("r+");
+        int nAddrIndexVersion = 0;
+        bool fReindexAddr = GetBoolArg("-reindexaddr", false) ||
+            (fAddrIndex && (!txdbAddr.ReadAddrIndexVersion(nAddrIndexVersion) || nAddrIndexVersion != ADDRESS_INDEX_VERSION));
+        if (!fAddrIndex)
+            txdbAddr.EraseAddrIndexVersion();
+        if (fReindexAddr)
+        {
+            uiInterface.InitMessage(_("Rebuilding address index..."));
+            txdbAddr.EraseAddrIndexVersion();
+            if (!txdbAddr.WipeAddrIndex())
+                return InitError(_("Error erasing the address index"));
+
+            // entries are appended in chain order, one batch per block
+            bool fAddrIndexComplete = true;
+            CBlockIndex *pblockAddrIndex = pindexGenesisBlock;
+            while (pblockAddrIndex && !ShutdownRequested())
+            {
+                if (pblockAddrIndex->nHeight % 1000 == 0)
+                    uiInterface.InitMessage(strprintf(_("Rebuilding address index, block %i"), pblockAddrIndex->nHeight));
+                CBlock blockAddr;
+                if (!blockAddr.ReadFromDisk(pblockAddrIndex, true))
+                {
+                    fAddrIndexComplete = false;
+                    LogPrintf("Rebuilding address index could not read block %d\n", pblockAddrIndex->nHeight);
+                }
+                else
+                {
+                    txdbAddr.TxnBegin();
+                    if (!blockAddr.RebuildAddressIndex(txdbAddr, pblockAddrIndex))
+                    {
+                        txdbAddr.TxnAbort();
+                        fAddrIndexComplete = false;
+                        LogPrintf("Rebuilding address index failed at block %d\n", pblockAddrIndex->nHeight);
+                    }
+                    else if (!txdbAddr.TxnCommit())
+                        return InitError(_("Error writing the address index"));
+                }
+                pblockAddrIndex = pblockAddrIndex->pnext;
+            }
+            // an incomplete index has no version record, so the next start rebuilds it
+            if (fAddrIndex && fAddrIndexComplete && !ShutdownRequested())
+                txdbAddr.WriteAddrIndexVersion(ADDRESS_INDEX_VERSION);
+            else if (fAddrIndex && !fAddrIndexComplete)
+                InitWarning(_("Warning: the address index could not be rebuilt completely, it will be rebuilt on the next start."));
+        }
     }
 
     //// debug print
@@ -1151,6 +1191,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("mapAddressBook.size() = %u\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 #endif
 
+    int nBlockCheckThreads = GetArg("-par", (int)boost::thread::hardware_concurrency() - 1);
+    StartBlockCheckThreads(threadGroup, std::max(0, std::min(nBlockCheckThreads, MAX_BLOCK_CHECK_THREADS)));
+
     StartNode(threadGroup);
 #ifdef ENABLE_WALLET
     // InitRPCMining is needed here so getwork/getblocktemplate in the GUI debug console works properly.
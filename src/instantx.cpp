@@ -25,6 +25,45 @@ std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
 
+// expiry wheels: slot (time / INSTANTX_EXPIRY_SLOT_SECONDS) -> hashes due in that slot,
+// cleaning only visits the slots that are due instead of every lock
+std::map<int64_t, std::vector<uint256> > mapLockExpiryWheel;
+std::map<int64_t, std::vector<uint256> > mapVoteExpiryWheel;
+// txHash -> hashes of all its votes in mapTxLockVote, so a cleaned lock takes every vote with it
+static std::map<uint256, std::vector<uint256> > mapTxLockVotesByTx;
+
+static void ScheduleExpiry(std::map<int64_t, std::vector<uint256> >& wheel, int64_t nTime, const uint256& hash)
+{
+    wheel[nTime / INSTANTX_EXPIRY_SLOT_SECONDS].push_back(hash);
+}
+
+// pop everything due at or before nNow
+static void PopExpired(std::map<int64_t, std::vector<uint256> >& wheel, int64_t nNow, std::vector<uint256>& vExpired)
+{
+    std::map<int64_t, std::vector<uint256> >::iterator it = wheel.begin();
+    while(it != wheel.end() && it->first <= nNow / INSTANTX_EXPIRY_SLOT_SECONDS) {
+        vExpired.insert(vExpired.end(), it->second.begin(), it->second.end());
+        wheel.erase(it++);
+    }
+}
+
+// no more than INSTANTX_MAX_VOTES_PER_TX votes are kept for a transaction
+static bool TxLockVotesFull(const uint256& txHash)
+{
+    std::map<uint256, std::vector<uint256> >::const_iterator it = mapTxLockVotesByTx.find(txHash);
+    return it != mapTxLockVotesByTx.end() && it->second.size() >= INSTANTX_MAX_VOTES_PER_TX;
+}
+
+// remember a vote, it goes when its lock is cleaned or after INSTANTX_LOCK_EXPIRATION_SECONDS without one
+static void AddTxLockVote(const CConsensusVote& ctx)
+{
+    if(TxLockVotesFull(ctx.txHash)) return;
+    uint256 hash = ctx.GetHash();
+    if(!mapTxLockVote.insert(make_pair(hash, ctx)).second) return;
+    mapTxLockVotesByTx[ctx.txHash].push_back(hash);
+    ScheduleExpiry(mapVoteExpiryWheel, GetTime() + INSTANTX_LOCK_EXPIRATION_SECONDS, hash);
+}
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
@@ -136,9 +175,15 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
             return;
         }
 
-        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
+        if(TxLockVotesFull(ctx.txHash)){
+            LogPrint("instantx", "ProcessMessageInstantX::txlvote - too many votes for %s\n", ctx.txHash.ToString().c_str());
+            return;
+        }
 
         if(ProcessConsensusVote(pfrom, ctx)){
+            // only votes that checked out are kept and served
+            AddTxLockVote(ctx);
+
             //Spam/Dos protection
             /*
                 Masternodes will sometimes propagate votes before the transaction is known to the client.
@@ -240,10 +285,11 @@ int64_t CreateNewLock(CTransaction tx)
 
         CTransactionLock newLock;
         newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime()+(20*60); //locks expire after 20 minutes (20 confirmations)
+        newLock.nExpiration = GetTime()+INSTANTX_LOCK_EXPIRATION_SECONDS;
         newLock.nTimeout = GetTime()+(60*5);
         newLock.txHash = tx.GetHash();
         mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
+        ScheduleExpiry(mapLockExpiryWheel, newLock.nExpiration, newLock.txHash);
     } else {
         mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
         LogPrint("instantx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
@@ -289,7 +335,7 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
         return;
     }
 
-    mapTxLockVote[ctx.GetHash()] = ctx;
+    AddTxLockVote(ctx);
 
     CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
 
@@ -334,10 +380,11 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 
         CTransactionLock newLock;
         newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime()+(20*60);
+        newLock.nExpiration = GetTime()+INSTANTX_LOCK_EXPIRATION_SECONDS;
         newLock.nTimeout = GetTime()+(60*5);
         newLock.txHash = ctx.txHash;
         mapTxLocks.insert(make_pair(ctx.txHash, newLock));
+        ScheduleExpiry(mapLockExpiryWheel, newLock.nExpiration, newLock.txHash);
     } else {
         LogPrint("instantx", "InstantX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
     }
@@ -348,7 +395,10 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
     //compile consessus vote
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
     if (i != mapTxLocks.end()){
-        (*i).second.AddSignature(ctx);
+        if(!(*i).second.AddSignature(ctx)){
+            LogPrint("instantx", "InstantX::ProcessConsensusVote - Vote not added %s\n", ctx.GetHash().ToString().c_str());
+            return false;
+        }
 
 #ifdef ENABLE_WALLET
         if(pwalletMain){
@@ -408,14 +458,24 @@ bool CheckForConflictingLocks(CTransaction& tx)
         Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
+    uint256 hashTx = tx.GetHash();
     BOOST_FOREACH(const CTxIn& in, tx.vin){
-        if(mapLockedInputs.count(in.prevout)){
-            if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                LogPrintf("InstantX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if(mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if(mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
+        std::map<COutPoint, uint256>::iterator mi = mapLockedInputs.find(in.prevout);
+        if(mi != mapLockedInputs.end() && (*mi).second != hashTx){
+            const uint256& hashConflict = (*mi).second;
+            LogPrintf("InstantX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", hashTx.ToString().c_str(), hashConflict.ToString().c_str());
+            int64_t nNow = GetTime();
+            std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(hashTx);
+            if(it != mapTxLocks.end()) {
+                (*it).second.nExpiration = nNow;
+                ScheduleExpiry(mapLockExpiryWheel, nNow, hashTx);
+            }
+            it = mapTxLocks.find(hashConflict);
+            if(it != mapTxLocks.end()) {
+                (*it).second.nExpiration = nNow;
+                ScheduleExpiry(mapLockExpiryWheel, nNow, hashConflict);
             }
+            return true;
         }
     }
 
@@ -441,31 +501,60 @@ void CleanTransactionLocksList()
 {
     if(pindexBest == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    int64_t nNow = GetTime();
 
-    while(it != mapTxLocks.end()) {
-        if(GetTime() > it->second.nExpiration){ //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+    std::vector<uint256> vExpired;
+    PopExpired(mapLockExpiryWheel, nNow, vExpired);
 
-            if(mapTxLockReq.count(it->second.txHash)){
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+    BOOST_FOREACH(const uint256& hash, vExpired) {
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(hash);
+        if(it == mapTxLocks.end()) continue; // already gone, stale wheel entry
 
-                BOOST_FOREACH(const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+        if(nNow <= it->second.nExpiration) {
+            ScheduleExpiry(mapLockExpiryWheel, it->second.nExpiration, hash);
+            continue;
+        }
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+        LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
 
-                BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
+        std::map<uint256, CTransaction>::iterator mi = mapTxLockReq.find(it->second.txHash);
+        if(mi != mapTxLockReq.end()){
+            BOOST_FOREACH(const CTxIn& in, (*mi).second.vin) {
+                std::map<COutPoint, uint256>::iterator li = mapLockedInputs.find(in.prevout);
+                if(li != mapLockedInputs.end() && (*li).second == it->second.txHash)
+                    mapLockedInputs.erase(li);
             }
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            mapTxLockReq.erase(mi);
         }
+        mapTxLockReqRejected.erase(it->second.txHash);
+
+        // every vote for the transaction, also those the lock didn't take
+        std::map<uint256, std::vector<uint256> >::iterator vi = mapTxLockVotesByTx.find(it->second.txHash);
+        if(vi != mapTxLockVotesByTx.end()) {
+            BOOST_FOREACH(const uint256& hashVote, (*vi).second)
+                mapTxLockVote.erase(hashVote);
+            mapTxLockVotesByTx.erase(vi);
+        }
+
+        mapTxLocks.erase(it);
     }
 
+    // votes that never made it into a lock
+    vExpired.clear();
+    PopExpired(mapVoteExpiryWheel, nNow, vExpired);
+    BOOST_FOREACH(const uint256& hash, vExpired) {
+        std::map<uint256, CConsensusVote>::iterator it = mapTxLockVote.find(hash);
+        if(it == mapTxLockVote.end()) continue;
+        if(mapTxLocks.count((*it).second.txHash)) continue; // cleaned with its lock
+
+        std::map<uint256, std::vector<uint256> >::iterator vi = mapTxLockVotesByTx.find((*it).second.txHash);
+        if(vi != mapTxLockVotesByTx.end()) {
+            (*vi).second.erase(std::remove((*vi).second.begin(), (*vi).second.end(), hash), (*vi).second.end());
+            if((*vi).second.empty()) mapTxLockVotesByTx.erase(vi);
+        }
+        mapTxLockVote.erase(it);
+    }
 }
 
 uint256 CConsensusVote::GetHash() const
@@ -554,9 +643,22 @@ bool CTransactionLock::SignaturesValid()
     return true;
 }
 
-void CTransactionLock::AddSignature(CConsensusVote& cv)
+bool CTransactionLock::AddSignature(CConsensusVote& cv)
 {
+    int nWrongHeight = -1;
+    for(unsigned int i = 0; i < vecConsensusVotes.size(); i++) {
+        if(vecConsensusVotes[i].vinMasternode == cv.vinMasternode) return false;
+        if(vecConsensusVotes[i].nBlockHeight != nBlockHeight) nWrongHeight = i;
+    }
+
+    if(vecConsensusVotes.size() >= INSTANTX_MAX_VOTES_PER_TX) {
+        // when full, a vote for our height can still replace one that can never count
+        if(cv.nBlockHeight != nBlockHeight || nWrongHeight == -1) return false;
+        vecConsensusVotes.erase(vecConsensusVotes.begin() + nWrongHeight);
+    }
+
     vecConsensusVotes.push_back(cv);
+    return true;
 }
 
 int CTransactionLock::CountSignatures()
@@ -18,6 +18,10 @@
 using namespace std;
 using namespace boost;
 
+#define INSTANTX_LOCK_EXPIRATION_SECONDS       (20*60) // locks expire after 20 minutes (20 confirmations)
+#define INSTANTX_EXPIRY_SLOT_SECONDS           60      // granularity of the expiry wheel
+#define INSTANTX_MAX_VOTES_PER_TX              (INSTANTX_SIGNATURES_TOTAL*2)
+
 class CConsensusVote;
 class CTransaction;
 class CTransactionLock;
@@ -83,7 +87,8 @@ public:
 
     bool SignaturesValid();
     int CountSignatures();
-    void AddSignature(CConsensusVote& cv);
+    // false if the masternode already voted or the lock holds INSTANTX_MAX_VOTES_PER_TX votes
+    bool AddSignature(CConsensusVote& cv);
 
     uint256 GetHash()
     {
@@ -52,50 +52,61 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+// Candidate block for stake modifier selection. The selection hash only depends
+// on the candidate and the previous modifier, so it is computed once per
+// candidate instead of once per selection round.
+struct CModifierCandidate
+{
+    int64_t nTime;
+    uint256 hashBlock;
+    const CBlockIndex* pindex;
+    uint256 hashSelection;
+    bool fSelected;
+
+    bool operator<(const CModifierCandidate& b) const
+    {
+        // same order as the former (time, hash) pairs
+        if (nTime != b.nTime)
+            return nTime < b.nTime;
+        return hashBlock < b.hashBlock;
+    }
+};
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, const CBlockIndex** pindexSelected)
+// already selected blocks, and with timestamp up to nSelectionIntervalStop.
+static bool SelectBlockFromCandidates(vector<CModifierCandidate>& vSortedByTimestamp,
+    int64_t nSelectionIntervalStop, CModifierCandidate** pSelected)
 {
     bool fSelected = false;
     uint256 hashBest = 0;
-    *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+    *pSelected = NULL;
+    BOOST_FOREACH(CModifierCandidate& item, vSortedByTimestamp)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        if (fSelected && item.nTime > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (item.fSelected)
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        CDataStream ss(SER_GETHASH, 0);
-        ss << pindex->hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-        if (fSelected && hashSelection < hashBest)
+        if (fSelected && item.hashSelection < hashBest)
         {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = item.hashSelection;
+            *pSelected = &item;
         }
         else if (!fSelected)
         {
             fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = item.hashSelection;
+            *pSelected = &item;
         }
     }
     LogPrint("stakemodifier", "SelectBlockFromCandidates: selection hash=%s\n", hashBest.ToString());
     return fSelected;
 }
 
+// Modifiers computed for a given previous block, so sibling blocks racing for
+// the same height do not repeat the 64 round selection. Guarded by cs_main.
+static map<uint256, uint64_t> mapModifierCache;
+static const unsigned int MAX_MODIFIER_CACHE = 64;
+
 // Stake Modifier (hash modifier of proof-of-stake):
 // The purpose of stake modifier is to prevent a txout (coin) owner from
 // computing future proof-of-stake generated by this txout at the time
@@ -127,8 +138,17 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     if (nModifierTime / nModifierInterval >= pindexPrev->GetBlockTime() / nModifierInterval)
         return true;
 
+    uint256 hashPrev = pindexPrev->GetBlockHash();
+    map<uint256, uint64_t>::const_iterator mi = mapModifierCache.find(hashPrev);
+    if (mi != mapModifierCache.end())
+    {
+        nStakeModifier = mi->second;
+        fGeneratedStakeModifier = true;
+        return true;
+    }
+
     // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
+    vector<CModifierCandidate> vSortedByTimestamp;
 
     if(pindexBest->nHeight >= HARD_FORK_BLOCK){
         vSortedByTimestamp.reserve(64 * nModifierInterval / TARGET_SPACING_FORK);
@@ -141,7 +161,24 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        CModifierCandidate candidate;
+        candidate.nTime = pindex->GetBlockTime();
+        candidate.hashBlock = pindex->GetBlockHash();
+        candidate.pindex = pindex;
+        candidate.fSelected = false;
+
+        // compute the selection hash by hashing its proof-hash and the
+        // previous proof-of-stake modifier
+        CDataStream ss(SER_GETHASH, 0);
+        ss << pindex->hashProof << nStakeModifier;
+        candidate.hashSelection = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (pindex->IsProofOfStake())
+            candidate.hashSelection >>= 32;
+
+        vSortedByTimestamp.push_back(candidate);
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
@@ -151,18 +188,21 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
+    vector<const CBlockIndex*> vSelectedBlocks;
     for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        CModifierCandidate* pSelected;
+        if (!SelectBlockFromCandidates(vSortedByTimestamp, nSelectionIntervalStop, &pSelected))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
+        pindex = pSelected->pindex;
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
         // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
+        pSelected->fSelected = true;
+        vSelectedBlocks.push_back(pindex);
         LogPrint("stakemodifier", "ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n", nRound, DateTimeStrFormat(nSelectionIntervalStop), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
 
@@ -180,16 +220,20 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        BOOST_FOREACH(const CBlockIndex* pindexSelected, vSelectedBlocks)
         {
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            strSelectionMap.replace(pindexSelected->nHeight - nHeightFirstCandidate, 1, pindexSelected->IsProofOfStake()? "S" : "W");
         }
         LogPrintf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap);
     }
     LogPrint("stakemodifier", "ComputeNextStakeModifier: new modifier=0x%016x time=%s\n", nStakeModifierNew, DateTimeStrFormat(pindexPrev->GetBlockTime()));
 
+    if (mapModifierCache.size() >= MAX_MODIFIER_CACHE)
+        mapModifierCache.clear();
+    mapModifierCache[hashPrev] = nStakeModifierNew;
+
     nStakeModifier = nStakeModifierNew;
     fGeneratedStakeModifier = true;
     return true;
@@ -221,15 +265,19 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     }
 
     // Base target
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative, fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
-    // Weighted target
+    // Weighted target. A negative target is met by no hash and one past 2^256
+    // by every hash; targetProofOfStake keeps the low 256 bits as before.
     int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    CBigNum bnWeight = CBigNum(nValueIn);
+    arith_uint256 bnWeight = (uint64_t)std::max(nValueIn, (int64_t)0);
+    bool fTargetNegative = fNegative && nValueIn != 0;
+    bool fTargetOverflow = !fTargetNegative && nValueIn > 0 && (fOverflow || bnTarget > ~arith_uint256(0) / bnWeight);
     bnTarget *= bnWeight;
 
-    targetProofOfStake = bnTarget.getuint256();
+    targetProofOfStake = ArithToUint256(bnTarget);
 
     uint64_t nStakeModifier = pindexPrev->nStakeModifier;
     uint256 bnStakeModifierV2 = pindexPrev->bnStakeModifierV2;
@@ -261,7 +309,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnTarget){
+    if (fTargetNegative || (!fTargetOverflow && UintToArith256(hashProofOfStake) > bnTarget)){
          return false;
     }
 
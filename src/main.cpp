@@ -6,6 +6,7 @@
 #include "main.h"
 
 #include "addrman.h"
+#include "blockencodings.h"
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -28,6 +29,9 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+
+#include <deque>
+
 using namespace std;
 using namespace boost;
 
@@ -45,7 +49,7 @@ CTxMemPool mempool;
 map<uint256, CBlockIndex*> mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
-CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
+arith_uint256 bnProofOfStakeLimit(~arith_uint256(0) >> 20);
 
 unsigned int nStakeMinAge = 24 * 60 * 60; // 24 hours
 unsigned int nModifierInterval = 2 * 60; // time to elapse before new modifier is computed
@@ -161,15 +165,59 @@ struct CNodeState {
     int nMisbehavior;
     bool fShouldBan;
     std::string name;
+    // Number of header chain blocks requested from this peer and not yet received
+    int nBlocksInFlight;
+    // Time until which the peer gets no new block requests after stalling
+    int64_t nStallingUntil;
+    // Time the outstanding getheaders was sent, 0 if none
+    int64_t nHeadersRequestTime;
+    // The last headers reply was full, more can be asked for
+    bool fHeadersMore;
+    // The peer did not answer getheaders, it is synced with getblocks instead
+    bool fHeadersFailed;
+    // Compact block waiting for the blocktxn reply of this peer, and when it was requested
+    uint256 hashPartialBlock;
+    boost::shared_ptr<CPartialBlock> partialBlock;
+    int64_t nPartialBlockTime;
+    // We sent sendcmpct, compact blocks from this peer are processed
+    bool fSentSendCmpct;
+    // The peer sent sendcmpct, new blocks are pushed to it as compact blocks
+    bool fPreferCmpct;
 
     CNodeState() {
         nMisbehavior = 0;
         fShouldBan = false;
+        nBlocksInFlight = 0;
+        nStallingUntil = 0;
+        nHeadersRequestTime = 0;
+        fHeadersMore = false;
+        fHeadersFailed = false;
+        nPartialBlockTime = 0;
+        fSentSendCmpct = false;
+        fPreferCmpct = false;
     }
 };
 
 map<NodeId, CNodeState> mapNodeState;
 
+// Headers-first sync. Headers received from the sync peer are kept as a plan
+// of the blocks following our best block; the bodies are then requested from
+// all suitable peers within a moving window and validated as they connect.
+// The plan is not trusted: proof-of-stake headers cannot be checked without
+// their coinstake, so only linkage and hardened checkpoints are verified and
+// the plan is dropped when it keeps stalling. All of this requires cs_main.
+struct CBlockInFlight {
+    NodeId nodeid;
+    int64_t nTime;
+};
+
+std::deque<uint256> dequeHeaderChain; // hashes following nHeaderChainStart - 1
+map<uint256, int> mapHeaderChainHeight;
+int nHeaderChainStart = 0;
+map<uint256, CBlockInFlight> mapBlocksInFlight;
+set<uint256> setBlocksQueued; // received, waiting for the block check threads
+int nBlockStalls = 0;
+
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
@@ -195,8 +243,168 @@ void InitializeNode(NodeId nodeid, const CNode *pnode) {
 
 void FinalizeNode(NodeId nodeid) {
     LOCK(cs_main);
+    for (map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); )
+    {
+        if ((*it).second.nodeid == nodeid)
+            mapBlocksInFlight.erase(it++);
+        else
+            ++it;
+    }
     mapNodeState.erase(nodeid);
 }
+
+void ClearHeaderChain() {
+    dequeHeaderChain.clear();
+    mapHeaderChainHeight.clear();
+    nHeaderChainStart = 0;
+    nBlockStalls = 0;
+}
+
+// Mark a header chain block as no longer outstanding
+void MarkBlockReceived(const uint256& hash) {
+    map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.find(hash);
+    if (it == mapBlocksInFlight.end())
+        return;
+    CNodeState *state = State((*it).second.nodeid);
+    if (state && state->nBlocksInFlight > 0)
+        state->nBlocksInFlight--;
+    mapBlocksInFlight.erase(it);
+}
+
+// Drop the part of the plan our best chain has caught up with. If the best
+// chain went elsewhere the plan is stale and is thrown away.
+void PruneHeaderChain() {
+    while (!dequeHeaderChain.empty() && nHeaderChainStart <= nBestHeight)
+    {
+        const uint256& hash = dequeHeaderChain.front();
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+        {
+            LogPrint("net", "header chain diverged from best chain at height %d, dropping it\n", nHeaderChainStart);
+            ClearHeaderChain();
+            return;
+        }
+        MarkBlockReceived(hash);
+        mapHeaderChainHeight.erase(hash);
+        dequeHeaderChain.pop_front();
+        nHeaderChainStart++;
+        // only stalls without any progress in between count against the plan
+        nBlockStalls = 0;
+    }
+}
+
+// Append headers to the plan. Returns false if a header does not connect.
+bool AcceptHeaders(const vector<CBlock>& vHeaders) {
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+    {
+        uint256 hash = header.GetHash();
+        int nHeight;
+        map<uint256, int>::iterator mh = mapHeaderChainHeight.find(header.hashPrevBlock);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+        if (mh != mapHeaderChainHeight.end())
+        {
+            nHeight = (*mh).second + 1;
+            // a fork of the plan replaces everything after its parent
+            while (nHeaderChainStart + (int)dequeHeaderChain.size() > nHeight)
+            {
+                MarkBlockReceived(dequeHeaderChain.back());
+                mapHeaderChainHeight.erase(dequeHeaderChain.back());
+                dequeHeaderChain.pop_back();
+            }
+        }
+        else if (mi != mapBlockIndex.end() && (*mi).second->IsInMainChain())
+        {
+            if (mapBlockIndex.count(hash))
+                continue;
+            nHeight = (*mi).second->nHeight + 1;
+            ClearHeaderChain();
+            nHeaderChainStart = nHeight;
+        }
+        else
+            return false;
+
+        if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+            return false;
+        if (!Checkpoints::CheckHardened(nHeight, hash))
+            return false;
+        if (dequeHeaderChain.size() >= MAX_HEADERS_AHEAD + MAX_HEADERS_RESULTS)
+            break;
+
+        dequeHeaderChain.push_back(hash);
+        mapHeaderChainHeight[hash] = nHeight;
+    }
+    return true;
+}
+
+void PushGetHeaders(CNode* pnode, CNodeState* state) {
+    CBlockLocator locator(pindexBest);
+    if (!dequeHeaderChain.empty())
+        locator.PushFront(dequeHeaderChain.back());
+    pnode->PushMessage("getheaders", locator, uint256(0));
+    state->nHeadersRequestTime = GetTime();
+    state->fHeadersMore = false;
+}
+
+bool CanFetchBlocksFrom(const CNode* pnode, const CNodeState* state, int64_t nNow) {
+    return !pnode->fClient && !pnode->fOneShot && !pnode->fDisconnect && pnode->fSuccessfullyConnected &&
+        (pnode->nVersion < NOBLKS_VERSION_START || pnode->nVersion >= NOBLKS_VERSION_END) &&
+        state->nStallingUntil <= nNow && pnode->nStartingHeight > nBestHeight;
+}
+
+// Hand out requests for the next missing blocks of the window to pto and
+// release the requests it let stall, so other peers pick them up.
+void ScheduleBlockDownloads(CNode* pto, CNodeState* state, vector<CInv>& vGetData) {
+    int64_t nNow = GetTime();
+
+    bool fStalled = false;
+    for (map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); )
+    {
+        if ((*it).second.nodeid == pto->GetId() && (*it).second.nTime + BLOCK_STALLING_TIMEOUT < nNow)
+        {
+            fStalled = true;
+            mapBlocksInFlight.erase(it++);
+            state->nBlocksInFlight--;
+        }
+        else
+            ++it;
+    }
+    if (fStalled)
+    {
+        LogPrint("net", "peer=%d is stalling block download, rotating its requests\n", pto->GetId());
+        state->nStallingUntil = nNow + BLOCK_STALL_BACKOFF;
+        if (++nBlockStalls >= MAX_BLOCK_STALLS)
+        {
+            LogPrintf("Header chain keeps stalling, falling back to getblocks\n");
+            ClearHeaderChain();
+            PushGetBlocks(pto, pindexBest, uint256(0));
+        }
+        return;
+    }
+
+    PruneHeaderChain();
+    if (dequeHeaderChain.empty() || !CanFetchBlocksFrom(pto, state, nNow))
+        return;
+
+    int nWindowEnd = std::min(nBestHeight + BLOCK_DOWNLOAD_WINDOW, nHeaderChainStart + (int)dequeHeaderChain.size() - 1);
+    for (int nHeight = std::max(nHeaderChainStart, nBestHeight + 1); nHeight <= nWindowEnd; nHeight++)
+    {
+        if (state->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER || nHeight > pto->nStartingHeight)
+            break;
+        const uint256& hash = dequeHeaderChain[nHeight - nHeaderChainStart];
+        if (mapBlocksInFlight.count(hash) || setBlocksQueued.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        CBlockInFlight inflight;
+        inflight.nodeid = pto->GetId();
+        inflight.nTime = nNow;
+        mapBlocksInFlight[hash] = inflight;
+        state->nBlocksInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+}
+}
+
+bool static IsHeaderChainBlock(const uint256& hash) {
+    return mapHeaderChainHeight.count(hash);
 }
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -205,6 +413,7 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     if (state == NULL)
         return false;
     stats.nMisbehavior = state->nMisbehavior;
+    stats.nBlocksInFlight = state->nBlocksInFlight;
     return true;
 }
 
@@ -585,11 +794,10 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
         // Update the tx's hashBlock
         hashBlock = pblock->GetHash();
 
-        // Locate the transaction
-        for (nIndex = 0; nIndex < (int)pblock->vtx.size(); nIndex++)
-            if (pblock->vtx[nIndex] == *(CTransaction*)this)
-                break;
-        if (nIndex == (int)pblock->vtx.size())
+        // Locate the transaction, by txid against the block's (possibly
+        // already built) merkle tree rather than comparing every transaction
+        nIndex = pblock->GetTxIndex(GetHash());
+        if (nIndex == -1)
         {
             vMerkleBranch.clear();
             nIndex = -1;
@@ -885,6 +1093,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     setValidatedTx.insert(hash);
 
     SyncWithWallets(tx, NULL);
+    mnodeman.SyncTransaction(tx, NULL);
 
     LogPrint("mempool", "AcceptToMemoryPool : accepted %s (poolsz %u)\n",
            hash.ToString(),
@@ -1348,7 +1557,7 @@ void static PruneOrphanBlocks()
     mapOrphanBlocks.erase(hash);
 }
 
-static CBigNum GetProofOfStakeLimit(int nHeight)
+static arith_uint256 GetProofOfStakeLimit(int nHeight)
 {
     return bnProofOfStakeLimit;
 }
@@ -1397,7 +1606,7 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
 
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
-    CBigNum bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : Params().ProofOfWorkLimit();
+    arith_uint256 bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : Params().ProofOfWorkLimit();
 
 
 
@@ -1429,19 +1638,24 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
-    if(pindexBest->nHeight >= HARD_FORK_BLOCK){
-        int64_t nInterval = nTargetTimespan / TARGET_SPACING_FORK;
-        bnNew *= ((nInterval - 1) * TARGET_SPACING_FORK + nActualSpacing + nActualSpacing);
-        bnNew /= ((nInterval + 1) * TARGET_SPACING_FORK);
-    } else {
-        int64_t nInterval = nTargetTimespan / TARGET_SPACING;
-        bnNew *= ((nInterval - 1) * TARGET_SPACING + nActualSpacing + nActualSpacing);
-        bnNew /= ((nInterval + 1) * TARGET_SPACING);
+    arith_uint256 bnNew;
+    bool fNegative, fOverflow;
+    bnNew.SetCompact(pindexPrev->nBits, &fNegative, &fOverflow);
+    int64_t nSpacing = pindexBest->nHeight >= HARD_FORK_BLOCK ? TARGET_SPACING_FORK : TARGET_SPACING;
+    int64_t nInterval = nTargetTimespan / nSpacing;
+    arith_uint256 bnMul = (nInterval - 1) * nSpacing + nActualSpacing + nActualSpacing;
+    arith_uint256 bnDiv = (nInterval + 1) * nSpacing;
+
+    // A product past 2^256 divided by a divisor under 2^16 is past any target limit
+    if (fNegative || fOverflow || bnNew > ~arith_uint256(0) / bnMul)
+        bnNew = bnTargetLimit;
+    else
+    {
+        bnNew *= bnMul;
+        bnNew /= bnDiv;
     }
 
-    if (bnNew <= 0 || bnNew > bnTargetLimit)
+    if (bnNew == 0 || bnNew > bnTargetLimit)
         bnNew = bnTargetLimit;
 
     return bnNew.GetCompact();
@@ -1449,15 +1663,16 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative, fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > Params().ProofOfWorkLimit())
+    if (fNegative || fOverflow || bnTarget == 0 || bnTarget > Params().ProofOfWorkLimit())
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (UintToArith256(hash) > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -1557,7 +1772,7 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 
 
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const
 {
     // FetchInputs can return false either because we just haven't seen some inputs
     // (in which case the transaction should be stored as an orphan)
@@ -1772,30 +1987,6 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
     return true;
 }
 
-bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
-{
-    // Disconnect in reverse order
-    for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
-            return false;
-
-    // Update block index on disk without changing it in memory.
-    // The memory index structure will be changed after the db commits.
-    if (pindex->pprev)
-    {
-        CDiskBlockIndex blockindexPrev(pindex->pprev);
-        blockindexPrev.hashNext = 0;
-        if (!txdb.WriteBlockIndex(blockindexPrev))
-            return error("DisconnectBlock() : WriteBlockIndex failed");
-    }
-
-    // ppcoin: clean up wallet after disconnecting coinstake
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, false);
-
-    return true;
-}
-
 bool static BuildAddrIndex(const CScript &script, std::vector<uint160>& addrIds)
 {
     CScript::const_iterator pc = script.begin();
@@ -1830,17 +2021,23 @@ bool static BuildAddrIndex(const CScript &script, std::vector<uint160>& addrIds)
     }
 }
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash) {
-    uint160 addrid = 0;
+bool GetAddrIndexId(const CTxDestination &dest, uint160 &addrId)
+{
+    addrId = 0;
     const CKeyID *pkeyid = boost::get<CKeyID>(&dest);
     if (pkeyid)
-        addrid = static_cast<uint160>(*pkeyid);
-    if (!addrid) {
+        addrId = static_cast<uint160>(*pkeyid);
+    if (!addrId) {
         const CScriptID *pscriptid = boost::get<CScriptID>(&dest);
         if (pscriptid)
-            addrid = static_cast<uint160>(*pscriptid);
+            addrId = static_cast<uint160>(*pscriptid);
     }
-    if (!addrid)
+    return addrId != 0;
+}
+
+bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash) {
+    uint160 addrid;
+    if (!GetAddrIndexId(dest, addrid))
     {
         LogPrintf("FindTransactionsByDestination(): Couldn't parse dest into addrid\n");
         return false;
@@ -1850,56 +2047,205 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
     CTxDB txdb("r");
     if(!txdb.ReadAddrIndex(addrid, vtxhash))
     {
-        LogPrintf("FindTransactionsByDestination(): txdb.ReadAddrIndex failed\n");
+        LogPrint("addrindex", "FindTransactionsByDestination(): no entries for %s\n", addrid.ToString());
         return false;
     }
     return true;
 }
 
-void CBlock::RebuildAddressIndex(CTxDB& txdb)
+// Amounts received and sent per address
+typedef std::map<uint160, std::pair<int64_t, int64_t> > MapAddrDeltas;
+
+// Address index changes of one transaction
+struct CAddrTxChanges
+{
+    MapAddrDeltas mapDeltas;
+    // spent outputs that paid to an indexed address, nHeight is only filled
+    // in when the outputs have to be restored on disconnect
+    std::vector<CAddrUnspentEntry> vSpent;
+};
+
+static void GetScriptAddrIds(const CScript& script, std::set<uint160>& setAddrIds)
+{
+    std::vector<uint160> addrIds;
+    if (script.empty() || !BuildAddrIndex(script, addrIds))
+        return;
+    setAddrIds.insert(addrIds.begin(), addrIds.end());
+}
+
+// Height of the block holding an indexed transaction, -1 when not on the main chain
+static int GetTxIndexHeight(const CTxIndex& txindex)
 {
-    BOOST_FOREACH(CTransaction& tx, vtx)
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return -1;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+        return -1;
+    return (*mi).second->nHeight;
+}
+
+static void GetAddrTxChanges(const CTransaction& tx, const MapPrevTx& mapInputs, bool fSpentHeight, CAddrTxChanges& changes)
+{
+    if (!tx.IsCoinBase())
     {
-        uint256 hashTx = tx.GetHash();
-        // inputs
-        if(!tx.IsCoinBase())
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            MapPrevTx::const_iterator mi = mapInputs.find(txin.prevout.hash);
+            if (mi == mapInputs.end() || txin.prevout.n >= (*mi).second.second.vout.size())
+                continue;
+            const CTxOut& txoutPrev = (*mi).second.second.vout[txin.prevout.n];
+            std::set<uint160> setAddrIds;
+            GetScriptAddrIds(txoutPrev.scriptPubKey, setAddrIds);
+            if (setAddrIds.empty())
+                continue;
+            int nPrevHeight = fSpentHeight ? GetTxIndexHeight((*mi).second.first) : 0;
+            BOOST_FOREACH(const uint160& addrId, setAddrIds)
+            {
+                changes.mapDeltas[addrId].second += txoutPrev.nValue;
+                changes.vSpent.push_back(make_pair(CAddrUnspentKey(addrId, txin.prevout),
+                                                   CAddrUnspentValue(txoutPrev.nValue, txoutPrev.scriptPubKey, nPrevHeight)));
+            }
+        }
+    }
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        std::set<uint160> setAddrIds;
+        GetScriptAddrIds(txout.scriptPubKey, setAddrIds);
+        BOOST_FOREACH(const uint160& addrId, setAddrIds)
+            changes.mapDeltas[addrId].first += txout.nValue;
+    }
+}
+
+static bool GetBlockAddrChanges(CTxDB& txdb, const CBlock& block, bool fSpentHeight, std::vector<CAddrTxChanges>& vChanges)
+{
+    vChanges.resize(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        const CTransaction& tx = block.vtx[i];
+        MapPrevTx mapInputs;
+        if (!tx.IsCoinBase())
         {
-            MapPrevTx mapInputs;
             map<uint256, CTxIndex> mapQueuedChangesT;
             bool fInvalid;
             if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-                return;
+                return error("GetBlockAddrChanges() : FetchInputs failed for %s", tx.GetHash().ToString());
+        }
+        GetAddrTxChanges(tx, mapInputs, fSpentHeight, vChanges[i]);
+    }
+    return true;
+}
+
+// Append (fConnect) or remove the address index entries of a block, move the
+// unspent output records and apply the change to the per address summaries.
+// Summaries are read once per block. Transactions are undone in reverse order
+// so outputs created and spent inside the block end up removed.
+static bool UpdateAddrIndex(CTxDB& txdb, const CBlock& block, int nHeight, const std::vector<CAddrTxChanges>& vChanges, bool fConnect)
+{
+    std::map<uint160, CAddrSummary> mapSummaries;
+    for (unsigned int n = 0; n < vChanges.size(); n++)
+    {
+        unsigned int i = fConnect ? n : vChanges.size() - 1 - n;
+        const CTransaction& tx = block.vtx[i];
+        uint256 hashTx = tx.GetHash();
 
-            MapPrevTx::const_iterator mi;
-            for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
+        BOOST_FOREACH(const CAddrUnspentEntry& spent, vChanges[i].vSpent)
+        {
+            if (fConnect ? !txdb.EraseAddrUnspent(spent.first) : !txdb.WriteAddrUnspent(spent.first, spent.second))
+                return error("UpdateAddrIndex() : failed to update unspent %s", spent.first.outpoint.ToString());
+        }
+        for (unsigned int j = 0; j < tx.vout.size(); j++)
+        {
+            std::set<uint160> setAddrIds;
+            GetScriptAddrIds(tx.vout[j].scriptPubKey, setAddrIds);
+            BOOST_FOREACH(const uint160& addrId, setAddrIds)
             {
-                BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-                {
-                    std::vector<uint160> addrIds;
-                    if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                    {
-                        BOOST_FOREACH(uint160 addrId, addrIds)
-                        {
-                            if(!txdb.WriteAddrIndex(addrId, hashTx))
-                                LogPrintf("RebuildAddressIndex(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                        }
-                    }
-                }
+                CAddrUnspentKey key(addrId, COutPoint(hashTx, j));
+                if (fConnect ? !txdb.WriteAddrUnspent(key, CAddrUnspentValue(tx.vout[j].nValue, tx.vout[j].scriptPubKey, nHeight)) : !txdb.EraseAddrUnspent(key))
+                    return error("UpdateAddrIndex() : failed to update unspent %s", key.outpoint.ToString());
             }
         }
-        // outputs
-        BOOST_FOREACH(const CTxOut &atxout, tx.vout) {
-            std::vector<uint160> addrIds;
-            if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
+
+        for (MapAddrDeltas::const_iterator it = vChanges[i].mapDeltas.begin(); it != vChanges[i].mapDeltas.end(); ++it)
+        {
+            const uint160& addrId = (*it).first;
+            int64_t nReceived = (*it).second.first;
+            int64_t nSent = (*it).second.second;
+
+            CAddrIndexKey key(addrId, nHeight, i);
+            if (fConnect ? !txdb.WriteAddrIndex(key, CAddrIndexValue(hashTx, nReceived, nSent)) : !txdb.EraseAddrIndex(key))
+                return error("UpdateAddrIndex() : failed to update entry of %s for tx %s", addrId.ToString(), hashTx.ToString());
+
+            std::map<uint160, CAddrSummary>::iterator si = mapSummaries.find(addrId);
+            if (si == mapSummaries.end())
             {
-                BOOST_FOREACH(uint160 addrId, addrIds)
-                {
-                    if(!txdb.WriteAddrIndex(addrId, hashTx))
-                        LogPrintf("RebuildAddressIndex(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                }
+                si = mapSummaries.insert(make_pair(addrId, CAddrSummary())).first;
+                txdb.ReadAddrSummary(addrId, (*si).second);
+            }
+            CAddrSummary& summary = (*si).second;
+            if (fConnect)
+            {
+                summary.nReceived += nReceived;
+                summary.nSent += nSent;
+                summary.nBalance += nReceived - nSent;
+                summary.nTxCount++;
+            }
+            else
+            {
+                summary.nReceived -= nReceived;
+                summary.nSent -= nSent;
+                summary.nBalance -= nReceived - nSent;
+                if (summary.nTxCount > 0)
+                    summary.nTxCount--;
             }
         }
     }
+
+    for (std::map<uint160, CAddrSummary>::const_iterator si = mapSummaries.begin(); si != mapSummaries.end(); ++si)
+        if (!txdb.WriteAddrSummary((*si).first, (*si).second))
+            return error("UpdateAddrIndex() : failed to write summary of %s", (*si).first.ToString());
+
+    return true;
+}
+
+bool CBlock::RebuildAddressIndex(CTxDB& txdb, const CBlockIndex* pindex)
+{
+    std::vector<CAddrTxChanges> vChanges;
+    if (!GetBlockAddrChanges(txdb, *this, false, vChanges))
+        return false;
+    return UpdateAddrIndex(txdb, *this, pindex->nHeight, vChanges, true);
+}
+
+bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
+{
+    // Remove address index entries while the spent outputs are still indexed
+    if (GetBoolArg("-addrindex", false))
+    {
+        std::vector<CAddrTxChanges> vAddrChanges;
+        if (!GetBlockAddrChanges(txdb, *this, true, vAddrChanges) || !UpdateAddrIndex(txdb, *this, pindex->nHeight, vAddrChanges, false))
+            return error("DisconnectBlock() : UpdateAddrIndex failed");
+    }
+
+    // Disconnect in reverse order
+    for (int i = vtx.size()-1; i >= 0; i--)
+        if (!vtx[i].DisconnectInputs(txdb))
+            return false;
+
+    // Update block index on disk without changing it in memory.
+    // The memory index structure will be changed after the db commits.
+    if (pindex->pprev)
+    {
+        CDiskBlockIndex blockindexPrev(pindex->pprev);
+        blockindexPrev.hashNext = 0;
+        if (!txdb.WriteBlockIndex(blockindexPrev))
+            return error("DisconnectBlock() : WriteBlockIndex failed");
+    }
+
+    // ppcoin: clean up wallet after disconnecting coinstake
+    BOOST_FOREACH(CTransaction& tx, vtx)
+        SyncWithWallets(tx, this, false);
+
+    return true;
 }
 
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
@@ -1926,9 +2272,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     int64_t nStakeReward = 0;
     unsigned int nSigOps = 0;
     int nInputs = 0;
+    bool fAddrIndex = !fJustCheck && GetBoolArg("-addrindex", false);
+    std::vector<CAddrTxChanges> vAddrChanges;
+    if (fAddrIndex)
+        vAddrChanges.resize(vtx.size());
 
-    BOOST_FOREACH(CTransaction& tx, vtx)
+    for (unsigned int i = 0; i < vtx.size(); i++)
     {
+        CTransaction& tx = vtx[i];
         uint256 hashTx = tx.GetHash();
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
@@ -1970,6 +2321,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
                 return false;
         }
 
+        if (fAddrIndex)
+            GetAddrTxChanges(tx, mapInputs, false, vAddrChanges[i]);
+
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
@@ -2011,54 +2365,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
-    if(GetBoolArg("-addrindex", false))
-    {
-        // Write Address Index
-        BOOST_FOREACH(CTransaction& tx, vtx)
-        {
-            uint256 hashTx = tx.GetHash();
-            // inputs
-            if(!tx.IsCoinBase())
-            {
-                MapPrevTx mapInputs;
-                map<uint256, CTxIndex> mapQueuedChangesT;
-                bool fInvalid;
-                if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-                    return false;
-
-                MapPrevTx::const_iterator mi;
-                for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-                {
-                    BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-                    {
-                        std::vector<uint160> addrIds;
-                        if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                        {
-                            BOOST_FOREACH(uint160 addrId, addrIds)
-                            {
-                                if(!txdb.WriteAddrIndex(addrId, hashTx))
-                                    LogPrintf("ConnectBlock(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                            }
-                        }
-                    }
-                }
-            }
-
-            // outputs
-            BOOST_FOREACH(const CTxOut &atxout, tx.vout)
-            {
-                std::vector<uint160> addrIds;
-                if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                {
-                    BOOST_FOREACH(uint160 addrId, addrIds)
-                    {
-                        if(!txdb.WriteAddrIndex(addrId, hashTx))
-                            LogPrintf("ConnectBlock(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                    }
-                }
-            }
-        }
-    }
+    if (fAddrIndex && !UpdateAddrIndex(txdb, *this, pindex->nHeight, vAddrChanges, true))
+        return error("ConnectBlock() : UpdateAddrIndex failed");
 
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
@@ -2070,9 +2378,12 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : WriteBlockIndex failed");
     }
 
-    // Watch for transactions paying to me
+    // Watch for transactions paying to me and for spent masternode collateral
     BOOST_FOREACH(CTransaction& tx, vtx)
+    {
         SyncWithWallets(tx, this);
+        mnodeman.SyncTransaction(tx, this);
+    }
 
 
 
@@ -2448,11 +2759,10 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     return true;
 }
 
-bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) const
+// Checks that depend on nothing but the block itself, safe to run off the
+// message thread. Sets fChecked when every check ran and passed.
+bool CBlock::CheckBlockContextFree(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) const
 {
-    // These are checks that are independent of context
-    // that can be verified before saving an orphan block.
-
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return DoS(100, error("CheckBlock() : size limits failed"));
@@ -2461,10 +2771,6 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     if (fCheckPOW && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
         return DoS(50, error("CheckBlock() : proof of work failed"));
 
-    // Check timestamp
-    if (GetBlockTime() > FutureDrift(GetAdjustedTime()))
-        return error("CheckBlock() : block timestamp too far in the future");
-
     // First transaction must be coinbase, the rest must not be
     if (vtx.empty() || !vtx[0].IsCoinBase())
         return DoS(100, error("CheckBlock() : first tx is not coinbase"));
@@ -2490,6 +2796,55 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     if (fCheckSig && !CheckBlockSignature())
         return DoS(100, error("CheckBlock() : bad proof-of-stake block signature"));
 
+    // Check transactions
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        if (!tx.CheckTransaction())
+            return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
+
+        // ppcoin: check transaction timestamp
+        if (GetBlockTime() < (int64_t)tx.nTime)
+            return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
+    }
+
+    // The merkle tree starts with the transaction hashes, so build it once
+    // and take the txids for the duplicate check from there
+    uint256 hashMerkleRootBuilt = BuildMerkleTree();
+
+    // Check for duplicate txids. This is caught by ConnectInputs(),
+    // but catching it earlier avoids a potential DoS attack:
+    set<uint256> uniqueTx(vMerkleTree.begin(), vMerkleTree.begin() + vtx.size());
+    if (uniqueTx.size() != vtx.size())
+        return DoS(100, error("CheckBlock() : duplicate transaction"));
+
+    unsigned int nSigOps = 0;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        nSigOps += GetLegacySigOpCount(tx);
+    }
+    if (nSigOps > MAX_BLOCK_SIGOPS)
+        return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
+
+    // Check merkle root
+    if (fCheckMerkleRoot && hashMerkleRoot != hashMerkleRootBuilt)
+        return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
+
+    if (fCheckPOW && fCheckMerkleRoot && fCheckSig)
+        fChecked = true;
+    return true;
+}
+
+bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) const
+{
+    // These are checks that are independent of context
+    // that can be verified before saving an orphan block.
+
+    if (!fChecked && !CheckBlockContextFree(fCheckPOW, fCheckMerkleRoot, fCheckSig))
+        return false;
+
+    // Check timestamp
+    if (GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("CheckBlock() : block timestamp too far in the future");
 
 // ----------- instantX transaction scanning -----------
 
@@ -2579,48 +2934,6 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         if(fDebug) { LogPrintf("CheckBlock() : Is initial download, skipping masternode payment check %d\n", pindexBest->nHeight+1); }
     }
 
-
-
-
-
-
-
-
-
-    // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        if (!tx.CheckTransaction())
-            return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
-
-        // ppcoin: check transaction timestamp
-        if (GetBlockTime() < (int64_t)tx.nTime)
-            return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
-    }
-
-    // Check for duplicate txids. This is caught by ConnectInputs(),
-    // but catching it earlier avoids a potential DoS attack:
-    set<uint256> uniqueTx;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        uniqueTx.insert(tx.GetHash());
-    }
-    if (uniqueTx.size() != vtx.size())
-        return DoS(100, error("CheckBlock() : duplicate transaction"));
-
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        nSigOps += GetLegacySigOpCount(tx);
-    }
-    if (nSigOps > MAX_BLOCK_SIGOPS)
-        return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
-
-    // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
-        return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
-
-
     return true;
 }
 
@@ -2717,10 +3030,33 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers supporting compact blocks get the block pushed right away
+        // instead of an inv followed by a full block download
+        CInv inv(MSG_BLOCK, hash);
+        CSharedMessage msgCmpctBlock;
+        bool fCompact = !IsInitialBlockDownload();
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            CNodeState *state = State(pnode->GetId());
+            if (fCompact && state && state->fPreferCmpct && pnode->fSuccessfullyConnected)
+            {
+                if (pnode->HasInventoryKnown(inv))
+                    continue;
+                if (!msgCmpctBlock)
+                {
+                    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    ss << CBlockHeaderAndShortTxIDs(*this);
+                    msgCmpctBlock = MakeSharedMessage("cmpctblock", ss);
+                }
+                pnode->PushSharedMessage(msgCmpctBlock);
+                pnode->AddInventoryKnown(inv);
+            }
+            else
+                pnode->PushInventory(inv);
+        }
     }
 
     return true;
@@ -2728,13 +3064,16 @@ bool CBlock::AcceptBlock()
 
 uint256 CBlockIndex::GetBlockTrust() const
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative, fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
-    if (bnTarget <= 0)
+    if (fNegative || fOverflow || bnTarget == 0)
         return 0;
 
-    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+    // 2^256 / (target+1) does not fit in 256 bits, but it is equal to
+    // ~target / (target+1) + 1 for any target below 2^256 - 1
+    return ArithToUint256((~bnTarget / (bnTarget + 1)) + 1);
 }
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
@@ -2775,6 +3114,38 @@ void Misbehaving(NodeId pnode, int howmuch)
         LogPrintf("Misbehaving: %s (%d -> %d)\n", state->name.c_str(), state->nMisbehavior-howmuch, state->nMisbehavior);
 }
 
+// Complete a compact block with the transactions the peer sent and process
+// it. A reconstruction that does not match the merkle root is not the peer's
+// fault (short ID collision), the full block is requested instead.
+bool ProcessCompactBlock(CNode* pfrom, const CPartialBlock& partialBlock, const vector<CTransaction>& vMissing)
+{
+    uint256 hashBlock = partialBlock.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+
+    CBlock block;
+    CPartialBlock::ReadStatus status = partialBlock.FillBlock(block, vMissing);
+    if (status == CPartialBlock::READ_INVALID)
+    {
+        Misbehaving(pfrom->GetId(), 20);
+        return error("ProcessCompactBlock() : transaction count mismatch for block %s", hashBlock.ToString());
+    }
+    if (status == CPartialBlock::READ_FAILED)
+    {
+        LogPrint("net", "compact block %s reconstruction failed, requesting full block\n", hashBlock.ToString());
+        pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+        return true;
+    }
+
+    LogPrint("net", "reconstructed compact block %s\n", hashBlock.ToString());
+    MarkBlockReceived(hashBlock);
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
+    if (fSecMsgEnabled)
+        SecureMsgScanBlock(block);
+    return true;
+}
+
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
     AssertLockHeld(cs_main);
@@ -2848,12 +3219,16 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             if (pblock->IsProofOfStake())
                 setStakeSeenOrphan.insert(pblock->GetProofOfStake());
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
-            // ppcoin: getblocks may not obtain the ancestor block rejected
-            // earlier by duplicate-stake check so we ask for it again directly
-            if (!IsInitialBlockDownload())
-                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+            // Ask this guy to fill in what we're missing, unless the block is
+            // part of the header chain whose gaps are being downloaded anyway
+            if (!IsHeaderChainBlock(hash))
+            {
+                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
+                // ppcoin: getblocks may not obtain the ancestor block rejected
+                // earlier by duplicate-stake check so we ask for it again directly
+                if (!IsInitialBlockDownload())
+                    pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+            }
         }
         return true;
     }
@@ -2931,6 +3306,143 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     return true;
 }
 
+// Hand a block received from a peer to ProcessBlock and settle the peer's
+// score. Called with cs_main held, either straight from the "block" message
+// or once the block check threads are done with it.
+static void ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    AssertLockHeld(cs_main);
+
+    CInv inv(MSG_BLOCK, block.GetHash());
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
+    if (fSecMsgEnabled)
+        SecureMsgScanBlock(block);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Block check threads
+//
+// During initial download the context-free part of CheckBlock (transaction
+// checks, duplicate txids, sigops, merkle root and block signature) runs on
+// worker threads, overlapping with the message thread connecting earlier
+// blocks. Blocks leave the queue in arrival order, so ProcessBlock sees them
+// in the same order as without the threads.
+//
+
+namespace {
+struct CQueuedBlock
+{
+    CBlock block;
+    CNode* pfrom; // referenced until the block is processed
+    bool fDone;
+};
+
+boost::mutex csBlockCheck;
+boost::condition_variable condBlockCheck;
+boost::condition_variable condBlockChecked;
+std::deque<CQueuedBlock*> queueBlockArrived;  // all queued blocks, arrival order
+std::deque<CQueuedBlock*> queueBlockUnchecked; // not yet picked up by a thread
+int nBlockCheckThreads = 0;
+}
+
+static void ThreadBlockCheck()
+{
+    RenameThread("transfer-blockcheck");
+
+    while (true)
+    {
+        CQueuedBlock* pitem;
+        {
+            boost::unique_lock<boost::mutex> lock(csBlockCheck);
+            while (queueBlockUnchecked.empty())
+                condBlockCheck.wait(lock);
+            pitem = queueBlockUnchecked.front();
+            queueBlockUnchecked.pop_front();
+        }
+
+        // A failing block goes through the full CheckBlock again on the
+        // message thread, which scores the peer
+        if (!pitem->block.CheckBlockContextFree())
+            pitem->block.nDoS = 0;
+
+        boost::unique_lock<boost::mutex> lock(csBlockCheck);
+        pitem->fDone = true;
+        condBlockChecked.notify_all();
+    }
+}
+
+void StartBlockCheckThreads(boost::thread_group& threadGroup, int nThreads)
+{
+    nBlockCheckThreads = nThreads;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(&ThreadBlockCheck);
+    LogPrintf("Using %d threads for block checks during initial download\n", nThreads);
+}
+
+static void ProcessCheckedBlocks();
+
+// Queue a block for the check threads, false if it should be processed directly.
+// A block never goes around the queue: once it holds blocks, new ones are
+// queued behind them, and a full queue is worked off first. Requires cs_main.
+static bool QueueBlockCheck(CNode* pfrom, const CBlock& block)
+{
+    if (nBlockCheckThreads == 0)
+        return false;
+
+    boost::unique_lock<boost::mutex> lock(csBlockCheck);
+    if (queueBlockArrived.empty() && !IsInitialBlockDownload())
+        return false;
+
+    while (queueBlockArrived.size() >= MAX_BLOCK_CHECK_QUEUE)
+    {
+        while (!queueBlockArrived.front()->fDone)
+            condBlockChecked.wait(lock);
+        lock.unlock();
+        ProcessCheckedBlocks();
+        lock.lock();
+    }
+
+    setBlocksQueued.insert(block.GetHash());
+
+    CQueuedBlock* pitem = new CQueuedBlock();
+    pitem->block = block;
+    pitem->pfrom = pfrom->AddRef();
+    pitem->fDone = false;
+    queueBlockArrived.push_back(pitem);
+    queueBlockUnchecked.push_back(pitem);
+    condBlockCheck.notify_one();
+    return true;
+}
+
+// Process the checked blocks at the head of the queue
+static void ProcessCheckedBlocks()
+{
+    std::vector<CQueuedBlock*> vChecked;
+    {
+        boost::unique_lock<boost::mutex> lock(csBlockCheck);
+        while (!queueBlockArrived.empty() && queueBlockArrived.front()->fDone)
+        {
+            vChecked.push_back(queueBlockArrived.front());
+            queueBlockArrived.pop_front();
+        }
+    }
+    if (vChecked.empty())
+        return;
+
+    LOCK(cs_main);
+    BOOST_FOREACH(CQueuedBlock* pitem, vChecked)
+    {
+        setBlocksQueued.erase(pitem->block.GetHash());
+        if (!fImporting && !fReindex)
+            ProcessReceivedBlock(pitem->pfrom, pitem->block);
+        pitem->pfrom->Release();
+        delete pitem;
+    }
+}
+
 #ifdef ENABLE_WALLET
 // novacoin: attempt to generate suitable proof-of-stake
 bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
@@ -3416,6 +3928,31 @@ void static ProcessGetData(CNode* pfrom)
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
+                    // Old blocks are served from what is left of the upload budget
+                    // and the peer's rate, recent ones always go out
+                    bool fHistorical = pindexBest->GetBlockTime() - (*mi).second->GetBlockTime() > HISTORICAL_BLOCK_AGE;
+                    if (fHistorical && CNode::OutboundTargetReached(true))
+                    {
+                        // Refuse the first request, disconnect peers that keep asking
+                        if (pfrom->fHistoricalRefused)
+                        {
+                            LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                            pfrom->fDisconnect = true;
+                            break;
+                        }
+                        LogPrint("net", "historical block serving limit reached, not sending block %s to peer=%d\n", inv.hash.ToString(), pfrom->GetId());
+                        pfrom->fHistoricalRefused = true;
+                        continue;
+                    }
+                    int64_t nTokensDue = fHistorical ? pfrom->GetUploadTokensDue() : 0;
+                    if (nTokensDue != 0)
+                    {
+                        // Over its upload rate, answer the request once the bucket refills
+                        pfrom->nGetDataDelayedUntil = nTokensDue;
+                        it--;
+                        break;
+                    }
+
                     CBlock block;
                     block.ReadFromDisk((*mi).second);
                     pfrom->PushMessage("block", block);
@@ -3438,15 +3975,14 @@ void static ProcessGetData(CNode* pfrom)
                 if(fDebug) LogPrintf("ProcessGetData -- Starting \n");
                 // Send stream from relay memory
                 bool pushed = false;
-                /*{
+                if (inv.type == MSG_TX) {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        if(fDebug) LogPrintf("ProcessGetData -- pushed = true Rest will fail\n");
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
-                }*/
+                }
                 if (!pushed && inv.type == MSG_TX) {
 
                     CTransaction tx;
@@ -3604,6 +4140,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->PushMessage("verack");
         pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
+        // Ask for new blocks as compact blocks, only announcements we asked for are processed
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+        {
+            pfrom->PushMessage("sendcmpct");
+            LOCK(cs_main);
+            State(pfrom->GetId())->fSentSendCmpct = true;
+        }
+
         if (!pfrom->fInbound)
         {
             // Advertise our address
@@ -3666,6 +4210,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "sendcmpct")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferCmpct = true;
+    }
+
+
     else if (strCommand == "addr")
     {
         vector<CAddress> vAddr;
@@ -3765,10 +4316,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave) {
-                if (!fImporting)
+                if (!fImporting && !(inv.type == MSG_BLOCK && IsHeaderChainBlock(inv.hash)))
                     pfrom->AskFor(inv);
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
+                if (!IsHeaderChainBlock(inv.hash))
+                    PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
             } else if (nInv == nLastBlock) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
@@ -3801,7 +4353,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             LogPrint("net", "received getdata for: %s\n", vInv[0].ToString());
 
         pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
-        ProcessGetData(pfrom);
+        if (!pfrom->IsGetDataDelayed())
+            ProcessGetData(pfrom);
     }
 
 
@@ -3881,6 +4434,36 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers" && !fImporting && !fReindex)
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+
+        LOCK(cs_main);
+        CNodeState *state = State(pfrom->GetId());
+        if (!state || state->nHeadersRequestTime == 0)
+            return true;
+        state->nHeadersRequestTime = 0;
+
+        PruneHeaderChain();
+        if (!AcceptHeaders(vHeaders) || (vHeaders.empty() && dequeHeaderChain.empty() && pfrom->nStartingHeight > nBestHeight))
+        {
+            LogPrint("net", "unusable headers from peer=%d, syncing with getblocks\n", pfrom->GetId());
+            state->fHeadersFailed = true;
+            PushGetBlocks(pfrom, pindexBest, uint256(0));
+            return true;
+        }
+        state->fHeadersMore = (vHeaders.size() == MAX_HEADERS_RESULTS);
+        LogPrint("net", "received %u headers from peer=%d, header chain reaches height %d\n",
+            vHeaders.size(), pfrom->GetId(), nHeaderChainStart + (int)dequeHeaderChain.size() - 1);
+    }
+
+
     else if (strCommand == "tx"|| strCommand == "dstx")
     {
         vector<uint256> vWorkQueue;
@@ -4032,13 +4615,138 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         LOCK(cs_main);
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
-        if (fSecMsgEnabled)
-            SecureMsgScanBlock(block);
+        MarkBlockReceived(hashBlock);
+        if (setBlocksQueued.count(hashBlock))
+            LogPrint("net", "block %s already queued for checking\n", hashBlock.ToString());
+        else if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock) || !QueueBlockCheck(pfrom, block))
+            ProcessReceivedBlock(pfrom, block);
     }
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+
+        LogPrint("net", "received compact block %s (%u txs, %u prefilled)\n", hashBlock.ToString(),
+                 cmpctblock.BlockTxCount(), cmpctblock.vPrefilledTxn.size());
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+
+        LOCK(cs_main);
+
+        CNodeState *state = State(pfrom->GetId());
+        if (!state->fSentSendCmpct)
+        {
+            LogPrint("net", "ignoring unsolicited compact block %s from peer=%d\n", hashBlock.ToString(), pfrom->GetId());
+            return true;
+        }
+
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock) || setBlocksQueued.count(hashBlock))
+            return true;
+
+        // Nothing is reconstructed for a header that doesn't hold up on its own
+        if (!cmpctblock.CheckHeader())
+        {
+            if (cmpctblock.header.nDoS) Misbehaving(pfrom->GetId(), cmpctblock.header.nDoS);
+            return error("cmpctblock : invalid header for compact block %s", hashBlock.ToString());
+        }
+
+        // Without its parent the block would end up as an orphan, fetch it whole
+        if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+        {
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
+
+        boost::shared_ptr<CPartialBlock> partialBlock(new CPartialBlock());
+        CPartialBlock::ReadStatus status = partialBlock->InitData(cmpctblock, mempool);
+        if (status == CPartialBlock::READ_INVALID)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("cmpctblock : invalid compact block %s", hashBlock.ToString());
+        }
+        if (status == CPartialBlock::READ_FAILED)
+        {
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hashBlock;
+        partialBlock->GetMissing(req.vIndexes);
+        if (req.vIndexes.empty())
+            return ProcessCompactBlock(pfrom, *partialBlock, vector<CTransaction>());
+
+        LogPrint("net", "requesting %u missing transactions of compact block %s\n", req.vIndexes.size(), hashBlock.ToString());
+        state->hashPartialBlock = hashBlock;
+        state->partialBlock = partialBlock;
+        state->nPartialBlockTime = GetTime();
+        pfrom->PushMessage("getblocktxn", req);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain() ||
+            (*mi).second->nHeight < nBestHeight - MAX_BLOCKTXN_DEPTH)
+        {
+            LogPrint("net", "ignoring getblocktxn for %s from peer=%d\n", req.blockhash.ToString(), pfrom->GetId());
+            return true;
+        }
+
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return error("getblocktxn : failed to read block %s", req.blockhash.ToString());
+
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("getblocktxn : index %u out of range for block %s", nIndex, req.blockhash.ToString());
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+
+        CNodeState *state = State(pfrom->GetId());
+        if (!state->partialBlock || state->hashPartialBlock != resp.blockhash)
+        {
+            LogPrint("net", "unexpected blocktxn for %s from peer=%d\n", resp.blockhash.ToString(), pfrom->GetId());
+            return true;
+        }
+        boost::shared_ptr<CPartialBlock> partialBlock = state->partialBlock;
+        state->partialBlock.reset();
+        state->hashPartialBlock = 0;
+        state->nPartialBlockTime = 0;
+
+        if (mapBlockIndex.count(resp.blockhash) || mapOrphanBlocks.count(resp.blockhash) || setBlocksQueued.count(resp.blockhash))
+            return true;
+
+        return ProcessCompactBlock(pfrom, *partialBlock, resp.vtx);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -4228,11 +4936,16 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
+    ProcessCheckedBlocks();
+
+    // a getdata held back by the upload rate waits for its tokens, other messages
+    // (pings, masternode and InstantX traffic) go ahead of it meanwhile
+    bool fGetDataDelayed = pfrom->IsGetDataDelayed();
+    if (!pfrom->vRecvGetData.empty() && !fGetDataDelayed)
         ProcessGetData(pfrom);
 
     // this maintains the order of responses
-    if (!pfrom->vRecvGetData.empty()) return fOk;
+    if (!pfrom->vRecvGetData.empty() && !fGetDataDelayed) return fOk;
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
@@ -4327,7 +5040,11 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
+    {
+        for (std::deque<CNetMessage>::iterator itDone = pfrom->vRecvMsg.begin(); itDone != it; ++itDone)
+            pfrom->RecycleRecvMsg(*itDone);
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -4374,12 +5091,31 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!lockMain)
             return true;
 
-        // Start block sync
+        CNodeState &state = *State(pto->GetId());
+
+        // Start block sync, headers first unless the peer did not serve them
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
+            if (!state.fHeadersFailed)
+                PushGetHeaders(pto, &state);
+            else
+                PushGetBlocks(pto, pindexBest, uint256(0));
+        }
+
+        if (state.nHeadersRequestTime && state.nHeadersRequestTime + HEADERS_RESPONSE_TIMEOUT < GetTime()) {
+            LogPrint("net", "peer=%d did not answer getheaders, syncing with getblocks\n", pto->GetId());
+            state.nHeadersRequestTime = 0;
+            state.fHeadersFailed = true;
             PushGetBlocks(pto, pindexBest, uint256(0));
         }
 
+        // Keep the header chain ahead of the download window
+        if (state.fHeadersMore && state.nHeadersRequestTime == 0 && !fImporting && !fReindex) {
+            PruneHeaderChain();
+            if (dequeHeaderChain.size() < MAX_HEADERS_AHEAD)
+                PushGetHeaders(pto, &state);
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -4459,7 +5195,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -4480,9 +5216,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                if (!pto->filterInventoryKnown.contains(inv))
                 {
+                    pto->filterInventoryKnown.insert(inv);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000)
                     {
@@ -4522,6 +5258,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        // A compact block whose blocktxn never came is fetched whole
+        if (state.partialBlock && GetTime() > state.nPartialBlockTime + BLOCKTXN_RESPONSE_TIMEOUT)
+        {
+            LogPrint("net", "blocktxn for %s from peer=%d timed out\n", state.hashPartialBlock.ToString(), pto->GetId());
+            vGetData.push_back(CInv(MSG_BLOCK, state.hashPartialBlock));
+            state.partialBlock.reset();
+            state.hashPartialBlock = 0;
+            state.nPartialBlockTime = 0;
+        }
+        if (!fImporting && !fReindex)
+            ScheduleBlockDownloads(pto, &state, vGetData);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
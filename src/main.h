@@ -60,6 +60,30 @@ static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 10000;
+/** Number of headers sent in one getheaders result */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** How many headers past our best block are kept as the download plan */
+static const unsigned int MAX_HEADERS_AHEAD = 4 * MAX_HEADERS_RESULTS;
+/** Size of the moving window of block bodies fetched in parallel */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Number of blocks that can be requested from a single peer at the same time */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds a requested block may be outstanding before the peer counts as stalling */
+static const int64_t BLOCK_STALLING_TIMEOUT = 30;
+/** Seconds a stalling peer is skipped when handing out block requests */
+static const int64_t BLOCK_STALL_BACKOFF = 120;
+/** Number of stalls after which the header chain is dropped and sync falls back to getblocks */
+static const int MAX_BLOCK_STALLS = 8;
+/** Seconds to wait for a headers reply before falling back to getblocks */
+static const int64_t HEADERS_RESPONSE_TIMEOUT = 60;
+/** Depth up to which getblocktxn requests for compact block transactions are answered */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Seconds to wait for the blocktxn reply to a compact block before fetching the full block */
+static const int64_t BLOCKTXN_RESPONSE_TIMEOUT = 10;
+/** Maximum number of received blocks waiting on the block check threads */
+static const unsigned int MAX_BLOCK_CHECK_QUEUE = 64;
+/** Maximum number of block check threads */
+static const int MAX_BLOCK_CHECK_THREADS = 16;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 0.0001*COIN;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
@@ -148,6 +172,8 @@ CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Start the threads that run context-free block checks during initial download */
+void StartBlockCheckThreads(boost::thread_group& threadGroup, int nThreads);
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -170,6 +196,7 @@ bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree
                         bool* pfMissingInputs, bool fRejectInsaneFee=false, bool isDSTX=false);
 
 
+bool GetAddrIndexId(const CTxDestination &dest, uint160 &addrId);
 bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash);
 
 int GetInputAge(CTxIn& vin);
@@ -184,6 +211,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue);
 
 struct CNodeStateStats {
     int nMisbehavior;
+    int nBlocksInFlight;
 };
 
 
@@ -266,13 +294,19 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+    // memory only: a deserialized transaction is treated as immutable and
+    // remembers its hash; code that edits one must call InvalidateHash()
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+    mutable bool fHashCacheable;
+
     CTransaction()
     {
         SetNull();
     }
 
     CTransaction(int nVersion, unsigned int nTime, const std::vector<CTxIn>& vin, const std::vector<CTxOut>& vout, unsigned int nLockTime)
-        : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0)
+        : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0), fHashCached(false), fHashCacheable(false)
     {
     }
 
@@ -284,6 +318,11 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+        {
+            fHashCached = false;
+            fHashCacheable = true;
+        }
     )
 
     void SetNull()
@@ -294,6 +333,8 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        fHashCached = false;
+        fHashCacheable = false;
     }
 
     bool IsNull() const
@@ -303,7 +344,22 @@ public:
 
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        if (fHashCached)
+            return hashCached;
+        uint256 hash = SerializeHash(*this);
+        if (fHashCacheable)
+        {
+            hashCached = hash;
+            fHashCached = true;
+        }
+        return hash;
+    }
+
+    // Stop caching the hash, for code that modifies a transaction it received
+    void InvalidateHash()
+    {
+        fHashCached = false;
+        fHashCacheable = false;
     }
 
     bool IsCoinBase() const
@@ -317,6 +373,15 @@ public:
         return (vin.size() > 0 && (!vin[0].prevout.IsNull()) && vout.size() >= 2 && vout[0].IsEmpty());
     }
 
+    // Stealth ephemeral keys and narrations ride in OP_RETURN outputs
+    bool HasStealthMetadata() const
+    {
+        BOOST_FOREACH(const CTxOut& txout, vout)
+            if (!txout.scriptPubKey.empty() && txout.scriptPubKey[0] == OP_RETURN)
+                return true;
+        return false;
+    }
+
     // Compute priority, given priority of inputs and (optionally) tx size
     double ComputePriority(double dPriorityInputs, unsigned int nTxSize=0) const;
 
@@ -422,7 +487,7 @@ public:
      @return	Returns true if all inputs are in txdb or mapTestPool
      */
     bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const;
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
@@ -613,6 +678,178 @@ public:
 };
 
 
+/** Key of an address index entry. Every transaction touching an address gets
+ * its own record, so indexing is an append and the history of an address is a
+ * single range scan. Height and position are stored big endian to make LevelDB
+ * return the entries of an address in chain order.
+ */
+class CAddrIndexKey
+{
+public:
+    uint160 addrHash;
+    int nHeight;
+    unsigned int nTxIndex;
+
+    CAddrIndexKey()
+    {
+        addrHash = 0;
+        nHeight = 0;
+        nTxIndex = 0;
+    }
+
+    CAddrIndexKey(const uint160& addrHashIn, int nHeightIn, unsigned int nTxIndexIn)
+    {
+        addrHash = addrHashIn;
+        nHeight = nHeightIn;
+        nTxIndex = nTxIndexIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(addrHash);
+        unsigned char pchPos[8];
+        if (!fRead)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                pchPos[i] = ((unsigned int)nHeight >> (24 - 8 * i)) & 0xff;
+                pchPos[4 + i] = (nTxIndex >> (24 - 8 * i)) & 0xff;
+            }
+        }
+        READWRITE(FLATDATA(pchPos));
+        if (fRead)
+        {
+            CAddrIndexKey* pthis = const_cast<CAddrIndexKey*>(this);
+            pthis->nHeight = 0;
+            pthis->nTxIndex = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                pthis->nHeight = (pthis->nHeight << 8) | pchPos[i];
+                pthis->nTxIndex = (pthis->nTxIndex << 8) | pchPos[4 + i];
+            }
+        }
+    )
+};
+
+/** Amounts one transaction moved in and out of an indexed address */
+class CAddrIndexValue
+{
+public:
+    uint256 txHash;
+    int64_t nReceived;
+    int64_t nSent;
+
+    CAddrIndexValue()
+    {
+        txHash = 0;
+        nReceived = 0;
+        nSent = 0;
+    }
+
+    CAddrIndexValue(const uint256& txHashIn, int64_t nReceivedIn, int64_t nSentIn)
+    {
+        txHash = txHashIn;
+        nReceived = nReceivedIn;
+        nSent = nSentIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txHash);
+        READWRITE(nReceived);
+        READWRITE(nSent);
+    )
+};
+
+/** Running totals of an indexed address, kept next to its entries */
+class CAddrSummary
+{
+public:
+    int64_t nBalance;
+    int64_t nReceived;
+    int64_t nSent;
+    unsigned int nTxCount;
+
+    CAddrSummary()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nBalance);
+        READWRITE(nReceived);
+        READWRITE(nSent);
+        READWRITE(nTxCount);
+    )
+
+    void SetNull()
+    {
+        nBalance = 0;
+        nReceived = 0;
+        nSent = 0;
+        nTxCount = 0;
+    }
+};
+
+typedef std::pair<CAddrIndexKey, CAddrIndexValue> CAddrIndexEntry;
+
+/** Key of an unspent output paying to an indexed address */
+class CAddrUnspentKey
+{
+public:
+    uint160 addrHash;
+    COutPoint outpoint;
+
+    CAddrUnspentKey()
+    {
+        addrHash = 0;
+    }
+
+    CAddrUnspentKey(const uint160& addrHashIn, const COutPoint& outpointIn)
+    {
+        addrHash = addrHashIn;
+        outpoint = outpointIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(addrHash);
+        READWRITE(outpoint);
+    )
+};
+
+class CAddrUnspentValue
+{
+public:
+    int64_t nValue;
+    CScript scriptPubKey;
+    int nHeight;
+
+    CAddrUnspentValue()
+    {
+        nValue = 0;
+        nHeight = 0;
+    }
+
+    CAddrUnspentValue(int64_t nValueIn, const CScript& scriptPubKeyIn, int nHeightIn)
+    {
+        nValue = nValueIn;
+        scriptPubKey = scriptPubKeyIn;
+        nHeight = nHeightIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(scriptPubKey);
+        READWRITE(nHeight);
+    )
+};
+
+typedef std::pair<CAddrUnspentKey, CAddrUnspentValue> CAddrUnspentEntry;
+
+
 
 
 
@@ -646,6 +883,10 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    mutable bool fChecked; // context-free checks already passed
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+    mutable bool fHashCacheable; // header was deserialized, see CTransaction
 
     // Denial-of-service detection:
     mutable int nDoS;
@@ -665,6 +906,14 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
+        if (fRead)
+        {
+            // memory-only state describes the old contents
+            fHashCached = false;
+            fHashCacheable = true;
+            fChecked = false;
+            vMerkleTree.clear();
+        }
 
         // ConnectBlock depends on vtx following header to generate CDiskTxPos
         if (!(nType & (SER_GETHASH|SER_BLOCKHEADERONLY)))
@@ -690,6 +939,9 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        fChecked = false;
+        fHashCached = false;
+        fHashCacheable = false;
         nDoS = 0;
     }
 
@@ -700,10 +952,21 @@ public:
 
     uint256 GetHash() const
     {
-        if (nVersion > 6)
-            return Hash(BEGIN(nVersion), END(nNonce));
-        else
-            return GetPoWHash();
+        if (fHashCached)
+            return hashCached;
+        uint256 hash = nVersion > 6 ? Hash(BEGIN(nVersion), END(nNonce)) : GetPoWHash();
+        if (fHashCacheable)
+        {
+            hashCached = hash;
+            fHashCached = true;
+        }
+        return hash;
+    }
+
+    void InvalidateHash()
+    {
+        fHashCached = false;
+        fHashCacheable = false;
     }
 
     uint256 GetPoWHash() const
@@ -755,27 +1018,41 @@ public:
     uint256 BuildMerkleTree() const
     {
         vMerkleTree.clear();
+        vMerkleTree.reserve(vtx.size() * 2 + 16);
         BOOST_FOREACH(const CTransaction& tx, vtx)
             vMerkleTree.push_back(tx.GetHash());
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
+            // Sibling pairs sit next to each other in the level below, so all
+            // full pairs of a level are hashed as one batch
+            int nPairs = nSize / 2;
+            vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+            SHA256D64(vMerkleTree[j+nSize].begin(), vMerkleTree[j].begin(), nPairs);
+            if (nSize & 1)
+                vMerkleTree[j+nSize+nPairs] = HashMerkleNode(vMerkleTree[j+nSize-1], vMerkleTree[j+nSize-1]);
             j += nSize;
         }
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
     }
 
+    // Position of a transaction in vtx, looked up through the merkle leaves
+    int GetTxIndex(const uint256& hashTx) const
+    {
+        if (vMerkleTree.empty())
+            BuildMerkleTree();
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            if (vMerkleTree[i] == hashTx)
+                return i;
+        return -1;
+    }
+
     std::vector<uint256> GetMerkleBranch(int nIndex) const
     {
         if (vMerkleTree.empty())
             BuildMerkleTree();
         std::vector<uint256> vMerkleBranch;
+        vMerkleBranch.reserve(32);
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
@@ -794,9 +1071,9 @@ public:
         BOOST_FOREACH(const uint256& otherside, vMerkleBranch)
         {
             if (nIndex & 1)
-                hash = Hash(BEGIN(otherside), END(otherside), BEGIN(hash), END(hash));
+                hash = HashMerkleNode(otherside, hash);
             else
-                hash = Hash(BEGIN(hash), END(hash), BEGIN(otherside), END(otherside));
+                hash = HashMerkleNode(hash, otherside);
             nIndex >>= 1;
         }
         return hash;
@@ -886,10 +1163,11 @@ public:
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof);
     bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true) const;
+    bool CheckBlockContextFree(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true) const;
     bool AcceptBlock();
     bool SignBlock(CWallet& keystore, int64_t nFees);
     bool CheckBlockSignature() const;
-    void RebuildAddressIndex(CTxDB& txdb);
+    bool RebuildAddressIndex(CTxDB& txdb, const CBlockIndex* pindex);
 
 private:
     bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
@@ -1260,6 +1538,12 @@ public:
         return vHave.empty();
     }
 
+    // Try hashBlock first, used to continue from a block we only have the header of
+    void PushFront(const uint256& hashBlock)
+    {
+        vHave.insert(vHave.begin(), hashBlock);
+    }
+
     void Set(const CBlockIndex* pindex)
     {
         vHave.clear();
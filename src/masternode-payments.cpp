@@ -330,9 +330,13 @@ void CMasternodePayments::Relay(CMasternodePaymentWinner& winner)
 
     vector<CInv> vInv;
     vInv.push_back(inv);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vInv;
+    CSharedMessage msg = MakeSharedMessage("inv", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes){
-        pnode->PushMessage("inv", vInv);
+        pnode->PushSharedMessage(msg);
     }
 }
 
@@ -78,6 +78,8 @@ CMasternode::CMasternode()
     cacheInputAge = 0;
     cacheInputAgeBlock = 0;
     unitTest = false;
+    fCollateralChecked = false;
+    nListVersion = 0;
     allowFreeTx = true;
     protocolVersion = MIN_PEER_PROTO_VERSION;
     nLastDsq = 0;
@@ -106,6 +108,8 @@ CMasternode::CMasternode(const CMasternode& other)
     cacheInputAge = other.cacheInputAge;
     cacheInputAgeBlock = other.cacheInputAgeBlock;
     unitTest = other.unitTest;
+    fCollateralChecked = other.fCollateralChecked;
+    nListVersion = other.nListVersion;
     allowFreeTx = other.allowFreeTx;
     protocolVersion = other.protocolVersion;
     nLastDsq = other.nLastDsq;
@@ -134,6 +138,8 @@ CMasternode::CMasternode(CService newAddr, CTxIn newVin, CPubKey newPubkey, std:
     cacheInputAge = 0;
     cacheInputAgeBlock = 0;
     unitTest = false;
+    fCollateralChecked = false;
+    nListVersion = 0;
     allowFreeTx = true;
     protocolVersion = protocolVersionIn;
     nLastDsq = 0;
@@ -155,12 +161,18 @@ uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
     if(pindexBest == NULL) return 0;
 
     uint256 hash = 0;
-    uint256 aux = vin.prevout.hash + vin.prevout.n;
 
     if(!GetBlockHash(hash, nBlockHeight)) return 0;
 
-    uint256 hash2 = Hash(BEGIN(hash), END(hash));
-    uint256 hash3 = Hash(BEGIN(hash), END(hash), BEGIN(aux), END(aux));
+    return CalculateScore(hash);
+}
+
+uint256 CMasternode::CalculateScore(const uint256& hashBlock) const
+{
+    uint256 aux = vin.prevout.hash + vin.prevout.n;
+
+    uint256 hash2 = Hash(BEGIN(hashBlock), END(hashBlock));
+    uint256 hash3 = Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(aux), END(aux));
 
     uint256 r = (hash3 > hash2 ? hash3 - hash2 : hash2 - hash3);
 
@@ -171,10 +183,6 @@ void CMasternode::Check()
 {
     if(ShutdownRequested()) return;
 
-    //TODO: Random segfault with this line removed
-    TRY_LOCK(cs_main, lockRecv);
-    if(!lockRecv) return;
-
     //once spent, stop doing the checks
     if(activeState == MASTERNODE_VIN_SPENT) return;
 
@@ -189,14 +197,21 @@ void CMasternode::Check()
         return;
     }
 
-    if(!unitTest){
+    // the collateral is verified against the mempool once (e.g. for entries loaded from mncache.dat),
+    // later spends are pushed to us by CMasternodeMan::SyncTransaction
+    if(!unitTest && !fCollateralChecked){
+        //TODO: Random segfault with this line removed
+        TRY_LOCK(cs_main, lockRecv);
+        if(!lockRecv) return;
+
         CValidationState state;
         CTransaction tx = CTransaction();
         CTxOut vout = CTxOut(DARKSEND_POOL_MAX, darkSendPool.collateralPubKey);
         tx.vin.push_back(vin);
         tx.vout.push_back(vout);
 
-	if(!AcceptableInputs(mempool, tx, false, NULL)){
+        fCollateralChecked = true;
+        if(!AcceptableInputs(mempool, tx, false, NULL)){
             activeState = MASTERNODE_VIN_SPENT;
             return;
         }
@@ -84,6 +84,8 @@ public:
     int nScanningErrorCount;
     int nLastScanningErrorBlockHeight;
     int64_t nLastPaid;
+    bool fCollateralChecked; // not serialized, spends afterwards are reported by CMasternodeMan::SyncTransaction
+    int64_t nListVersion; // not serialized, CMasternodeMan list version of the last announced change
 
 
     CMasternode();
@@ -120,6 +122,8 @@ public:
         swap(first.nScanningErrorCount, second.nScanningErrorCount);
         swap(first.nLastScanningErrorBlockHeight, second.nLastScanningErrorBlockHeight);
         swap(first.nLastPaid, second.nLastPaid);
+        swap(first.fCollateralChecked, second.fCollateralChecked);
+        swap(first.nListVersion, second.nListVersion);
     }
 
     CMasternode& operator=(CMasternode from)
@@ -137,6 +141,8 @@ public:
     }
 
     uint256 CalculateScore(int mod=1, int64_t nBlockHeight=0);
+    // Score against an already resolved block hash, touches no shared state
+    uint256 CalculateScore(const uint256& hashBlock) const;
 
     IMPLEMENT_SERIALIZE
     (
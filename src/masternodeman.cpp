@@ -5,8 +5,12 @@
 #include "core.h"
 #include "util.h"
 #include "addrman.h"
+#include "xxhash/xxhash.h"
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 
 /** Masternode manager */
@@ -35,47 +39,272 @@ struct CompareValueOnlyMN
 // CMasternodeDB
 //
 
+static const char pchMasternodeCacheMagic[8] = {'M', 'N', 'C', 'A', 'C', 'H', 'E', 0};
+static const uint32_t MASTERNODE_CACHE_FORMAT_VERSION = 2;
+
+// set once ThreadLoadMasternodes is done, nothing is written before that; created there
+// because the data directory is not known during static initialization
+static CCriticalSection cs_mndbFlush;
+static boost::scoped_ptr<CMasternodeDB> pmndbFlush;
+
+template<typename T>
+static void AppendRecord(CDataStream& ss, uint32_t nType, const T& obj)
+{
+    CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+    ssPayload << obj;
+
+    CMasternodeCacheRecord rec;
+    rec.nType = nType;
+    rec.nSize = ssPayload.size();
+    rec.nChecksum = XXH32(&ssPayload[0], ssPayload.size(), 0);
+
+    ss << FLATDATA(rec);
+    ss.write(&ssPayload[0], ssPayload.size());
+}
+
 CMasternodeDB::CMasternodeDB()
 {
     pathMN = GetDataDir() / "mncache.dat";
     strMagicMessage = "MasternodeCache";
+    nRecords = 0;
+    fCompactNext = true;
 }
 
-bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
+bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave, bool fCompact)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize addresses, checksum data up to that point, then append csum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage; // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE *file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
+    if (fCompactNext || !boost::filesystem::exists(pathMN))
+        fCompact = true;
+
+    CDataStream ssRecords(SER_DISK, CLIENT_VERSION);
+    std::map<COutPoint, pair<int64_t, int64_t> > mapNowWritten;
+    unsigned int nNewRecords = 0;
+    {
+        LOCK(mnodemanToSave.cs);
+
+        if (nRecords > 2 * mnodemanToSave.vMasternodes.size() + 100)
+            fCompact = true;
+
+        BOOST_FOREACH(const CMasternode& mn, mnodemanToSave.vMasternodes) {
+            pair<int64_t, int64_t> state = make_pair(mn.nListVersion, mn.lastTimeSeen);
+            mapNowWritten[mn.vin.prevout] = state;
+
+            if (!fCompact) {
+                std::map<COutPoint, pair<int64_t, int64_t> >::const_iterator it = mapWritten.find(mn.vin.prevout);
+                if (it != mapWritten.end() && (*it).second == state)
+                    continue;
+            }
+            AppendRecord(ssRecords, RECORD_MASTERNODE, mn);
+            nNewRecords++;
+        }
+
+        if (!fCompact) {
+            std::map<COutPoint, pair<int64_t, int64_t> >::const_iterator it;
+            for (it = mapWritten.begin(); it != mapWritten.end(); ++it) {
+                if (mapNowWritten.count((*it).first)) continue;
+                AppendRecord(ssRecords, RECORD_REMOVED, (*it).first);
+                nNewRecords++;
+            }
+        }
+
+        CDataStream ssState(SER_DISK, CLIENT_VERSION);
+        ssState << mnodemanToSave.mAskedUsForMasternodeList;
+        ssState << mnodemanToSave.mWeAskedForMasternodeList;
+        ssState << mnodemanToSave.mWeAskedForMasternodeListEntry;
+        ssState << mnodemanToSave.nDsqCount;
+        AppendRecord(ssRecords, RECORD_STATE, ssState);
+        nNewRecords++;
     }
-    catch (std::exception &e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+
+    if (fCompact) {
+        // write everything to a temporary file and move it into place
+        unsigned short randv = 0;
+        GetRandBytes((unsigned char *)&randv, sizeof(randv));
+        boost::filesystem::path pathTmp = GetDataDir() / strprintf("mncache.dat.%04x", randv);
+
+        CMasternodeCacheHeader header;
+        memcpy(header.pchMagic, pchMasternodeCacheMagic, sizeof(header.pchMagic));
+        memcpy(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart));
+        header.nFormatVersion = MASTERNODE_CACHE_FORMAT_VERSION;
+
+        FILE *file = fopen(pathTmp.string().c_str(), "wb");
+        CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+        try {
+            fileout << FLATDATA(header);
+            fileout << ssRecords;
+        }
+        catch (std::exception &e) {
+            return error("%s : Serialize or I/O error - %s", __func__, e.what());
+        }
+        FileCommit(fileout.Get());
+        fileout.fclose();
+
+        if (!RenameOver(pathTmp, pathMN))
+            return error("%s : Rename-into-place failed", __func__);
+
+        nRecords = nNewRecords;
+        fCompactNext = false;
+    } else {
+        FILE *file = fopen(pathMN.string().c_str(), "ab");
+        CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s : Failed to open file %s", __func__, pathMN.string());
+
+        try {
+            fileout << ssRecords;
+        }
+        catch (std::exception &e) {
+            // the tail may be torn now, the next write starts a fresh file
+            fCompactNext = true;
+            return error("%s : Serialize or I/O error - %s", __func__, e.what());
+        }
+        FileCommit(fileout.Get());
+        fileout.fclose();
+
+        nRecords += nNewRecords;
     }
-    FileCommit(fileout.Get());
-    fileout.fclose();
+    mapWritten.swap(mapNowWritten);
 
-    LogPrintf("Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrintf("  %s\n", mnodemanToSave.ToString());
+    LogPrint("masternode", "Written %u records to mncache.dat%s  %dms\n", nNewRecords, fCompact ? " (compacted)" : "", GetTimeMillis() - nStart);
 
     return true;
 }
 
 CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
+{
+    int64_t nStart = GetTimeMillis();
+
+    if (!boost::filesystem::exists(pathMN))
+    {
+        error("%s : Failed to open file %s", __func__, pathMN.string());
+        return FileError;
+    }
+
+    std::map<COutPoint, CMasternode> mapLoaded;
+    CDataStream ssState(SER_DISK, CLIENT_VERSION);
+    unsigned int nRead = 0;
+    bool fTorn = false;
+    try {
+        // map the file, records are deserialized straight from the mapping
+        boost::interprocess::file_mapping mapping(pathMN.string().c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+        const char* pbegin = static_cast<const char*>(region.get_address());
+        const char* pend = pbegin + region.get_size();
+
+        CMasternodeCacheHeader header;
+        if (region.get_size() < sizeof(header) || memcmp(pbegin, pchMasternodeCacheMagic, sizeof(header.pchMagic)))
+            return ReadLegacy(mnodemanToLoad);
+        memcpy(&header, pbegin, sizeof(header));
+
+        if (memcmp(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart)))
+        {
+            error("%s : Invalid network magic number", __func__);
+            return IncorrectMagicNumber;
+        }
+        if (header.nFormatVersion != MASTERNODE_CACHE_FORMAT_VERSION)
+        {
+            error("%s : Unknown format version %u", __func__, header.nFormatVersion);
+            return IncorrectFormat;
+        }
+
+        const char* p = pbegin + sizeof(header);
+        while (p + sizeof(CMasternodeCacheRecord) <= pend)
+        {
+            CMasternodeCacheRecord rec;
+            memcpy(&rec, p, sizeof(rec));
+            const char* pdata = p + sizeof(rec);
+            if (rec.nSize > (uint64_t)(pend - pdata) || XXH32(pdata, rec.nSize, 0) != rec.nChecksum)
+            {
+                // a crash during an append leaves a torn tail, keep everything before it
+                LogPrintf("%s : Ignoring damaged tail of mncache.dat after %u records\n", __func__, nRead);
+                fTorn = true;
+                break;
+            }
+
+            CDataStream ssRecord(pdata, pdata + rec.nSize, SER_DISK, CLIENT_VERSION);
+            if (rec.nType == RECORD_MASTERNODE) {
+                CMasternode mn;
+                ssRecord >> mn;
+                mapLoaded[mn.vin.prevout] = mn;
+            } else if (rec.nType == RECORD_REMOVED) {
+                COutPoint outpoint;
+                ssRecord >> outpoint;
+                mapLoaded.erase(outpoint);
+            } else if (rec.nType == RECORD_STATE) {
+                ssState.clear();
+                ssState.write(pdata, rec.nSize);
+            }
+
+            p = pdata + rec.nSize;
+            nRead++;
+        }
+    }
+    catch (std::exception &e) {
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return IncorrectFormat;
+    }
+
+    CMasternodeMan mnodemanState;
+    if (!ssState.empty()) {
+        try {
+            ssState >> mnodemanState.mAskedUsForMasternodeList >> mnodemanState.mWeAskedForMasternodeList
+                    >> mnodemanState.mWeAskedForMasternodeListEntry >> mnodemanState.nDsqCount;
+        }
+        catch (std::exception &e) {
+            error("%s : Deserialize error in manager state - %s", __func__, e.what());
+            mnodemanState.mAskedUsForMasternodeList.clear();
+            mnodemanState.mWeAskedForMasternodeList.clear();
+            mnodemanState.mWeAskedForMasternodeListEntry.clear();
+            mnodemanState.nDsqCount = 0;
+        }
+    }
+    Merge(mnodemanToLoad, mapLoaded, mnodemanState);
+
+    // the next write appends to what is on disk now
+    nRecords = nRead;
+    fCompactNext = fTorn;
+
+    mnodemanToLoad.CheckAndRemove(); // clean out expired
+    LogPrintf("Loaded %u records from mncache.dat  %dms\n", nRead, GetTimeMillis() - nStart);
+    LogPrintf("  %s\n", mnodemanToLoad.ToString());
+
+    return Ok;
+}
+
+void CMasternodeDB::Merge(CMasternodeMan& mnodemanToLoad, const std::map<COutPoint, CMasternode>& mapLoaded, const CMasternodeMan& mnodemanState)
+{
+    mapWritten.clear();
+
+    LOCK(mnodemanToLoad.cs);
+
+    // entries may have arrived from the network while we were loading, those win
+    // and get written again on the next flush
+    std::map<COutPoint, CMasternode>::const_iterator it;
+    for (it = mapLoaded.begin(); it != mapLoaded.end(); ++it) {
+        if (mnodemanToLoad.setCollaterals.count((*it).first)) {
+            mapWritten[(*it).first] = make_pair(-1, -1);
+            continue;
+        }
+
+        mnodemanToLoad.vMasternodes.push_back((*it).second);
+        CMasternode& mn = mnodemanToLoad.vMasternodes.back();
+        mn.nListVersion = ++mnodemanToLoad.nListVersion;
+        mnodemanToLoad.setCollaterals.insert((*it).first);
+        mapWritten[(*it).first] = make_pair(mn.nListVersion, mn.lastTimeSeen);
+    }
+    mnodemanToLoad.mapRankCache.clear();
+
+    mnodemanToLoad.mAskedUsForMasternodeList.insert(mnodemanState.mAskedUsForMasternodeList.begin(), mnodemanState.mAskedUsForMasternodeList.end());
+    mnodemanToLoad.mWeAskedForMasternodeList.insert(mnodemanState.mWeAskedForMasternodeList.begin(), mnodemanState.mWeAskedForMasternodeList.end());
+    mnodemanToLoad.mWeAskedForMasternodeListEntry.insert(mnodemanState.mWeAskedForMasternodeListEntry.begin(), mnodemanState.mWeAskedForMasternodeListEntry.end());
+    mnodemanToLoad.nDsqCount = std::max(mnodemanToLoad.nDsqCount, mnodemanState.nDsqCount);
+}
+
+CMasternodeDB::ReadResult CMasternodeDB::ReadLegacy(CMasternodeMan& mnodemanToLoad)
 {
     int64_t nStart = GetTimeMillis();
     // open input file, and associate with CAutoFile
@@ -120,6 +349,7 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
 
     unsigned char pchMsgTmp[4];
     std::string strMagicMessageTmp;
+    CMasternodeMan mnodemanLegacy;
     try {
         // de-serialize file header (masternode cache file specific magic message) and ..
 
@@ -142,15 +372,24 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
             return IncorrectMagicNumber;
         }
 
-        // de-serialize address data into one CMnList object
-        ssMasternodes >> mnodemanToLoad;
+        // de-serialize address data into a separate list, the live one may already
+        // hold entries from the network
+        ssMasternodes >> mnodemanLegacy;
     }
     catch (std::exception &e) {
-        mnodemanToLoad.Clear();
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
         return IncorrectFormat;
     }
 
+    std::map<COutPoint, CMasternode> mapLoaded;
+    BOOST_FOREACH(const CMasternode& mn, mnodemanLegacy.vMasternodes)
+        mapLoaded[mn.vin.prevout] = mn;
+    Merge(mnodemanToLoad, mapLoaded, mnodemanLegacy);
+
+    // nothing of the new format is on disk yet
+    nRecords = 0;
+    fCompactNext = true;
+
     mnodemanToLoad.CheckAndRemove(); // clean out expired
     LogPrintf("Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", mnodemanToLoad.ToString());
@@ -158,37 +397,58 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
     return Ok;
 }
 
-void DumpMasternodes()
+void ThreadLoadMasternodes()
 {
-    int64_t nStart = GetTimeMillis();
-
-    CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
+    RenameThread("transfer-mnload");
 
-    LogPrintf("Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman);
-    // there was an error and it was not an error on file openning => do not proceed
+    CMasternodeDB* pmndb = new CMasternodeDB();
+    CMasternodeDB::ReadResult readResult = pmndb->Read(mnodeman);
     if (readResult == CMasternodeDB::FileError)
-        LogPrintf("Missing masternode list file - mncache.dat, will try to recreate\n");
+        LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
     else if (readResult != CMasternodeDB::Ok)
     {
         LogPrintf("Error reading mncache.dat: ");
         if(readResult == CMasternodeDB::IncorrectFormat)
             LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
         else
-        {
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
     }
+
+    LOCK(cs_mndbFlush);
+    pmndbFlush.reset(pmndb);
+}
+
+void FlushMasternodes()
+{
+    LOCK(cs_mndbFlush);
+    if (!pmndbFlush) return;
+
+    pmndbFlush->Write(mnodeman, false);
+}
+
+void DumpMasternodes()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // don't overwrite the cache with a partial list while it's still loading
+    LOCK(cs_mndbFlush);
+    if (!pmndbFlush) {
+        LogPrintf("Masternode cache not loaded yet, skipping dump\n");
+        return;
+    }
+
     LogPrintf("Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
+    pmndbFlush->Write(mnodeman, true);
 
     LogPrintf("Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
+    LogPrintf("  %s\n", mnodeman.ToString());
 }
 
 CMasternodeMan::CMasternodeMan() {
     nDsqCount = 0;
+    nListId = GetRand(std::numeric_limits<uint64_t>::max());
+    nListVersion = 0;
+    nRemovedHorizon = 0;
 }
 
 bool CMasternodeMan::Add(CMasternode &mn)
@@ -204,6 +464,9 @@ bool CMasternodeMan::Add(CMasternode &mn)
     {
         LogPrint("masternode", "CMasternodeMan: Adding new masternode %s - %i now\n", mn.addr.ToString().c_str(), size() + 1);
         vMasternodes.push_back(mn);
+        vMasternodes.back().nListVersion = ++nListVersion;
+        setCollaterals.insert(mn.vin.prevout);
+        mapRankCache.clear();
         return true;
     }
 
@@ -246,7 +509,10 @@ void CMasternodeMan::CheckAndRemove()
     while(it != vMasternodes.end()){
         if((*it).activeState == CMasternode::MASTERNODE_REMOVE || (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT || (*it).protocolVersion < nMasternodeMinProtocol){
             LogPrint("masternode", "CMasternodeMan: Removing inactive masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
+            setCollaterals.erase((*it).vin.prevout);
+            RecordRemoval((*it).vin.prevout);
             it = vMasternodes.erase(it);
+            mapRankCache.clear();
         } else {
             ++it;
         }
@@ -272,6 +538,16 @@ void CMasternodeMan::CheckAndRemove()
         }
     }
 
+    // forget list versions of peers we haven't synced with for a while
+    map<CNetAddr, pair<pair<uint64_t, int64_t>, int64_t> >::iterator it3 = mapPeerListVersion.begin();
+    while(it3 != mapPeerListVersion.end()){
+        if((*it3).second.second + MASTERNODES_DSEG_SECONDS < GetTime()){
+            mapPeerListVersion.erase(it3++);
+        } else {
+            ++it3;
+        }
+    }
+
     // check which masternodes we've asked for
     map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
     while(it2 != mWeAskedForMasternodeListEntry.end()){
@@ -288,12 +564,28 @@ void CMasternodeMan::Clear()
 {
     LOCK(cs);
     vMasternodes.clear();
+    nListVersion++;
+    // removals before the clear are lost, peers older than this get a full list
+    mapRemovedCollaterals.clear();
+    nRemovedHorizon = nListVersion;
+    setCollaterals.clear();
+    mapRankCache.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
+    mapPeerListVersion.clear();
     nDsqCount = 0;
 }
 
+void CMasternodeMan::RecordRemoval(const COutPoint& prevout)
+{
+    mapRemovedCollaterals[++nListVersion] = prevout;
+    if(mapRemovedCollaterals.size() > MASTERNODES_REMOVED_KEEP) {
+        nRemovedHorizon = mapRemovedCollaterals.begin()->first;
+        mapRemovedCollaterals.erase(mapRemovedCollaterals.begin());
+    }
+}
+
 int CMasternodeMan::CountEnabled(int protocolVersion)
 {
     int i = 0;
@@ -329,13 +621,89 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
     if (it != mWeAskedForMasternodeList.end())
     {
         if (GetTime() < (*it).second) {
-            LogPrintf("dseg - we already asked %s for the list; skipping...\n", pnode->addr.ToString());
+            LogPrint("masternode", "dseg - we already asked %s for the list; skipping...\n", pnode->addr.ToString());
             return;
         }
     }
-    pnode->PushMessage("dseg", CTxIn());
+
+    if(pnode->nVersion < MIN_MASTERNODE_LIST_SYNC_PROTO_VERSION) {
+        pnode->PushMessage("dseg", CTxIn());
+        mWeAskedForMasternodeList[pnode->addr] = GetTime() + MASTERNODES_DSEG_SECONDS;
+        return;
+    }
+
+    // ask only for what changed since the last list this peer sent us,
+    // the list hash lets the peer skip the full dump if we already agree
+    pair<uint64_t, int64_t> known = make_pair(0, 0);
+    std::map<CNetAddr, pair<pair<uint64_t, int64_t>, int64_t> >::iterator mi = mapPeerListVersion.find(pnode->addr);
+    if (mi != mapPeerListVersion.end())
+        known = (*mi).second.first;
+
+    pnode->PushMessage("mnlistget", known.first, known.second, GetListHash());
+    mWeAskedForMasternodeList[pnode->addr] = GetTime() + MASTERNODES_DELTA_SECONDS;
+}
+
+void CMasternodeMan::SyncList()
+{
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if(pnode->fDisconnect || pnode->nVersion == 0) continue;
+            pnode->AddRef();
+            vNodesCopy.push_back(pnode);
+            if(vNodesCopy.size() == MASTERNODES_SYNC_PEERS) break;
+        }
+    }
+
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        DsegUpdate(pnode);
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
+
+uint256 CMasternodeMan::GetListHash()
+{
+    LOCK(cs);
+
+    // not cached, entries drop in and out of the served set without a version change
+    std::vector<pair<COutPoint, int64_t> > vEntries;
+    vEntries.reserve(vMasternodes.size());
+    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        mn.Check();
+        if(IsListed(mn))
+            vEntries.push_back(make_pair(mn.vin.prevout, mn.sigTime));
+    }
+    sort(vEntries.begin(), vEntries.end());
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << vEntries;
+    return ss.GetHash();
+}
+
+bool CMasternodeMan::AllowListRequest(CNode* pfrom)
+{
+    //local network
+    if(pfrom->addr.IsRFC1918() || Params().NetworkID() != CChainParams::MAIN) return true;
+
+    std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
+    if (i != mAskedUsForMasternodeList.end())
+    {
+        int64_t t = (*i).second;
+        if (GetTime() < t) {
+            Misbehaving(pfrom->GetId(), 34);
+            LogPrintf("dseg - peer already asked me for the list\n");
+            return false;
+        }
+    }
+
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
-    mWeAskedForMasternodeList[pnode->addr] = askAgain;
+    mAskedUsForMasternodeList[pfrom->addr] = askAgain;
+    return true;
 }
 
 CMasternode *CMasternodeMan::Find(const CTxIn &vin)
@@ -434,40 +802,43 @@ CMasternode *CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude
     return NULL;
 }
 
-CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+// Score a slice of the candidate list, run on worker threads for large lists
+static void ScoreMasternodes(const std::vector<const CMasternode*>& vpmn, const uint256& hashBlock,
+                             std::vector<pair<unsigned int, CTxIn> >& vecScores, size_t nBegin, size_t nEnd)
 {
-    unsigned int score = 0;
-    CMasternode* winner = NULL;
-
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-        mn.Check();
-        if(mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
-
-        // calculate the score for each masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
+    for(size_t i = nBegin; i < nEnd; i++) {
+        uint256 n = vpmn[i]->CalculateScore(hashBlock);
         unsigned int n2 = 0;
         memcpy(&n2, &n, sizeof(n2));
 
-        // determine the winner
-        if(n2 > score){
-            score = n2;
-            winner = &mn;
-        }
+        vecScores[i] = make_pair(n2, vpmn[i]->vin);
     }
-
-    return winner;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+const std::vector<CTxIn>& CMasternodeMan::GetRankedVins(int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    static const std::vector<CTxIn> vEmpty;
+
+    if(pindexBest == NULL) return vEmpty;
+
+    // rankings are rebuilt once per block: a new tip also refreshes the enabled states
+    if(hashRankCacheTip != pindexBest->GetBlockHash()) {
+        mapRankCache.clear();
+        hashRankCacheTip = pindexBest->GetBlockHash();
+    }
+
+    if(nBlockHeight == 0) nBlockHeight = pindexBest->nHeight;
+
+    pair<int64_t, pair<int, bool> > key = make_pair(nBlockHeight, make_pair(minProtocol, fOnlyActive));
+    std::map<pair<int64_t, pair<int, bool> >, std::vector<CTxIn> >::iterator it = mapRankCache.find(key);
+    if(it != mapRankCache.end()) return (*it).second;
 
     //make sure we know about this block
     uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return -1;
+    if(!GetBlockHash(hash, nBlockHeight)) return vEmpty;
 
-    // scan for winner
+    std::vector<const CMasternode*> vpmn;
+    vpmn.reserve(vMasternodes.size());
     BOOST_FOREACH(CMasternode& mn, vMasternodes) {
 
         if(mn.protocolVersion < minProtocol) continue;
@@ -476,19 +847,59 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             if(!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+        vpmn.push_back(&mn);
+    }
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+    // each score is two double-SHA256 runs, split big lists across cores
+    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores(vpmn.size());
+    unsigned int nThreads = boost::thread::hardware_concurrency();
+    if(vpmn.size() >= MASTERNODES_RANK_PARALLEL_MIN && nThreads > 1) {
+        boost::thread_group threadGroup;
+        size_t nChunk = (vpmn.size() + nThreads - 1) / nThreads;
+        for(size_t nBegin = 0; nBegin < vpmn.size(); nBegin += nChunk) {
+            size_t nEnd = std::min(nBegin + nChunk, vpmn.size());
+            threadGroup.create_thread(boost::bind(&ScoreMasternodes, boost::cref(vpmn), boost::cref(hash),
+                                                  boost::ref(vecMasternodeScores), nBegin, nEnd));
+        }
+        threadGroup.join_all();
+    } else {
+        ScoreMasternodes(vpmn, hash, vecMasternodeScores, 0, vpmn.size());
     }
 
     sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
 
+    if(mapRankCache.size() >= MASTERNODES_RANK_CACHE_SIZE)
+        mapRankCache.erase(mapRankCache.begin());
+
+    std::vector<CTxIn>& vRanked = mapRankCache[key];
+    vRanked.reserve(vecMasternodeScores.size());
+    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores)
+        vRanked.push_back(s.second);
+
+    return vRanked;
+}
+
+CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs);
+
+    // the winner is the best scoring enabled masternode
+    const std::vector<CTxIn>& vRanked = GetRankedVins(nBlockHeight, minProtocol, true);
+    if(vRanked.empty()) return NULL;
+
+    return Find(vRanked.front());
+}
+
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
+
+    const std::vector<CTxIn>& vRanked = GetRankedVins(nBlockHeight, minProtocol, fOnlyActive);
+
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
+    BOOST_FOREACH (const CTxIn& v, vRanked){
         rank++;
-        if(s.second == vin) {
+        if(v == vin) {
             return rank;
         }
     }
@@ -498,36 +909,17 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<unsigned int, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
-
-    //make sure we know about this block
-    uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
-
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-
-        mn.Check();
-
-        if(mn.protocolVersion < minProtocol) continue;
-        if(!mn.IsEnabled()) {
-            continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    LOCK(cs);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
+    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnlyMN());
+    const std::vector<CTxIn>& vRanked = GetRankedVins(nBlockHeight, minProtocol, true);
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CMasternode)& s, vecMasternodeScores){
+    BOOST_FOREACH (const CTxIn& v, vRanked){
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        CMasternode* pmn = Find(v);
+        if(pmn) vecMasternodeRanks.push_back(make_pair(rank, *pmn));
     }
 
     return vecMasternodeRanks;
@@ -535,35 +927,13 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
-
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-
-        if(mn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            mn.Check();
-            if(!mn.IsEnabled()) continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    LOCK(cs);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    const std::vector<CTxIn>& vRanked = GetRankedVins(nBlockHeight, minProtocol, fOnlyActive);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(rank == nRank) {
-            return Find(s.second);
-        }
-    }
+    if(nRank < 1 || nRank > (int)vRanked.size()) return NULL;
 
-    return NULL;
+    return Find(vRanked[nRank-1]);
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -583,208 +953,219 @@ void CMasternodeMan::ProcessMasternodeConnections()
     }
 }
 
-void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+void CMasternodeMan::ProcessMasternodeEntry(CNode* pfrom, CTxIn vin, CService addr, std::vector<unsigned char> vchSig, int64_t sigTime, CPubKey pubkey, CPubKey pubkey2, int count, int current, int64_t lastUpdated, int protocolVersion, CScript donationAddress, int donationPercentage, bool fListEntry)
 {
+    std::string strMessage;
 
-    //Normally would disable functionality, NEED this enabled for staking.
-    //if(fLiteMode) return;
+    // make sure signature isn't in the future (past is OK)
+    if (sigTime > GetAdjustedTime() + 60 * 60) {
+        LogPrintf("dsee - Signature rejected, too far into the future %s\n", vin.ToString().c_str());
+        return;
+    }
 
-    if(!darkSendPool.IsBlockchainSynced()) return;
+    bool isIPV4 = addr.IsIPv4() && addr.IsRoutable();
+    //if(RegTest()) isLocal = false;
 
-    LOCK(cs_process_message);
+    std::string vchPubKey(pubkey.begin(), pubkey.end());
+    std::string vchPubKey2(pubkey2.begin(), pubkey2.end());
 
-    if (strCommand == "dsee") { //DarkSend Election Entry
+    strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion)  + donationAddress.ToString() + boost::lexical_cast<std::string>(donationPercentage);
 
-        CTxIn vin;
-        CService addr;
-        CPubKey pubkey;
-        CPubKey pubkey2;
-        vector<unsigned char> vchSig;
-        int64_t sigTime;
-        int count;
-        int current;
-        int64_t lastUpdated;
-        int protocolVersion;
-        CScript donationAddress;
-        int donationPercentage;
-        std::string strMessage;
+    if(donationPercentage < 0 || donationPercentage > 100){
+        LogPrintf("dsee - donation percentage out of range %d\n", donationPercentage);
+        return;     
+    }
+    if(protocolVersion < MIN_POOL_PEER_PROTO_VERSION) {
+        LogPrintf("dsee - ignoring outdated masternode %s protocol version %d\n", vin.ToString().c_str(), protocolVersion);
+        return;
+    }
 
-        // 70047 and greater
-        vRecv >> vin >> addr >> vchSig >> sigTime >> pubkey >> pubkey2 >> count >> current >> lastUpdated >> protocolVersion >> donationAddress >> donationPercentage;
+    CScript pubkeyScript;
+    pubkeyScript.SetDestination(pubkey.GetID());
 
-        // make sure signature isn't in the future (past is OK)
-        if (sigTime > GetAdjustedTime() + 60 * 60) {
-            LogPrintf("dsee - Signature rejected, too far into the future %s\n", vin.ToString().c_str());
-            return;
-        }
+    if(pubkeyScript.size() != 25) {
+        LogPrintf("dsee - pubkey the wrong size\n");
+        Misbehaving(pfrom->GetId(), 100);
+        return;
+    }
 
-        bool isIPV4 = addr.IsIPv4() && addr.IsRoutable();
-        //if(RegTest()) isLocal = false;
+    CScript pubkeyScript2;
+    pubkeyScript2.SetDestination(pubkey2.GetID());
 
-        std::string vchPubKey(pubkey.begin(), pubkey.end());
-        std::string vchPubKey2(pubkey2.begin(), pubkey2.end());
+    if(pubkeyScript2.size() != 25) {
+        LogPrintf("dsee - pubkey2 the wrong size\n");
+        Misbehaving(pfrom->GetId(), 100);
+        return;
+    }
 
-        strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion)  + donationAddress.ToString() + boost::lexical_cast<std::string>(donationPercentage);
+    if(!vin.scriptSig.empty()) {
+        LogPrintf("dsee - Ignore Not Empty ScriptSig %s\n",vin.ToString().c_str());
+        return;
+    }
 
-        if(donationPercentage < 0 || donationPercentage > 100){
-            LogPrintf("dsee - donation percentage out of range %d\n", donationPercentage);
-            return;     
-        }
-        if(protocolVersion < MIN_POOL_PEER_PROTO_VERSION) {
-            LogPrintf("dsee - ignoring outdated masternode %s protocol version %d\n", vin.ToString().c_str(), protocolVersion);
-            return;
-        }
+    std::string errorMessage = "";
+    if(!darkSendSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage)){
+        LogPrintf("dsee - Got bad masternode address signature\n");
+        Misbehaving(pfrom->GetId(), 100);
+        return;
+    }
 
-        CScript pubkeyScript;
-        pubkeyScript.SetDestination(pubkey.GetID());
+    if(Params().NetworkID() == CChainParams::MAIN){
+        if(addr.GetPort() != 17170) return;
+        if(!isIPV4) return;
+    } else if(addr.GetPort() == 17170) return;
 
-        if(pubkeyScript.size() != 25) {
-            LogPrintf("dsee - pubkey the wrong size\n");
-            Misbehaving(pfrom->GetId(), 100);
-            return;
+    //search existing masternode list, this is where we update existing masternodes with new dsee broadcasts
+    CMasternode* pmn = this->Find(vin);
+    // if we are a masternode but with undefined vin and this dsee is ours (matches our Masternode privkey) then just skip this part
+    if(pmn != NULL && !(fMasterNode && activeMasternode.vin == CTxIn() && pubkey2 == activeMasternode.pubKeyMasternode))
+    {
+        // count == -1 when it's a new entry
+        //   e.g. We don't want the entry relayed/time updated when we're syncing the list
+        // list entries only carry newer signatures over, they are neither relayed nor counted as seen
+        // mn.pubkey = pubkey, IsVinAssociatedWithPubkey is validated once below,
+        //   after that they just need to match
+        if(pmn->pubkey == pubkey && (fListEntry || (count == -1 && !pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS)))){
+            if(!fListEntry) pmn->UpdateLastSeen();
+
+            if(pmn->sigTime < sigTime){ //take the newest entry
+                LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
+                pmn->pubkey2 = pubkey2;
+                pmn->sigTime = sigTime;
+                pmn->sig = vchSig;
+                pmn->protocolVersion = protocolVersion;
+                pmn->addr = addr;
+                pmn->donationAddress = donationAddress;
+                pmn->donationPercentage = donationPercentage;
+                {
+                    LOCK(cs);
+                    pmn->nListVersion = ++nListVersion;
+                }
+                pmn->Check();
+                if(!fListEntry && pmn->IsEnabled())
+                    mnodeman.RelayMasternodeEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
+            }
         }
 
-        CScript pubkeyScript2;
-        pubkeyScript2.SetDestination(pubkey2.GetID());
+        return;
+    }
 
-        if(pubkeyScript2.size() != 25) {
-            LogPrintf("dsee - pubkey2 the wrong size\n");
-            Misbehaving(pfrom->GetId(), 100);
-            return;
-        }
+    // make sure the vout that was signed is related to the transaction that spawned the masternode
+    //  - this is expensive, so it's only done once per masternode
+    if(!darkSendSigner.IsVinAssociatedWithPubkey(vin, pubkey)) {
+        LogPrintf("dsee - Got mismatched pubkey and vin\n");
+        Misbehaving(pfrom->GetId(), 100);
+        return;
+    }
 
-        if(!vin.scriptSig.empty()) {
-            LogPrintf("dsee - Ignore Not Empty ScriptSig %s\n",vin.ToString().c_str());
-            return;
-        }
+    LogPrint("masternode", "dsee - Got NEW masternode entry %s\n", addr.ToString().c_str());
+
+    // make sure it's still unspent
+    //  - this is checked later by .check() in many places and by ThreadCheckDarkSendPool()
+
+    CValidationState state;
+    CTransaction tx = CTransaction();
+    CTxOut vout = CTxOut(DARKSEND_POOL_MAX, darkSendPool.collateralPubKey);
+    tx.vin.push_back(vin);
+    tx.vout.push_back(vout);
+    bool fAcceptable = false;
+    {
+        TRY_LOCK(cs_main, lockMain);
+        if(!lockMain) return;
+        fAcceptable = AcceptableInputs(mempool, tx, false, NULL);
+    }
+    if(fAcceptable){
+        LogPrint("masternode", "dsee - Accepted masternode entry %i %i\n", count, current);
 
-        std::string errorMessage = "";
-        if(!darkSendSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage)){
-            LogPrintf("dsee - Got bad masternode address signature\n");
-            Misbehaving(pfrom->GetId(), 100);
+        if(GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS){
+            LogPrintf("dsee - Input must have least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
+            Misbehaving(pfrom->GetId(), 20);
             return;
         }
 
-        if(Params().NetworkID() == CChainParams::MAIN){
-            if(addr.GetPort() != 17170) return;
-            if(!isIPV4) return;
-        } else if(addr.GetPort() == 17170) return;
-
-        //search existing masternode list, this is where we update existing masternodes with new dsee broadcasts
-        CMasternode* pmn = this->Find(vin);
-        // if we are a masternode but with undefined vin and this dsee is ours (matches our Masternode privkey) then just skip this part
-        if(pmn != NULL && !(fMasterNode && activeMasternode.vin == CTxIn() && pubkey2 == activeMasternode.pubKeyMasternode))
+        // verify that sig time is legit in past
+        // should be at least not earlier than block when 10000 TansferCoin tx got MASTERNODE_MIN_CONFIRMATIONS
+        uint256 hashBlock = 0;
+        GetTransaction(vin.prevout.hash, tx, hashBlock);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+       if (mi != mapBlockIndex.end() && (*mi).second)
         {
-            // count == -1 when it's a new entry
-            //   e.g. We don't want the entry relayed/time updated when we're syncing the list
-            // mn.pubkey = pubkey, IsVinAssociatedWithPubkey is validated once below,
-            //   after that they just need to match
-            if(count == -1 && pmn->pubkey == pubkey && !pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS)){
-                pmn->UpdateLastSeen();
-
-                if(pmn->sigTime < sigTime){ //take the newest entry
-                    LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
-                    pmn->pubkey2 = pubkey2;
-                    pmn->sigTime = sigTime;
-                    pmn->sig = vchSig;
-                    pmn->protocolVersion = protocolVersion;
-                    pmn->addr = addr;
-                    pmn->donationAddress = donationAddress;
-                    pmn->donationPercentage = donationPercentage;
-                    pmn->Check();
-                    if(pmn->IsEnabled())
-                        mnodeman.RelayMasternodeEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
-                }
+            CBlockIndex* pMNIndex = (*mi).second; // block for 10000 TansferCoin tx -> 1 confirmation
+            CBlockIndex* pConfIndex = FindBlockByHeight((pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1)); // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+            if(pConfIndex->GetBlockTime() > sigTime)
+            {
+                LogPrintf("dsee - Bad sigTime %d for masternode %20s %105s (%i conf block is at %d)\n",
+                          sigTime, addr.ToString(), vin.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
+                return;
             }
+        }
 
-            return;
+
+        // use this as a peer
+        addrman.Add(CAddress(addr), pfrom->addr, 2*60*60);
+
+        //doesn't support multisig addresses
+        if(donationAddress.IsPayToScriptHash()){
+            donationAddress = CScript();
+            donationPercentage = 0;
         }
 
-        // make sure the vout that was signed is related to the transaction that spawned the masternode
-        //  - this is expensive, so it's only done once per masternode
-        if(!darkSendSigner.IsVinAssociatedWithPubkey(vin, pubkey)) {
-            LogPrintf("dsee - Got mismatched pubkey and vin\n");
-            Misbehaving(pfrom->GetId(), 100);
-            return;
+        // add our masternode
+        CMasternode mn(addr, vin, pubkey, vchSig, sigTime, pubkey2, protocolVersion, donationAddress, donationPercentage);
+        mn.UpdateLastSeen(lastUpdated);
+        this->Add(mn);
+
+        // if it matches our masternodeprivkey, then we've been remotely activated
+        if(pubkey2 == activeMasternode.pubKeyMasternode && protocolVersion == PROTOCOL_VERSION){
+            activeMasternode.EnableHotColdMasterNode(vin, addr);
         }
 
-        LogPrint("masternode", "dsee - Got NEW masternode entry %s\n", addr.ToString().c_str());
+        if(count == -1 && isIPV4)
+            mnodeman.RelayMasternodeEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
 
-        // make sure it's still unspent
-        //  - this is checked later by .check() in many places and by ThreadCheckDarkSendPool()
+    } else {
+        LogPrintf("dsee - Rejected masternode entry %s\n", addr.ToString().c_str());
 
-        CValidationState state;
-        CTransaction tx = CTransaction();
-        CTxOut vout = CTxOut(DARKSEND_POOL_MAX, darkSendPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-        bool fAcceptable = false;
+        int nDoS = 0;
+        if (state.IsInvalid(nDoS))
         {
-            TRY_LOCK(cs_main, lockMain);
-            if(!lockMain) return;
-            fAcceptable = AcceptableInputs(mempool, tx, false, NULL);
+            LogPrintf("dsee - %s from %s %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
+                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
+            if (nDoS > 0)
+                Misbehaving(pfrom->GetId(), nDoS);
         }
-        if(fAcceptable){
-            LogPrint("masternode", "dsee - Accepted masternode entry %i %i\n", count, current);
-
-            if(GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS){
-                LogPrintf("dsee - Input must have least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
-                Misbehaving(pfrom->GetId(), 20);
-                return;
-            }
-
-            // verify that sig time is legit in past
-            // should be at least not earlier than block when 10000 TansferCoin tx got MASTERNODE_MIN_CONFIRMATIONS
-            uint256 hashBlock = 0;
-            GetTransaction(vin.prevout.hash, tx, hashBlock);
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
-           if (mi != mapBlockIndex.end() && (*mi).second)
-            {
-                CBlockIndex* pMNIndex = (*mi).second; // block for 10000 TansferCoin tx -> 1 confirmation
-                CBlockIndex* pConfIndex = FindBlockByHeight((pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1)); // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-                if(pConfIndex->GetBlockTime() > sigTime)
-                {
-                    LogPrintf("dsee - Bad sigTime %d for masternode %20s %105s (%i conf block is at %d)\n",
-                              sigTime, addr.ToString(), vin.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
-                    return;
-                }
-            }
+    }
+}
 
+void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
 
-            // use this as a peer
-            addrman.Add(CAddress(addr), pfrom->addr, 2*60*60);
+    //Normally would disable functionality, NEED this enabled for staking.
+    //if(fLiteMode) return;
 
-            //doesn't support multisig addresses
-            if(donationAddress.IsPayToScriptHash()){
-                donationAddress = CScript();
-                donationPercentage = 0;
-            }
+    if(!darkSendPool.IsBlockchainSynced()) return;
 
-            // add our masternode
-            CMasternode mn(addr, vin, pubkey, vchSig, sigTime, pubkey2, protocolVersion, donationAddress, donationPercentage);
-            mn.UpdateLastSeen(lastUpdated);
-            this->Add(mn);
+    LOCK(cs_process_message);
 
-            // if it matches our masternodeprivkey, then we've been remotely activated
-            if(pubkey2 == activeMasternode.pubKeyMasternode && protocolVersion == PROTOCOL_VERSION){
-                activeMasternode.EnableHotColdMasterNode(vin, addr);
-            }
+    if (strCommand == "dsee") { //DarkSend Election Entry
 
-            if(count == -1 && isIPV4)
-                mnodeman.RelayMasternodeEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
+        CTxIn vin;
+        CService addr;
+        CPubKey pubkey;
+        CPubKey pubkey2;
+        vector<unsigned char> vchSig;
+        int64_t sigTime;
+        int count;
+        int current;
+        int64_t lastUpdated;
+        int protocolVersion;
+        CScript donationAddress;
+        int donationPercentage;
 
-        } else {
-            LogPrintf("dsee - Rejected masternode entry %s\n", addr.ToString().c_str());
+        // 70047 and greater
+        vRecv >> vin >> addr >> vchSig >> sigTime >> pubkey >> pubkey2 >> count >> current >> lastUpdated >> protocolVersion >> donationAddress >> donationPercentage;
 
-            int nDoS = 0;
-            if (state.IsInvalid(nDoS))
-            {
-                LogPrintf("dsee - %s from %s %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
-                    pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
-                if (nDoS > 0)
-                    Misbehaving(pfrom->GetId(), nDoS);
-            }
-        }
+        ProcessMasternodeEntry(pfrom, vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
     }
 
     else if (strCommand == "dseep") { //DarkSend Election Entry Ping
@@ -898,23 +1279,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         vRecv >> vin;
 
         if(vin == CTxIn()) { //only should ask for this once
-            //local network
-            if(!pfrom->addr.IsRFC1918() && Params().NetworkID() == CChainParams::MAIN)
-            {
-                std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
-                if (i != mAskedUsForMasternodeList.end())
-                {
-                    int64_t t = (*i).second;
-                    if (GetTime() < t) {
-                        Misbehaving(pfrom->GetId(), 34);
-                        LogPrintf("dseg - peer already asked me for the list\n");
-                        return;
-                    }
-                }
-
-                int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
-                mAskedUsForMasternodeList[pfrom->addr] = askAgain;
-            }
+            if(!AllowListRequest(pfrom)) return;
         } //else, asking for a specific node which is ok
 
         int count = this->size();
@@ -939,22 +1304,115 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
 
         LogPrintf("dseg - Sent %d masternode entries to %s\n", i, pfrom->addr.ToString().c_str());
+
+    } else if (strCommand == "mnlistget") { //Get masternode list changes since a list version
+
+        uint64_t nPeerListId;
+        int64_t nPeerListVersion;
+        uint256 hashPeerList;
+        vRecv >> nPeerListId >> nPeerListVersion >> hashPeerList;
+
+        LOCK(cs);
+
+        if(hashPeerList == GetListHash()) {
+            // same content already, only hand out our version
+            nPeerListVersion = nListVersion;
+        } else if(nPeerListId != nListId || nPeerListVersion > nListVersion || nPeerListVersion < nRemovedHorizon) {
+            // versions from another list instance mean nothing here, and removals
+            // older than the horizon are forgotten, send everything
+            if(!AllowListRequest(pfrom)) return;
+            nPeerListVersion = 0;
+        }
+
+        std::vector<CMasternodeListEntry> vEntries;
+        std::vector<COutPoint> vRemoved;
+        int i = 0;
+        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+            if(mn.nListVersion <= nPeerListVersion) continue;
+            if(!IsListed(mn)) continue;
+
+            vEntries.push_back(CMasternodeListEntry(mn));
+            i++;
+            if(vEntries.size() == MASTERNODES_LIST_MAX_ENTRIES) {
+                pfrom->PushMessage("mnlist", nListId, nListVersion, vEntries, vRemoved);
+                vEntries.clear();
+            }
+        }
+        // removals go in the last message, at most MASTERNODES_REMOVED_KEEP of them
+        std::map<int64_t, COutPoint>::iterator mi = mapRemovedCollaterals.upper_bound(nPeerListVersion);
+        for(; mi != mapRemovedCollaterals.end(); ++mi)
+            vRemoved.push_back((*mi).second);
+        // always answer, even an empty list tells the peer our current version
+        pfrom->PushMessage("mnlist", nListId, nListVersion, vEntries, vRemoved);
+
+        LogPrint("masternode", "mnlistget - Sent %d masternode entries and %d removals since version %d to %s\n", i, vRemoved.size(), nPeerListVersion, pfrom->addr.ToString());
+
+    } else if (strCommand == "mnlist") { //Masternode list changes
+
+        uint64_t nPeerListId;
+        int64_t nPeerListVersion;
+        std::vector<CMasternodeListEntry> vEntries;
+        std::vector<COutPoint> vRemoved;
+        vRecv >> nPeerListId >> nPeerListVersion >> vEntries >> vRemoved;
+
+        if(vEntries.size() > MASTERNODES_LIST_MAX_ENTRIES || vRemoved.size() > MASTERNODES_REMOVED_KEEP) {
+            Misbehaving(pfrom->GetId(), 20);
+            return;
+        }
+
+        {
+            LOCK(cs);
+            // only accept the answer while our request is still open
+            std::map<CNetAddr, int64_t>::iterator it = mWeAskedForMasternodeList.find(pfrom->addr);
+            if(it == mWeAskedForMasternodeList.end() || (*it).second < GetTime()) {
+                LogPrintf("mnlist - unrequested list from %s\n", pfrom->addr.ToString());
+                return;
+            }
+            mapPeerListVersion[pfrom->addr] = make_pair(make_pair(nPeerListId, nPeerListVersion), GetTime());
+        }
+
+        int i = 0;
+        BOOST_FOREACH(CMasternodeListEntry& entry, vEntries) {
+            ProcessMasternodeEntry(pfrom, CTxIn(entry.prevout), entry.addr, entry.sig, entry.sigTime, entry.pubkey, entry.pubkey2, vEntries.size(), i++, entry.lastTimeSeen, entry.protocolVersion, entry.donationAddress, entry.donationPercentage, true);
+        }
+
+        // a peer's removal is only a hint, drop the entry if our own check agrees it is gone
+        int nRemoved = 0;
+        BOOST_FOREACH(const COutPoint& prevout, vRemoved) {
+            CTxIn vin(prevout);
+            CMasternode* pmn = Find(vin);
+            if(pmn == NULL) continue;
+            pmn->Check();
+            if(pmn->IsEnabled()) continue;
+            Remove(vin);
+            nRemoved++;
+        }
+
+        LogPrint("masternode", "mnlist - Got %d masternode entries and %d removals (%d applied) from %s, list version %d\n", vEntries.size(), vRemoved.size(), nRemoved, pfrom->addr.ToString(), nPeerListVersion);
     }
 
 }
 
 void CMasternodeMan::RelayMasternodeEntry(const CTxIn vin, const CService addr, const std::vector<unsigned char> vchSig, const int64_t nNow, const CPubKey pubkey, const CPubKey pubkey2, const int count, const int current, const int64_t lastUpdated, const int protocolVersion, CScript donationAddress, int donationPercentage)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vin << addr << vchSig << nNow << pubkey << pubkey2 << count << current << lastUpdated << protocolVersion << donationAddress << donationPercentage;
+    CSharedMessage msg = MakeSharedMessage("dsee", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
-        pnode->PushMessage("dsee", vin, addr, vchSig, nNow, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
+        pnode->PushSharedMessage(msg);
 }
 
 void CMasternodeMan::RelayMasternodeEntryPing(const CTxIn vin, const std::vector<unsigned char> vchSig, const int64_t nNow, const bool stop)
 {
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vin << vchSig << nNow << stop;
+    CSharedMessage msg = MakeSharedMessage("dseep", ss);
+
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
-        pnode->PushMessage("dseep", vin, vchSig, nNow, stop);
+        pnode->PushSharedMessage(msg);
 }
 
 void CMasternodeMan::Remove(CTxIn vin)
@@ -965,9 +1423,13 @@ void CMasternodeMan::Remove(CTxIn vin)
     while(it != vMasternodes.end()){
         if((*it).vin == vin){
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
+            setCollaterals.erase((*it).vin.prevout);
+            RecordRemoval((*it).vin.prevout);
             vMasternodes.erase(it);
+            mapRankCache.clear();
             break;
         }
+        ++it;
     }
 }
 
@@ -983,3 +1445,23 @@ std::string CMasternodeMan::ToString() const
 
     return info.str();
 }
+
+void CMasternodeMan::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    if(tx.IsCoinBase()) return;
+
+    LOCK(cs);
+
+    if(setCollaterals.empty()) return;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        if(!setCollaterals.count(txin.prevout)) continue;
+
+        CMasternode* pmn = Find(txin);
+        if(pmn == NULL) continue;
+
+        LogPrint("masternode", "CMasternodeMan::SyncTransaction - collateral %s spent by %s\n", txin.prevout.ToString(), tx.GetHash().ToString());
+        pmn->activeState = CMasternode::MASTERNODE_VIN_SPENT;
+        mapRankCache.clear();
+    }
+}
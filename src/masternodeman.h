@@ -19,6 +19,12 @@
 
 #define MASTERNODES_DUMP_SECONDS               (15*60)
 #define MASTERNODES_DSEG_SECONDS               (3*60*60)
+#define MASTERNODES_DELTA_SECONDS              (10*60)
+#define MASTERNODES_LIST_MAX_ENTRIES           500 // entries per mnlist message
+#define MASTERNODES_REMOVED_KEEP               500 // removals remembered for mnlist deltas
+#define MASTERNODES_SYNC_PEERS                 3   // peers asked for list updates at once
+#define MASTERNODES_RANK_CACHE_SIZE            32  // (height, protocol) rankings kept per tip
+#define MASTERNODES_RANK_PARALLEL_MIN          512 // score lists at least this long on several threads
 
 using namespace std;
 
@@ -29,13 +35,97 @@ extern CMasternodeMan mnodeman;
 extern void Misbehaving(NodeId nodeid, int howmuch);
 
 void DumpMasternodes();
+void FlushMasternodes();
+void ThreadLoadMasternodes();
 
-/** Access to the MN database (mncache.dat) */
+/** Compact masternode announcement sent in mnlist messages, one message carries many entries */
+class CMasternodeListEntry
+{
+public:
+    COutPoint prevout;
+    CService addr;
+    std::vector<unsigned char> sig;
+    int64_t sigTime;
+    CPubKey pubkey;
+    CPubKey pubkey2;
+    int64_t lastTimeSeen;
+    int protocolVersion;
+    CScript donationAddress;
+    int donationPercentage;
+
+    CMasternodeListEntry()
+    {
+        sigTime = 0;
+        lastTimeSeen = 0;
+        protocolVersion = 0;
+        donationPercentage = 0;
+    }
+
+    CMasternodeListEntry(const CMasternode& mn)
+    {
+        prevout = mn.vin.prevout;
+        addr = mn.addr;
+        sig = mn.sig;
+        sigTime = mn.sigTime;
+        pubkey = mn.pubkey;
+        pubkey2 = mn.pubkey2;
+        lastTimeSeen = mn.lastTimeSeen;
+        protocolVersion = mn.protocolVersion;
+        donationAddress = mn.donationAddress;
+        donationPercentage = mn.donationPercentage;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(prevout);
+        READWRITE(addr);
+        READWRITE(sig);
+        READWRITE(sigTime);
+        READWRITE(pubkey);
+        READWRITE(pubkey2);
+        READWRITE(lastTimeSeen);
+        READWRITE(protocolVersion);
+        READWRITE(donationAddress);
+        READWRITE(donationPercentage);
+    )
+};
+
+/** Fixed size header of mncache.dat, followed by a sequence of records */
+struct CMasternodeCacheHeader
+{
+    char pchMagic[8];
+    unsigned char pchMessageStart[4];
+    uint32_t nFormatVersion;
+};
+
+/** Fixed size record header, each record payload carries its own checksum so a torn
+ *  append only loses the records after it */
+struct CMasternodeCacheRecord
+{
+    uint32_t nType;
+    uint32_t nSize;
+    uint32_t nChecksum;
+};
+
+/** Access to the MN database (mncache.dat)
+ *
+ * The file is an append-only log of masternode entries, removals and manager state.
+ * Periodic flushes only append what changed since the previous flush, the file is
+ * rewritten compacted when the log grows too long and at shutdown.
+ */
 class CMasternodeDB
 {
 private:
     boost::filesystem::path pathMN;
     std::string strMagicMessage;
+
+    // what the file currently says about each masternode: list version and last seen time
+    std::map<COutPoint, pair<int64_t, int64_t> > mapWritten;
+    // records in the file, to decide when to compact
+    unsigned int nRecords;
+    // the file is missing, legacy or has a torn tail, appending to it is not safe
+    bool fCompactNext;
+
 public:
     enum ReadResult {
         Ok,
@@ -47,13 +137,28 @@ public:
         IncorrectFormat
     };
 
+    enum RecordType {
+        RECORD_MASTERNODE = 1,
+        RECORD_REMOVED = 2,
+        RECORD_STATE = 3
+    };
+
     CMasternodeDB();
-    bool Write(const CMasternodeMan &mnodemanToSave);
+    // Append changes since the last write, or rewrite the whole file if fCompact
+    bool Write(const CMasternodeMan &mnodemanToSave, bool fCompact = true);
     ReadResult Read(CMasternodeMan& mnodemanToLoad);
+
+private:
+    ReadResult ReadLegacy(CMasternodeMan& mnodemanToLoad);
+    // Add loaded entries the live list doesn't have yet, stamped with list versions, and
+    // the manager state kept in mnodemanState; fills mapWritten
+    void Merge(CMasternodeMan& mnodemanToLoad, const std::map<COutPoint, CMasternode>& mapLoaded, const CMasternodeMan& mnodemanState);
 };
 
 class CMasternodeMan
 {
+    friend class CMasternodeDB;
+
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -67,6 +172,41 @@ private:
     // which masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    // random id of this list instance and a version bumped on every change, peers hand both
+    // back in mnlistget and only receive the entries announced since
+    uint64_t nListId;
+    int64_t nListVersion;
+    // collaterals of removed entries by the list version of their removal, older
+    // removals are forgotten and peers behind nRemovedHorizon get a full list
+    std::map<int64_t, COutPoint> mapRemovedCollaterals;
+    int64_t nRemovedHorizon;
+    // list id and version each peer last sent us, and when
+    std::map<CNetAddr, pair<pair<uint64_t, int64_t>, int64_t> > mapPeerListVersion;
+
+    // collateral outpoints of all listed masternodes, so spends can be matched without a list scan
+    std::set<COutPoint> setCollaterals;
+
+    // score rankings keyed by (block height, min protocol, only active), best first
+    std::map<pair<int64_t, pair<int, bool> >, std::vector<CTxIn> > mapRankCache;
+    // chain tip the cached rankings were built against
+    uint256 hashRankCacheTip;
+
+    // Rate limit full list requests from a peer, false if it asked too recently
+    bool AllowListRequest(CNode* pfrom);
+
+    // Validate and add or update an entry from dsee or mnlist, list entries update
+    // existing masternodes without being relayed
+    void ProcessMasternodeEntry(CNode* pfrom, CTxIn vin, CService addr, std::vector<unsigned char> vchSig, int64_t sigTime, CPubKey pubkey, CPubKey pubkey2, int count, int current, int64_t lastUpdated, int protocolVersion, CScript donationAddress, int donationPercentage, bool fListEntry = false);
+
+    // Bump the list version for a removed entry and remember it for deltas, caller must hold cs
+    void RecordRemoval(const COutPoint& prevout);
+
+    // Whether an entry is served in mnlist and covered by the list hash
+    static bool IsListed(CMasternode& mn) { return !mn.addr.IsRFC1918() && mn.IsEnabled(); }
+
+    // Get (and cache) the vins ordered by score for a block, caller must hold cs
+    const std::vector<CTxIn>& GetRankedVins(int64_t nBlockHeight, int minProtocol, bool fOnlyActive);
+
 public:
     // keep track of dsq count to prevent masternodes from gaming darksend queue
     int64_t nDsqCount;
@@ -85,6 +225,13 @@ public:
                 READWRITE(mWeAskedForMasternodeList);
                 READWRITE(mWeAskedForMasternodeListEntry);
                 READWRITE(nDsqCount);
+                if (fRead)
+                {
+                    CMasternodeMan* pthis = const_cast<CMasternodeMan*>(this);
+                    pthis->setCollaterals.clear();
+                    BOOST_FOREACH(const CMasternode& mn, vMasternodes)
+                        pthis->setCollaterals.insert(mn.vin.prevout);
+                }
         }
     )
 
@@ -112,6 +259,12 @@ public:
 
     void DsegUpdate(CNode* pnode);
 
+    // Ask a few peers for the changes to their list since we last synced
+    void SyncList();
+
+    // Hash of (collateral, sigTime) of the entries served in mnlist, equal lists give equal hashes
+    uint256 GetListHash();
+
     // Find an entry
     CMasternode* Find(const CTxIn& vin);
     CMasternode* Find(const CPubKey& pubKeyMasternode);
@@ -152,6 +305,9 @@ public:
 
     void Remove(CTxIn vin);
 
+    // Mark masternodes whose collateral is spent by a transaction entering the mempool or a block
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+
 };
 
 #endif
@@ -60,10 +60,10 @@ int nMaxConnections = 125;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
-limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+CAskForTable mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -346,6 +346,10 @@ void AddressCurrentlyConnected(const CService& addr)
 
 uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxPeerUploadRate = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
@@ -643,6 +647,7 @@ void CNode::copyStats(CNodeStats &stats)
     // Raw ping time is in microseconds, but show it to user as whole seconds (Bitcoin users should be well used to small numbers with many decimal places by now :)
     stats.dPingTime = (((double)nPingUsecTime) / 1e6);
     stats.dPingWait = (((double)nPingUsecWait) / 1e6);
+    stats.dSendQueueLatency = (((double)nSendQueueLatency) / 1e6);
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
@@ -657,7 +662,14 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
+        {
             vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+            if (!vRecvBufferPool.empty())
+            {
+                vRecvMsg.back().vRecv.swap(vRecvBufferPool.back());
+                vRecvBufferPool.pop_back();
+            }
+        }
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -678,6 +690,29 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetRecvDataBuffer(unsigned int& nSize)
+{
+    nSize = 0;
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    return vRecvMsg.back().GetDataBuffer(nSize);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::RecycleRecvMsg(CNetMessage& msg)
+{
+    if (vRecvBufferPool.size() >= RECV_BUFFER_POOL_SIZE)
+        return;
+    CSerializeData data;
+    msg.vRecv.swap(data);
+    if (data.capacity() == 0 || data.capacity() > RECV_BUFFER_POOL_MAX_CAPACITY)
+        return;
+    data.clear();
+    vRecvBufferPool.push_back(CSerializeData());
+    vRecvBufferPool.back().swap(data);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -714,10 +749,7 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
+    ReserveData(nCopy);
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
@@ -725,6 +757,22 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     return nCopy;
 }
 
+char* CNetMessage::GetDataBuffer(unsigned int& nSize)
+{
+    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    ReserveData(std::min(nRemaining, RECV_ALLOC_AHEAD));
+    nSize = vRecv.size() - nDataPos;
+    return nSize ? &vRecv[nDataPos] : NULL;
+}
+
+void CNetMessage::ReserveData(unsigned int nBytes)
+{
+    if (vRecv.size() < nDataPos + nBytes) {
+        // Allocate up to 256 KiB ahead, but never more than the total message size.
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nBytes + RECV_ALLOC_AHEAD));
+    }
+}
+
 
 
 
@@ -736,22 +784,53 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<std::pair<CSharedMessage, int64_t> >::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it).first->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = *(*it).first;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand as many queued messages as possible to a single sendmsg call
+        struct iovec iov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<std::pair<CSharedMessage, int64_t> >::iterator itv = it; itv != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++itv) {
+            const CSerializeData &data = *(*itv).first;
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nIov++;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            pnode->ChargeUploadTokens(nBytes);
+
+            // Step over the messages that went out completely
+            int64_t nNow = GetTimeMicros();
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nSize = (*it).first->size();
+                if (nLeft < nSize - pnode->nSendOffset) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nSize - pnode->nSendOffset;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= nSize;
+                pnode->nSendQueueLatency = (pnode->nSendQueueLatency * 7 + (nNow - (*it).second)) / 8;
                 it++;
-            } else {
+            }
+            if (pnode->nSendOffset != 0) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -1021,10 +1100,21 @@ void ThreadSocketHandler()
                     else {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        int nBytes;
+                        // large message bodies are received straight into the message,
+                        // everything else goes through pchBuf and is split up there
+                        unsigned int nDirect = 0;
+                        char* pchDirect = pnode->GetRecvDataBuffer(nDirect);
+                        bool fDirect = pchDirect && nDirect >= RECV_DIRECT_MIN;
+                        if (fDirect)
+                            nBytes = recv(pnode->hSocket, pchDirect, nDirect, MSG_DONTWAIT);
+                        else
+                            nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (fDirect)
+                                pnode->MarkRecvData(nBytes);
+                            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
@@ -1600,7 +1690,8 @@ void ThreadMessageHandler()
 
                     if (pnode->nSendSize < SendBufferSize())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        // a rate limited getdata is no reason to spin, it is retried once due
+                        if ((!pnode->vRecvGetData.empty() && !pnode->IsGetDataDelayed()) || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
                             fSleep = false;
                         }
@@ -1926,8 +2017,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // getdata replies then share the one serialized copy
+        mapRelay.insert(std::make_pair(inv, MakeSharedMessage("tx", ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -1936,7 +2028,10 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
 
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
-    CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(1000);
+    ss << tx;
+    CSharedMessage msg = MakeSharedMessage("txlreq", ss);
 
     //broadcast the new lock
     LOCK(cs_vNodes);
@@ -1945,11 +2040,84 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
         if(!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("txlreq", tx);
+        pnode->PushSharedMessage(msg);
     }
 
 }
 
+CAskForTable::CAskForTable(size_t nEntries) : vTable((nEntries + 1) & ~(size_t)1), nSalt(0), fSalted(false)
+{
+    BOOST_FOREACH(CEntry& entry, vTable)
+        entry.nRequestTime = 0;
+}
+
+CAskForTable::CEntry* CAskForTable::Find(const CInv& inv)
+{
+    // Salted lazily, the random generator is not seeded during static initialization
+    if (!fSalted)
+    {
+        nSalt = GetRand(std::numeric_limits<unsigned int>::max());
+        fSalted = true;
+    }
+
+    unsigned char key[36];
+    memcpy(key, &inv.type, 4);
+    memcpy(key + 4, inv.hash.begin(), 32);
+    size_t nBucket = MurmurHash3(nSalt, key, sizeof(key)) % (vTable.size() / 2);
+    return &vTable[nBucket * 2];
+}
+
+int64_t CAskForTable::Get(const CInv& inv)
+{
+    CEntry* pbucket = Find(inv);
+    for (int i = 0; i < 2; i++)
+        if (pbucket[i].nRequestTime != 0 && pbucket[i].inv.type == inv.type && pbucket[i].inv.hash == inv.hash)
+            return pbucket[i].nRequestTime;
+    return 0;
+}
+
+void CAskForTable::Set(const CInv& inv, int64_t nRequestTime)
+{
+    CEntry* pbucket = Find(inv);
+    CEntry* pslot = &pbucket[0];
+    for (int i = 0; i < 2; i++)
+    {
+        if (pbucket[i].nRequestTime != 0 && pbucket[i].inv.type == inv.type && pbucket[i].inv.hash == inv.hash)
+        {
+            pslot = &pbucket[i];
+            break;
+        }
+        if (pbucket[i].nRequestTime < pslot->nRequestTime)
+            pslot = &pbucket[i];
+    }
+    pslot->inv = inv;
+    pslot->nRequestTime = nRequestTime;
+}
+
+void CAskForTable::erase(const CInv& inv)
+{
+    CEntry* pbucket = Find(inv);
+    for (int i = 0; i < 2; i++)
+        if (pbucket[i].nRequestTime != 0 && pbucket[i].inv.type == inv.type && pbucket[i].inv.hash == inv.hash)
+            pbucket[i].nRequestTime = 0;
+}
+
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    ss << hdr;
+    ss += ssPayload;
+
+    CSerializeData* pdata = new CSerializeData();
+    ss.GetAndClear(*pdata);
+    return CSharedMessage(pdata);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -1960,6 +2128,109 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t nNow = GetTime();
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME < nNow)
+    {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = nNow;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t nLimit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = nLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return MAX_UPLOAD_TIMEFRAME;
+
+    uint64_t nCycleEndTime = nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME;
+    uint64_t nNow = GetTime();
+    return (nCycleEndTime < nNow) ? 0 : nCycleEndTime - nNow;
+}
+
+bool CNode::OutboundTargetReached(bool fHistoricalBlockServing)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (fHistoricalBlockServing)
+    {
+        // Historical blocks may use at most half of the pro rata budget of the
+        // rest of the cycle, recent blocks and masternode/IX traffic keep the rest
+        uint64_t nReserve = nMaxOutboundLimit / 2 * GetMaxOutboundTimeLeftInCycle() / MAX_UPLOAD_TIMEFRAME;
+        if (nReserve >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - nReserve)
+            return true;
+    }
+    else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+void CNode::SetMaxPeerUploadRate(uint64_t nBytesPerSecond)
+{
+    nMaxPeerUploadRate = nBytesPerSecond;
+}
+
+uint64_t CNode::GetMaxPeerUploadRate()
+{
+    return nMaxPeerUploadRate;
+}
+
+void CNode::RefillUploadTokens()
+{
+    int64_t nNow = GetTimeMicros();
+    int64_t nBurst = nMaxPeerUploadRate * UPLOAD_BURST_SECONDS;
+    int64_t nElapsed = std::min(nNow - nUploadTokensTime, UPLOAD_BURST_SECONDS * 1000000);
+    nUploadTokensTime = nNow;
+    if (nElapsed > 0)
+        nUploadTokens = std::min(nBurst, nUploadTokens + nElapsed * (int64_t)nMaxPeerUploadRate / 1000000);
+}
+
+void CNode::ChargeUploadTokens(uint64_t nBytes)
+{
+    if (nMaxPeerUploadRate == 0)
+        return;
+    RefillUploadTokens();
+    nUploadTokens -= nBytes;
+}
+
+int64_t CNode::GetUploadTokensDue()
+{
+    if (nMaxPeerUploadRate == 0)
+        return 0;
+    LOCK(cs_vSend);
+    RefillUploadTokens();
+    if (nUploadTokens > 0)
+        return 0;
+    return nUploadTokensTime + (1 - nUploadTokens) * 1000000 / (int64_t)nMaxPeerUploadRate + 1;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
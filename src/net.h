@@ -5,10 +5,10 @@
 #ifndef BITCOIN_NET_H
 #define BITCOIN_NET_H
 
+#include "bloom.h"
 #include "compat.h"
 #include "core.h"
 #include "hash.h"
-#include "limitedmap.h"
 #include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -25,6 +25,7 @@
 
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -53,6 +54,27 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Number of recent inventory items remembered per peer as already known to it */
+static const unsigned int INVENTORY_KNOWN_FILTER_SIZE = 20000;
+/** False positive rate of the per peer known inventory filter */
+static const double INVENTORY_KNOWN_FILTER_FPRATE = 0.000001;
+/** Number of queued messages handed to the socket in one sendmsg call */
+static const int MAX_SEND_IOVECS = 64;
+/** Message bodies are allocated at most this far ahead of the data received */
+static const unsigned int RECV_ALLOC_AHEAD = 256 * 1024;
+/** Bodies with at least this much left are read from the socket straight into the message */
+static const unsigned int RECV_DIRECT_MIN = 4 * 1024;
+/** Number of receive buffers kept per peer for reuse */
+static const unsigned int RECV_BUFFER_POOL_SIZE = 4;
+/** Receive buffers larger than this are freed instead of pooled */
+static const unsigned int RECV_BUFFER_POOL_MAX_CAPACITY = RECV_ALLOC_AHEAD;
+
+/** Length of the -maxuploadtarget accounting cycle in seconds */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** Blocks this much older than our best block count as historical, their serving is cut first */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** Seconds of -maxpeeruploadrate a peer may use in one burst */
+static const int64_t UPLOAD_BURST_SECONDS = 10;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -136,10 +158,45 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+/** A complete network message (header, checksum and payload) that is serialized
+ *  once and can be queued on any number of peers without copying */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload);
+
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
-extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
+
+/** Bounded table of the earliest time each inventory item may be requested
+ *  again. Items hash into two-slot buckets with a random salt; when both slots
+ *  are taken the entry with the earlier request time is replaced, which only
+ *  means that item may be asked for again sooner. */
+class CAskForTable
+{
+private:
+    struct CEntry
+    {
+        CInv inv;
+        int64_t nRequestTime; // 0 for an empty slot
+    };
+
+    std::vector<CEntry> vTable;
+    unsigned int nSalt;
+    bool fSalted;
+
+    CEntry* Find(const CInv& inv);
+
+public:
+    CAskForTable(size_t nEntries);
+
+    // Next request time of the item, 0 if unknown
+    int64_t Get(const CInv& inv);
+    void Set(const CInv& inv, int64_t nRequestTime);
+    void erase(const CInv& inv);
+};
+
+extern CAskForTable mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
@@ -180,6 +237,7 @@ public:
     bool fSyncNode;
     double dPingTime;
     double dPingWait;
+    double dSendQueueLatency;
     std::string addrLocal;
 };
 
@@ -219,6 +277,16 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    // Space allocated for the rest of the body, so it can be received in place
+    char* GetDataBuffer(unsigned int& nSize);
+    void MarkDataRead(unsigned int nBytes)
+    {
+        nDataPos += nBytes;
+    }
+
+private:
+    void ReserveData(unsigned int nBytes);
 };
 
 typedef enum BanReason
@@ -318,12 +386,14 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<std::pair<CSharedMessage, int64_t> > vSendMsg; // with the time (usec) each was queued
+    int64_t nSendQueueLatency; // moving average of usec a message waits in vSendMsg
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    std::vector<CSerializeData> vRecvBufferPool; // emptied bodies of processed messages, reused for new ones
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -381,7 +451,7 @@ public:
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
@@ -389,6 +459,14 @@ public:
 
     SecMsgNode smsgData;
 
+    // Upload token bucket in bytes, refilled at -maxpeeruploadrate; guarded by cs_vSend
+    int64_t nUploadTokens;
+    int64_t nUploadTokensTime;
+    // Time (in usec) a rate limited getdata may be answered again, and whether a historical
+    // block was already refused for the upload target; only used by the message handler thread
+    int64_t nGetDataDelayedUntil;
+    bool fHistoricalRefused;
+
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
     uint64_t nPingNonceSent;
@@ -399,11 +477,13 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000),
+        filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, INVENTORY_KNOWN_FILTER_FPRATE)
     {
         nServices = 0;
         hSocket = hSocketIn;
         nRecvVersion = INIT_PROTO_VERSION;
+        vRecvBufferPool.reserve(RECV_BUFFER_POOL_SIZE);
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
@@ -423,7 +503,12 @@ public:
         fDisconnect = false;
         nRefCount = 0;
         nSendSize = 0;
+        nSendQueueLatency = 0;
         nSendOffset = 0;
+        nUploadTokens = nMaxPeerUploadRate * UPLOAD_BURST_SECONDS;
+        nUploadTokensTime = GetTimeMicros();
+        nGetDataDelayedUntil = 0;
+        fHistoricalRefused = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
@@ -432,7 +517,6 @@ public:
         fGetAddr = false;
         fRelayTxes = false;
         hashCheckpointKnown = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
         nPingNonceSent = 0;
         nPingUsecStart = 0;
         nPingUsecTime = 0;
@@ -467,6 +551,14 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Outbound limit, bytes sent in the current -maxuploadtarget cycle
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxPeerUploadRate;
+
+    void RefillUploadTokens();
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -493,6 +585,18 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    char* GetRecvDataBuffer(unsigned int& nSize);
+
+    // requires LOCK(cs_vRecvMsg)
+    void MarkRecvData(unsigned int nBytes)
+    {
+        vRecvMsg.back().MarkDataRead(nBytes);
+    }
+
+    // requires LOCK(cs_vRecvMsg)
+    void RecycleRecvMsg(CNetMessage& msg);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -538,15 +642,21 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv);
         }
     }
 
+    bool HasInventoryKnown(const CInv& inv)
+    {
+        LOCK(cs_inventory);
+        return filterInventoryKnown.contains(inv);
+    }
+
     void PushInventory(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -562,12 +672,7 @@ public:
 
         // We're using mapAskFor as a priority queue,
         // the key is the earliest time the request can be sent
-        int64_t nRequestTime;
-        limitedmap<CInv, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv);
-        if (it != mapAlreadyAskedFor.end())
-            nRequestTime = it->second;
-        else
-            nRequestTime = 0;
+        int64_t nRequestTime = mapAlreadyAskedFor.Get(inv);
         LogPrint("net", "askfor %s   %d (%s)\n", inv.ToString().c_str(), nRequestTime, DateTimeStrFormat("%H:%M:%S", nRequestTime/1000000).c_str());
 
         // Make sure not to reuse time indexes to keep things in the same order
@@ -582,10 +687,7 @@ public:
         	nRequestTime = nNow;
         else
             nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
-        if (it != mapAlreadyAskedFor.end())
-            mapAlreadyAskedFor.update(it, nRequestTime);
-        else
-            mapAlreadyAskedFor.insert(std::make_pair(inv, nRequestTime));
+        mapAlreadyAskedFor.Set(inv, nRequestTime);
         mapAskFor.insert(std::make_pair(nRequestTime, inv));
     }
 
@@ -639,17 +741,32 @@ public:
 
         LogPrint("net", "(%d bytes)\n", nSize);
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        CSerializeData* pdata = new CSerializeData();
+        ssSend.GetAndClear(*pdata);
+        vSendMsg.push_back(std::make_pair(CSharedMessage(pdata), GetTimeMicros()));
+        nSendSize += pdata->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    // Queue a message built with MakeSharedMessage, the buffer is shared with
+    // every other peer it is queued on
+    void PushSharedMessage(const CSharedMessage& msg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: shared message (%u bytes)\n", msg->size());
+        vSendMsg.push_back(std::make_pair(msg, GetTimeMicros()));
+        nSendSize += msg->size();
+
+        // If write queue empty, attempt "optimistic write"
+        if (vSendMsg.size() == 1)
+            SocketSendData(this);
+    }
+
     void PushVersion();
 
 
@@ -919,6 +1036,23 @@ template<typename T1, typename T2, typename T3, typename T4, typename T5, typena
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    // Upload limits
+    static void SetMaxOutboundTarget(uint64_t nLimit);
+    static uint64_t GetMaxOutboundTarget();
+    static bool OutboundTargetReached(bool fHistoricalBlockServing);
+    static uint64_t GetOutboundTargetBytesLeft();
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
+    static void SetMaxPeerUploadRate(uint64_t nBytesPerSecond);
+    static uint64_t GetMaxPeerUploadRate();
+
+    // Charge sent bytes against this peer's upload rate (cs_vSend must be held)
+    void ChargeUploadTokens(uint64_t nBytes);
+    // 0 if the peer is within its upload rate, otherwise the time (in usec) it will be again;
+    // historical blocks wait until then
+    int64_t GetUploadTokensDue();
+    // Whether getdata answers are held back by the upload rate
+    bool IsGetDataDelayed() { return nGetDataDelayedUntil > GetTimeMicros(); }
 };
 
 inline void RelayInventory(const CInv& inv)
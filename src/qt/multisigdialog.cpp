@@ -369,6 +369,7 @@ void MultisigDialog::on_signTransactionButton_clicked()
         return;
     }
     CTransaction mergedTx(tx);
+    mergedTx.InvalidateHash(); // scriptSigs are replaced below
 
     // Fetch previous transactions (inputs)
     std::map<COutPoint, CScript> mapPrevOut;
@@ -142,6 +142,9 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "sendalert", 6 },
     { "sendmany", 1 },
     { "sendmany", 2 },
+    { "sendbatch", 1 },
+    { "sendbatch", 2 },
+    { "sendbatch", 4 },
     { "reservebalance", 0 },
     { "reservebalance", 1 },
     { "createmultisig", 0 },
@@ -167,6 +170,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "searchrawtransactions", 1 },
     { "searchrawtransactions", 2 },
     { "searchrawtransactions", 3 },
+    { "searchrawtransactions", 4 },
+    { "getaddressutxos", 1 },
 };
 
 class CRPCConvertTable
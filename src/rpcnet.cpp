@@ -90,6 +90,7 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("conntime", (int64_t)stats.nTimeConnected));
         obj.push_back(Pair("timeoffset", stats.nTimeOffset));
         obj.push_back(Pair("pingtime", stats.dPingTime));
+        obj.push_back(Pair("sendqueuelatency", stats.dSendQueueLatency));
         if (stats.dPingWait > 0.0)
             obj.push_back(Pair("pingwait", stats.dPingWait));
         obj.push_back(Pair("version", stats.nVersion));
@@ -98,6 +99,7 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         if (fStateStats) {
             obj.push_back(Pair("banscore", statestats.nMisbehavior));
+            obj.push_back(Pair("inflight", statestats.nBlocksInFlight));
         }
         obj.push_back(Pair("syncnode", stats.fSyncNode));
 
@@ -310,12 +312,22 @@ Value getnettotals(const Array& params, bool fHelp)
         throw runtime_error(
             "getnettotals\n"
             "Returns information about network traffic, including bytes in, bytes out,\n"
-            "and current time.");
+            "current time and the state of the -maxuploadtarget budget.");
 
     Object obj;
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    Object outboundLimit;
+    outboundLimit.push_back(Pair("timeframe", MAX_UPLOAD_TIMEFRAME));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    outboundLimit.push_back(Pair("peer_upload_rate", CNode::GetMaxPeerUploadRate()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
     return obj;
 }
 
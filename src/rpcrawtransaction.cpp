@@ -386,6 +386,7 @@ Value signrawtransaction(const Array& params, bool fHelp)
     // mergedTx will end up with all the signatures; it
     // starts as a clone of the rawtx:
     CTransaction mergedTx(txVariants[0]);
+    mergedTx.InvalidateHash(); // scriptSigs are replaced below
     bool fComplete = true;
 
     // Fetch previous transactions (inputs):
@@ -599,23 +600,36 @@ Value sendrawtransaction(const Array& params, bool fHelp)
 }
 
 
-Value searchrawtransactions(const Array &params, bool fHelp)
+static uint160 AddrIndexIdFromParam(const Value& param)
 {
-    if (fHelp || params.size() < 1 || params.size() > 4)
-        throw runtime_error(
-            "searchrawtransactions <address> [verbose=1] [skip=0] [count=100]\n");
+    // without the index every address would look empty
+    if (!GetBoolArg("-addrindex", false))
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index is disabled, restart with -addrindex");
 
-    CTransfercoinAddress address(params[0].get_str());
+    CTransfercoinAddress address(param.get_str());
     if (!address.IsValid())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
-    CTxDestination dest = address.Get();
+    uint160 addrId;
+    if (!GetAddrIndexId(address.Get(), addrId))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Cannot search for address");
+    return addrId;
+}
 
-    std::vector<uint256> vtxhash;
-    if (!FindTransactionsByDestination(dest, vtxhash))
-        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+Value searchrawtransactions(const Array &params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 5)
+        throw runtime_error(
+            "searchrawtransactions <address> [verbose=1] [skip=0] [count=100] [startheight=0]\n"
+            "Returns the transactions of <address> in chain order.\n"
+            "A negative skip counts from the most recent transaction. To page through a long\n"
+            "history pass the height of the last returned transaction as startheight and the\n"
+            "number of returned transactions at that height as skip.\n");
+
+    uint160 addrId = AddrIndexIdFromParam(params[0]);
 
     int nSkip = 0;
     int nCount = 100;
+    int nStartHeight = 0;
     bool fVerbose = true;
     if (params.size() > 1)
         fVerbose = (params[1].get_int() != 0);
@@ -623,30 +637,69 @@ Value searchrawtransactions(const Array &params, bool fHelp)
         nSkip = params[2].get_int();
     if (params.size() > 3)
         nCount = params[3].get_int();
+    if (params.size() > 4)
+        nStartHeight = params[4].get_int();
+
+    if (nCount < 0)
+        nCount = 0;
+
+    LOCK(cs_main);
+    CTxDB txdb("r");
 
     if (nSkip < 0)
-        nSkip += vtxhash.size();
+    {
+        CAddrSummary summary;
+        if (!txdb.ReadAddrSummary(addrId, summary))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+        nSkip += summary.nTxCount;
+        nStartHeight = 0;
+    }
     if (nSkip < 0)
         nSkip = 0;
-    if (nCount < 0)
-        nCount = 0;
 
-    std::vector<uint256>::const_iterator it = vtxhash.begin();
-    while (it != vtxhash.end() && nSkip--) it++;
+    std::vector<CAddrIndexEntry> vEntries;
+    unsigned int nMaxEntries = std::min((int64_t)nSkip + nCount, (int64_t)std::numeric_limits<int>::max());
+    if (nCount > 0 && !txdb.ReadAddrIndex(addrId, vEntries, nStartHeight, std::numeric_limits<int>::max(), nMaxEntries))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
 
+    // Entries come in chain order, so each block is read from disk once and
+    // the transactions are taken from it instead of looking each one up.
     Array result;
-    while (it != vtxhash.end() && nCount--) {
+    CBlockIndex* pindex = NULL;
+    CBlock block;
+    bool fHaveBlock = false;
+    for (unsigned int i = nSkip; i < vEntries.size(); i++)
+    {
+        const CAddrIndexKey& key = vEntries[i].first;
+        const uint256& txHash = vEntries[i].second.txHash;
+
+        if (!pindex || pindex->nHeight != key.nHeight)
+        {
+            pindex = NULL;
+            if (key.nHeight <= nBestHeight)
+                pindex = FindBlockByHeight(key.nHeight);
+            fHaveBlock = pindex && block.ReadFromDisk(pindex, true);
+        }
+
         CTransaction tx;
-        uint256 hashBlock;
-        if (!GetTransaction(*it, tx, hashBlock))
+        uint256 hashBlock = 0;
+        bool fFound = false;
+        if (fHaveBlock && key.nTxIndex < block.vtx.size() && block.vtx[key.nTxIndex].GetHash() == txHash)
+        {
+            tx = block.vtx[key.nTxIndex];
+            hashBlock = pindex->GetBlockHash();
+            fFound = true;
+        }
+        else
+            fFound = GetTransaction(txHash, tx, hashBlock);
+
+        if (!fFound)
         {
-           // throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Cannot read transaction from disk");
-           Object obj;
-	   obj.push_back(Pair("ERROR", "Cannot read transaction from disk"));
-	   result.push_back(obj);
-	}
-	else
-	{
+            Object obj;
+            obj.push_back(Pair("ERROR", "Cannot read transaction from disk"));
+            result.push_back(obj);
+            continue;
+        }
 
         CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
         ssTx << tx;
@@ -654,14 +707,76 @@ Value searchrawtransactions(const Array &params, bool fHelp)
         if (fVerbose) {
             Object object;
             TxToJSON(tx, hashBlock, object);
+            object.push_back(Pair("height", key.nHeight));
             object.push_back(Pair("hex", strHex));
             result.push_back(object);
         } else {
             result.push_back(strHex);
         }
-      
-        }
-        it++;
+    }
+    return result;
+}
+
+Value getaddressbalance(const Array &params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <address>\n"
+            "Returns the balance and totals of <address> from the address index.\n");
+
+    uint160 addrId = AddrIndexIdFromParam(params[0]);
+
+    CAddrSummary summary;
+    {
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        txdb.ReadAddrSummary(addrId, summary);
+    }
+
+    Object result;
+    result.push_back(Pair("balance", ValueFromAmount(summary.nBalance)));
+    result.push_back(Pair("received", ValueFromAmount(summary.nReceived)));
+    result.push_back(Pair("sent", ValueFromAmount(summary.nSent)));
+    result.push_back(Pair("txcount", (int64_t)summary.nTxCount));
+    return result;
+}
+
+Value getaddressutxos(const Array &params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "getaddressutxos <address> [minconf=1]\n"
+            "Returns the unspent outputs of <address> from the address index.\n");
+
+    uint160 addrId = AddrIndexIdFromParam(params[0]);
+
+    int nMinDepth = 1;
+    if (params.size() > 1)
+        nMinDepth = params[1].get_int();
+
+    LOCK(cs_main);
+    std::vector<CAddrUnspentEntry> vEntries;
+    {
+        CTxDB txdb("r");
+        if (!txdb.ReadAddrUnspent(addrId, vEntries))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+    }
+
+    Array result;
+    BOOST_FOREACH(const CAddrUnspentEntry& entry, vEntries)
+    {
+        int nDepth = 1 + nBestHeight - entry.second.nHeight;
+        if (nDepth < nMinDepth)
+            continue;
+
+        Object obj;
+        obj.push_back(Pair("txid", entry.first.outpoint.hash.GetHex()));
+        obj.push_back(Pair("vout", (int64_t)entry.first.outpoint.n));
+        obj.push_back(Pair("scriptPubKey", HexStr(entry.second.scriptPubKey.begin(), entry.second.scriptPubKey.end())));
+        obj.push_back(Pair("amount", ValueFromAmount(entry.second.nValue)));
+        obj.push_back(Pair("height", entry.second.nHeight));
+        obj.push_back(Pair("confirmations", nDepth));
+        result.push_back(obj);
     }
     return result;
 }
@@ -28,7 +28,9 @@
 #include <boost/iostreams/stream.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <list>
+#include <set>
 
 using namespace std;
 using namespace boost;
@@ -43,6 +45,11 @@ static map<string, boost::shared_ptr<deadline_timer> > deadlineTimers;
 static ssl::context* rpc_ssl_context = NULL;
 static boost::thread_group* rpc_worker_group = NULL;
 
+// Default for -rpcworkqueue, requests beyond this depth get a 503
+static const int DEFAULT_RPC_WORK_QUEUE = 16;
+// Default for -rpcmaxconnections, open HTTP connections served at once
+static const int DEFAULT_RPC_MAX_CONNECTIONS = 64;
+
 void RPCTypeCheck(const Array& params,
                   const list<Value_type>& typesExpected,
                   bool fAllowNull)
@@ -217,117 +224,121 @@ Value stop(const Array& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      actor (function)         okSafeMode threadSafe reqWallet
-  //  ------------------------  -----------------------  ---------- ---------- ---------
-    { "help",                   &help,                   true,      true,      false },
-    { "stop",                   &stop,                   true,      true,      false },
-    { "getbestblockhash",       &getbestblockhash,       true,      false,     false },
-    { "getblockcount",          &getblockcount,          true,      false,     false },
-    { "getconnectioncount",     &getconnectioncount,     true,      false,     false },
-    { "getpeerinfo",            &getpeerinfo,            true,      false,     false },
-    { "addnode",                &addnode,                true,      true,      false },
-    { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,      false },
-    { "ping",                   &ping,                   true,      false,     false },
-    { "setban",                 &setban,                 true,      false,     false },
-    { "listbanned",             &listbanned,             true,      false,     false },
-    { "clearbanned",            &clearbanned,            true,      false,     false },
-    { "getnettotals",           &getnettotals,           true,      true,      false },
-    { "getdifficulty",          &getdifficulty,          true,      false,     false },
-    { "getinfo",                &getinfo,                true,      false,     false },
-    { "getrawmempool",          &getrawmempool,          true,      false,     false },
-    { "getblock",               &getblock,               false,     false,     false },
-    { "getblockbynumber",       &getblockbynumber,       false,     false,     false },
-    { "getblockhash",           &getblockhash,           false,     false,     false },
-    { "getrawtransaction",      &getrawtransaction,      false,     false,     false },
-    { "createrawtransaction",   &createrawtransaction,   false,     false,     false },
-    { "decoderawtransaction",   &decoderawtransaction,   false,     false,     false },
-    { "decodescript",           &decodescript,           false,     false,     false },
-    { "signrawtransaction",     &signrawtransaction,     false,     false,     false },
-    { "sendrawtransaction",     &sendrawtransaction,     false,     false,     false },
-    { "getcheckpoint",          &getcheckpoint,          true,      false,     false },
-    { "sendalert",              &sendalert,              false,     false,     false },
-    { "validateaddress",        &validateaddress,        true,      false,     false },
-    { "validatepubkey",         &validatepubkey,         true,      false,     false },
-    { "verifymessage",          &verifymessage,          false,     false,     false },
-    { "searchrawtransactions",  &searchrawtransactions,  false,     false,     false },
+{ //  name                      actor (function)         okSafeMode locks            reqWallet
+  //  ------------------------  -----------------------  ---------- ---------------- ---------
+    { "help",                   &help,                   true,      RPC_LOCK_NONE,   false },
+    { "stop",                   &stop,                   true,      RPC_LOCK_NONE,   false },
+    { "getrpcinfo",             &getrpcinfo,             true,      RPC_LOCK_NONE,   false },
+    { "getbestblockhash",       &getbestblockhash,       true,      RPC_LOCK_MAIN,   false },
+    { "getblockcount",          &getblockcount,          true,      RPC_LOCK_NONE,   false },
+    { "getconnectioncount",     &getconnectioncount,     true,      RPC_LOCK_NONE,   false },
+    { "getpeerinfo",            &getpeerinfo,            true,      RPC_LOCK_MAIN,   false },
+    { "addnode",                &addnode,                true,      RPC_LOCK_NONE,   false },
+    { "getaddednodeinfo",       &getaddednodeinfo,       true,      RPC_LOCK_NONE,   false },
+    { "ping",                   &ping,                   true,      RPC_LOCK_MAIN,   false },
+    { "setban",                 &setban,                 true,      RPC_LOCK_MAIN,   false },
+    { "listbanned",             &listbanned,             true,      RPC_LOCK_MAIN,   false },
+    { "clearbanned",            &clearbanned,            true,      RPC_LOCK_MAIN,   false },
+    { "getnettotals",           &getnettotals,           true,      RPC_LOCK_NONE,   false },
+    { "getdifficulty",          &getdifficulty,          true,      RPC_LOCK_MAIN,   false },
+    { "getinfo",                &getinfo,                true,      RPC_LOCK_WALLET, false },
+    { "getrawmempool",          &getrawmempool,          true,      RPC_LOCK_NONE,   false },
+    { "getblock",               &getblock,               false,     RPC_LOCK_MAIN,   false },
+    { "getblockbynumber",       &getblockbynumber,       false,     RPC_LOCK_MAIN,   false },
+    { "getblockhash",           &getblockhash,           false,     RPC_LOCK_MAIN,   false },
+    { "getrawtransaction",      &getrawtransaction,      false,     RPC_LOCK_MAIN,   false },
+    { "createrawtransaction",   &createrawtransaction,   false,     RPC_LOCK_MAIN,   false },
+    { "decoderawtransaction",   &decoderawtransaction,   false,     RPC_LOCK_MAIN,   false },
+    { "decodescript",           &decodescript,           false,     RPC_LOCK_MAIN,   false },
+    { "signrawtransaction",     &signrawtransaction,     false,     RPC_LOCK_WALLET, false },
+    { "sendrawtransaction",     &sendrawtransaction,     false,     RPC_LOCK_MAIN,   false },
+    { "getcheckpoint",          &getcheckpoint,          true,      RPC_LOCK_MAIN,   false },
+    { "sendalert",              &sendalert,              false,     RPC_LOCK_MAIN,   false },
+    { "validateaddress",        &validateaddress,        true,      RPC_LOCK_WALLET, false },
+    { "validatepubkey",         &validatepubkey,         true,      RPC_LOCK_WALLET, false },
+    { "verifymessage",          &verifymessage,          false,     RPC_LOCK_MAIN,   false },
+    { "searchrawtransactions",  &searchrawtransactions,  false,     RPC_LOCK_MAIN,   false },
+    { "getaddressbalance",      &getaddressbalance,      false,     RPC_LOCK_MAIN,   false },
+    { "getaddressutxos",        &getaddressutxos,        false,     RPC_LOCK_MAIN,   false },
 
 /* Dark features */
-    { "spork",                  &spork,                  true,      false,      false },
-    { "masternode",             &masternode,             true,      false,      true },
-    { "masternodelist",         &masternodelist,         true,      false,      false },
+    { "spork",                  &spork,                  true,      RPC_LOCK_MAIN,   false },
+    { "masternode",             &masternode,             true,      RPC_LOCK_WALLET, true },
+    { "masternodelist",         &masternodelist,         true,      RPC_LOCK_MAIN,   false },
     
 #ifdef ENABLE_WALLET
-    { "darksend",               &darksend,               false,     false,      true },
-    { "getmininginfo",          &getmininginfo,          true,      false,     false },
-    { "getstakinginfo",         &getstakinginfo,         true,      false,     false },
-    { "getnewaddress",          &getnewaddress,          true,      false,     true },
-    { "getnewpubkey",           &getnewpubkey,           true,      false,     true },
-    { "getaccountaddress",      &getaccountaddress,      true,      false,     true },
-    { "setaccount",             &setaccount,             true,      false,     true },
-    { "getaccount",             &getaccount,             false,     false,     true },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,      false,     true },
-    { "sendtoaddress",          &sendtoaddress,          false,     false,     true },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,     false,     true },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,     false,     true },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,     false,     true },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,     false,     true },
-    { "backupwallet",           &backupwallet,           true,      false,     true },
-    { "keypoolrefill",          &keypoolrefill,          true,      false,     true },
-    { "walletpassphrase",       &walletpassphrase,       true,      false,     true },
-    { "walletpassphrasechange", &walletpassphrasechange, false,     false,     true },
-    { "walletlock",             &walletlock,             true,      false,     true },
-    { "encryptwallet",          &encryptwallet,          false,     false,     true },
-    { "getbalance",             &getbalance,             false,     false,     true },
-    { "move",                   &movecmd,                false,     false,     true },
-    { "sendfrom",               &sendfrom,               false,     false,     true },
-    { "sendmany",               &sendmany,               false,     false,     true },
-    { "addmultisigaddress",     &addmultisigaddress,     false,     false,     true },
-    { "addredeemscript",        &addredeemscript,        false,     false,     true },
-    { "gettransaction",         &gettransaction,         false,     false,     true },
-    { "listtransactions",       &listtransactions,       false,     false,     true },
-    { "listaddressgroupings",   &listaddressgroupings,   false,     false,     true },
-    { "signmessage",            &signmessage,            false,     false,     true },
-    { "getwork",                &getwork,                true,      false,     true },
-    { "getworkex",              &getworkex,              true,      false,     true },
-    { "listaccounts",           &listaccounts,           false,     false,     true },
-    { "getblocktemplate",       &getblocktemplate,       true,      false,     false },
-    { "submitblock",            &submitblock,            false,     false,     false },
-    { "listsinceblock",         &listsinceblock,         false,     false,     true },
-    { "dumpprivkey",            &dumpprivkey,            false,     false,     true },
-    { "dumpwallet",             &dumpwallet,             true,      false,     true },
-    { "importprivkey",          &importprivkey,          false,     false,     true },
-    { "importwallet",           &importwallet,           false,     false,     true },
-    { "importaddress",          &importaddress,          false,     false,     true },
-    { "listunspent",            &listunspent,            false,     false,     true },
-    { "settxfee",               &settxfee,               false,     false,     true },
-    { "getsubsidy",             &getsubsidy,             true,      true,      false },
-    { "getstakesubsidy",        &getstakesubsidy,        true,      true,      false },
-    { "reservebalance",         &reservebalance,         false,     true,      true },
-    { "createmultisig",         &createmultisig,         true,      true,      false },
-    { "checkwallet",            &checkwallet,            false,     true,      true },
-    { "repairwallet",           &repairwallet,           false,     true,      true },
-    { "resendtx",               &resendtx,               false,     true,      true },
-    { "makekeypair",            &makekeypair,            false,     true,      false },
-    { "checkkernel",            &checkkernel,            true,      false,     true },
-    { "getnewstealthaddress",   &getnewstealthaddress,   false,     false,     true },
-    { "liststealthaddresses",   &liststealthaddresses,   false,     false,     true },
-    { "scanforalltxns",         &scanforalltxns,         false,     false,     false },
-    { "scanforstealthtxns",     &scanforstealthtxns,     false,     false,     false },
-    { "importstealthaddress",   &importstealthaddress,   false,     false,     true },
-    { "sendtostealthaddress",   &sendtostealthaddress,   false,     false,     true },
-    { "smsgenable",             &smsgenable,             false,     false,     false },
-    { "smsgdisable",            &smsgdisable,            false,     false,     false },
-    { "smsglocalkeys",          &smsglocalkeys,          false,     false,     false },
-    { "smsgoptions",            &smsgoptions,            false,     false,     false },
-    { "smsgscanchain",          &smsgscanchain,          false,     false,     false },
-    { "smsgscanbuckets",        &smsgscanbuckets,        false,     false,     false },
-    { "smsgaddkey",             &smsgaddkey,             false,     false,     false },
-    { "smsggetpubkey",          &smsggetpubkey,          false,     false,     false },
-    { "smsgsend",               &smsgsend,               false,     false,     false },
-    { "smsgsendanon",           &smsgsendanon,           false,     false,     false },
-    { "smsginbox",              &smsginbox,              false,     false,     false },
-    { "smsgoutbox",             &smsgoutbox,             false,     false,     false },
-    { "smsgbuckets",            &smsgbuckets,            false,     false,     false },
+    { "darksend",               &darksend,               false,     RPC_LOCK_WALLET, true },
+    { "getmininginfo",          &getmininginfo,          true,      RPC_LOCK_WALLET, false },
+    { "getstakinginfo",         &getstakinginfo,         true,      RPC_LOCK_WALLET, false },
+    { "getnewaddress",          &getnewaddress,          true,      RPC_LOCK_WALLET, true },
+    { "getnewpubkey",           &getnewpubkey,           true,      RPC_LOCK_WALLET, true },
+    { "getaccountaddress",      &getaccountaddress,      true,      RPC_LOCK_WALLET, true },
+    { "setaccount",             &setaccount,             true,      RPC_LOCK_WALLET, true },
+    { "getaccount",             &getaccount,             false,     RPC_LOCK_WALLET, true },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,      RPC_LOCK_WALLET, true },
+    { "sendtoaddress",          &sendtoaddress,          false,     RPC_LOCK_WALLET, true },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,     RPC_LOCK_WALLET, true },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,     RPC_LOCK_WALLET, true },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,     RPC_LOCK_WALLET, true },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,     RPC_LOCK_WALLET, true },
+    { "backupwallet",           &backupwallet,           true,      RPC_LOCK_WALLET, true },
+    { "keypoolrefill",          &keypoolrefill,          true,      RPC_LOCK_WALLET, true },
+    { "walletpassphrase",       &walletpassphrase,       true,      RPC_LOCK_WALLET, true },
+    { "walletpassphrasechange", &walletpassphrasechange, false,     RPC_LOCK_WALLET, true },
+    { "walletlock",             &walletlock,             true,      RPC_LOCK_WALLET, true },
+    { "encryptwallet",          &encryptwallet,          false,     RPC_LOCK_WALLET, true },
+    { "getbalance",             &getbalance,             false,     RPC_LOCK_WALLET, true },
+    { "move",                   &movecmd,                false,     RPC_LOCK_WALLET, true },
+    { "sendfrom",               &sendfrom,               false,     RPC_LOCK_WALLET, true },
+    { "sendmany",               &sendmany,               false,     RPC_LOCK_WALLET, true },
+    { "sendbatch",              &sendbatch,              false,     RPC_LOCK_WALLET, true },
+    { "addmultisigaddress",     &addmultisigaddress,     false,     RPC_LOCK_WALLET, true },
+    { "addredeemscript",        &addredeemscript,        false,     RPC_LOCK_WALLET, true },
+    { "gettransaction",         &gettransaction,         false,     RPC_LOCK_WALLET, true },
+    { "listtransactions",       &listtransactions,       false,     RPC_LOCK_WALLET, true },
+    { "listaddressgroupings",   &listaddressgroupings,   false,     RPC_LOCK_WALLET, true },
+    { "signmessage",            &signmessage,            false,     RPC_LOCK_WALLET, true },
+    { "getwork",                &getwork,                true,      RPC_LOCK_WALLET, true },
+    { "getworkex",              &getworkex,              true,      RPC_LOCK_WALLET, true },
+    { "listaccounts",           &listaccounts,           false,     RPC_LOCK_WALLET, true },
+    { "getblocktemplate",       &getblocktemplate,       true,      RPC_LOCK_MAIN,   false },
+    { "submitblock",            &submitblock,            false,     RPC_LOCK_MAIN,   false },
+    { "listsinceblock",         &listsinceblock,         false,     RPC_LOCK_WALLET, true },
+    { "dumpprivkey",            &dumpprivkey,            false,     RPC_LOCK_WALLET, true },
+    { "dumpwallet",             &dumpwallet,             true,      RPC_LOCK_WALLET, true },
+    { "importprivkey",          &importprivkey,          false,     RPC_LOCK_WALLET, true },
+    { "importwallet",           &importwallet,           false,     RPC_LOCK_WALLET, true },
+    { "importaddress",          &importaddress,          false,     RPC_LOCK_WALLET, true },
+    { "listunspent",            &listunspent,            false,     RPC_LOCK_WALLET, true },
+    { "settxfee",               &settxfee,               false,     RPC_LOCK_WALLET, true },
+    { "getsubsidy",             &getsubsidy,             true,      RPC_LOCK_NONE,   false },
+    { "getstakesubsidy",        &getstakesubsidy,        true,      RPC_LOCK_NONE,   false },
+    { "reservebalance",         &reservebalance,         false,     RPC_LOCK_NONE,   true },
+    { "createmultisig",         &createmultisig,         true,      RPC_LOCK_NONE,   false },
+    { "checkwallet",            &checkwallet,            false,     RPC_LOCK_NONE,   true },
+    { "repairwallet",           &repairwallet,           false,     RPC_LOCK_NONE,   true },
+    { "resendtx",               &resendtx,               false,     RPC_LOCK_NONE,   true },
+    { "makekeypair",            &makekeypair,            false,     RPC_LOCK_NONE,   false },
+    { "checkkernel",            &checkkernel,            true,      RPC_LOCK_WALLET, true },
+    { "getnewstealthaddress",   &getnewstealthaddress,   false,     RPC_LOCK_WALLET, true },
+    { "liststealthaddresses",   &liststealthaddresses,   false,     RPC_LOCK_WALLET, true },
+    { "scanforalltxns",         &scanforalltxns,         false,     RPC_LOCK_WALLET, false },
+    { "scanforstealthtxns",     &scanforstealthtxns,     false,     RPC_LOCK_WALLET, false },
+    { "importstealthaddress",   &importstealthaddress,   false,     RPC_LOCK_WALLET, true },
+    { "sendtostealthaddress",   &sendtostealthaddress,   false,     RPC_LOCK_WALLET, true },
+    { "smsgenable",             &smsgenable,             false,     RPC_LOCK_WALLET, false },
+    { "smsgdisable",            &smsgdisable,            false,     RPC_LOCK_WALLET, false },
+    { "smsglocalkeys",          &smsglocalkeys,          false,     RPC_LOCK_WALLET, false },
+    { "smsgoptions",            &smsgoptions,            false,     RPC_LOCK_WALLET, false },
+    { "smsgscanchain",          &smsgscanchain,          false,     RPC_LOCK_WALLET, false },
+    { "smsgscanbuckets",        &smsgscanbuckets,        false,     RPC_LOCK_WALLET, false },
+    { "smsgaddkey",             &smsgaddkey,             false,     RPC_LOCK_WALLET, false },
+    { "smsggetpubkey",          &smsggetpubkey,          false,     RPC_LOCK_WALLET, false },
+    { "smsgsend",               &smsgsend,               false,     RPC_LOCK_WALLET, false },
+    { "smsgsendanon",           &smsgsendanon,           false,     RPC_LOCK_WALLET, false },
+    { "smsginbox",              &smsginbox,              false,     RPC_LOCK_WALLET, false },
+    { "smsgoutbox",             &smsgoutbox,             false,     RPC_LOCK_WALLET, false },
+    { "smsgbuckets",            &smsgbuckets,            false,     RPC_LOCK_WALLET, false },
 #endif
 };
 
@@ -362,14 +373,22 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+void ErrorReply(const Object& objError, const Value& id, int& nStatus, string& strReply)
 {
-    // Send error reply from json-rpc error object
-    int nStatus = HTTP_INTERNAL_SERVER_ERROR;
+    // Build error reply from json-rpc error object
+    nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
-    string strReply = JSONRPCReply(Value::null, objError, id);
+    strReply = JSONRPCReply(Value::null, objError, id);
+}
+
+void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+{
+    // Send error reply from json-rpc error object
+    int nStatus;
+    string strReply;
+    ErrorReply(objError, id, nStatus, strReply);
     stream << HTTPReply(nStatus, strReply, false) << std::flush;
 }
 
@@ -404,6 +423,8 @@ public:
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+    // Abort blocking reads and writes from another thread
+    virtual void shutdown() = 0;
 };
 
 template <typename Protocol>
@@ -435,6 +456,12 @@ public:
         _stream.close();
     }
 
+    virtual void shutdown()
+    {
+        boost::system::error_code ec;
+        sslStream.lowest_layer().shutdown(socket_base::shutdown_both, ec);
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
@@ -445,6 +472,99 @@ private:
 
 void ServiceConnection(AcceptedConnection *conn);
 
+/**
+ * A request handed from a connection thread to the RPC workers. The
+ * connection thread waits on it until a worker has filled in the reply.
+ */
+class CRPCWorkItem
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fDone;
+
+public:
+    Value valRequest;
+    int64_t nQueuedTime; // usec
+    int nStatus;
+    string strReply;
+    bool fError;
+
+    CRPCWorkItem(const Value& valRequestIn) : fDone(false), valRequest(valRequestIn),
+        nQueuedTime(GetTimeMicros()), nStatus(HTTP_OK), fError(false) {}
+
+    void Complete()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fDone = true;
+        }
+        cond.notify_all();
+    }
+
+    void Wait()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fDone)
+            cond.wait(lock);
+    }
+};
+
+/**
+ * Bounded queue of RPC requests served by the -rpcthreads workers. Requests
+ * arriving while the queue is full are turned away with a 503 instead of
+ * piling up behind slow calls.
+ */
+class CRPCWorkQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<boost::shared_ptr<CRPCWorkItem> > queue;
+    size_t nMaxDepth;
+    bool fRunning;
+    int nBusy;
+
+    // Statistics, queue wait and execution time as moving averages in usec
+    uint64_t nExecuted;
+    uint64_t nRejected;
+    int64_t nAvgQueueUsec;
+    int64_t nAvgExecUsec;
+
+public:
+    CRPCWorkQueue() : nMaxDepth(0), fRunning(false), nBusy(0), nExecuted(0), nRejected(0),
+        nAvgQueueUsec(0), nAvgExecUsec(0) {}
+
+    void Start(size_t nMaxDepthIn);
+    bool Enqueue(const boost::shared_ptr<CRPCWorkItem>& item);
+    void Run();
+    void Interrupt();
+    Object GetInfo();
+};
+
+static CRPCWorkQueue rpcWorkQueue;
+
+// Every accepted connection is served by its own thread, which reads and
+// parses requests and hands them to the work queue; guarded by cs_rpcConnections
+static boost::mutex cs_rpcConnections;
+static boost::condition_variable condRPCConnections;
+static std::set<AcceptedConnection*> setRPCConnections;
+static bool fRPCAccepting = false;
+static size_t nMaxRPCConnections = DEFAULT_RPC_MAX_CONNECTIONS;
+
+static void RPCConnectionThread(AcceptedConnection* conn)
+{
+    RenameThread("transfer-rpcconn");
+    ServiceConnection(conn);
+    conn->close();
+    {
+        boost::unique_lock<boost::mutex> lock(cs_rpcConnections);
+        setRPCConnections.erase(conn);
+    }
+    condRPCConnections.notify_all();
+    delete conn;
+}
+
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
@@ -509,8 +629,28 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
         delete conn;
     }
     else {
-        ServiceConnection(conn);
-        conn->close();
+        bool fAccepted = false;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_rpcConnections);
+            if (fRPCAccepting && setRPCConnections.size() < nMaxRPCConnections)
+            {
+                setRPCConnections.insert(conn);
+                fAccepted = true;
+            }
+        }
+        if (fAccepted)
+        {
+            try {
+                boost::thread(boost::bind(&RPCConnectionThread, conn)).detach();
+                return;
+            } catch (boost::thread_resource_error& e) {
+                LogPrintf("RPC connection thread could not be started: %s\n", e.what());
+                boost::unique_lock<boost::mutex> lock(cs_rpcConnections);
+                setRPCConnections.erase(conn);
+            }
+        }
+        if (!fUseSSL)
+            conn->stream() << HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Too many connections", false) << std::flush;
         delete conn;
     }
 }
@@ -629,9 +769,18 @@ void StartRPCThreads()
         return;
     }
 
+    {
+        boost::unique_lock<boost::mutex> lock(cs_rpcConnections);
+        nMaxRPCConnections = std::max((int64_t)1, GetArg("-rpcmaxconnections", DEFAULT_RPC_MAX_CONNECTIONS));
+        fRPCAccepting = true;
+    }
+    rpcWorkQueue.Start(std::max((int64_t)1, GetArg("-rpcworkqueue", DEFAULT_RPC_WORK_QUEUE)));
+
     rpc_worker_group = new boost::thread_group();
     for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+        rpc_worker_group->create_thread(boost::bind(&CRPCWorkQueue::Run, &rpcWorkQueue));
+    // Accepting connections and timers need only one I/O thread
+    rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
 }
 
 void StopRPCThreads()
@@ -640,9 +789,20 @@ void StopRPCThreads()
 
     deadlineTimers.clear();
     rpc_io_service->stop();
+    rpcWorkQueue.Interrupt();
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
     delete rpc_worker_group; rpc_worker_group = NULL;
+
+    // Wake connection threads waiting on their clients and let them finish
+    {
+        boost::unique_lock<boost::mutex> lock(cs_rpcConnections);
+        fRPCAccepting = false;
+        BOOST_FOREACH(AcceptedConnection* conn, setRPCConnections)
+            conn->shutdown();
+        while (!setRPCConnections.empty())
+            condRPCConnections.wait(lock);
+    }
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
 }
@@ -741,6 +901,143 @@ static string JSONRPCExecBatch(const Array& vReq)
     return write_string(Value(ret), false) + "\n";
 }
 
+static void ExecuteRPCWorkItem(CRPCWorkItem& item)
+{
+    JSONRequest jreq;
+    try
+    {
+        // singleton request
+        if (item.valRequest.type() == obj_type) {
+            jreq.parse(item.valRequest);
+
+            Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+
+            item.strReply = JSONRPCReply(result, Value::null, jreq.id);
+
+        // array of requests
+        } else if (item.valRequest.type() == array_type)
+            item.strReply = JSONRPCExecBatch(item.valRequest.get_array());
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+    }
+    catch (Object& objError)
+    {
+        ErrorReply(objError, jreq.id, item.nStatus, item.strReply);
+        item.fError = true;
+    }
+    catch (std::exception& e)
+    {
+        ErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id, item.nStatus, item.strReply);
+        item.fError = true;
+    }
+}
+
+void CRPCWorkQueue::Start(size_t nMaxDepthIn)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nMaxDepth = nMaxDepthIn;
+    fRunning = true;
+}
+
+bool CRPCWorkQueue::Enqueue(const boost::shared_ptr<CRPCWorkItem>& item)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fRunning || queue.size() >= nMaxDepth)
+        {
+            nRejected++;
+            return false;
+        }
+        queue.push_back(item);
+    }
+    cond.notify_one();
+    return true;
+}
+
+void CRPCWorkQueue::Run()
+{
+    RenameThread("transfer-rpcworker");
+    while (true)
+    {
+        boost::shared_ptr<CRPCWorkItem> item;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (fRunning && queue.empty())
+                cond.wait(lock);
+            if (!fRunning)
+                break;
+            item = queue.front();
+            queue.pop_front();
+            nBusy++;
+        }
+
+        int64_t nStart = GetTimeMicros();
+        ExecuteRPCWorkItem(*item);
+        int64_t nEnd = GetTimeMicros();
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nBusy--;
+            nExecuted++;
+            nAvgQueueUsec = (nAvgQueueUsec * 7 + (nStart - item->nQueuedTime)) / 8;
+            nAvgExecUsec = (nAvgExecUsec * 7 + (nEnd - nStart)) / 8;
+        }
+        item->Complete();
+    }
+}
+
+void CRPCWorkQueue::Interrupt()
+{
+    std::deque<boost::shared_ptr<CRPCWorkItem> > queueLeft;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = false;
+        queueLeft.swap(queue);
+    }
+    cond.notify_all();
+
+    // Requests still waiting are answered without being run
+    BOOST_FOREACH(const boost::shared_ptr<CRPCWorkItem>& item, queueLeft)
+    {
+        item->nStatus = HTTP_SERVICE_UNAVAILABLE;
+        item->strReply = "Shutting down";
+        item->fError = true;
+        item->Complete();
+    }
+}
+
+Object CRPCWorkQueue::GetInfo()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    Object obj;
+    obj.push_back(Pair("queuedepth", (int)queue.size()));
+    obj.push_back(Pair("maxqueuedepth", (int)nMaxDepth));
+    obj.push_back(Pair("busyworkers", nBusy));
+    obj.push_back(Pair("executed", nExecuted));
+    obj.push_back(Pair("rejected", nRejected));
+    obj.push_back(Pair("avgqueueusec", nAvgQueueUsec));
+    obj.push_back(Pair("avgexecusec", nAvgExecUsec));
+    return obj;
+}
+
+Value getrpcinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcinfo\n"
+            "Returns the state of the RPC server: open connections, work queue depth,\n"
+            "busy workers, executed and rejected requests and the average time in\n"
+            "microseconds requests waited in the queue and took to execute.");
+
+    Object obj = rpcWorkQueue.GetInfo();
+    {
+        boost::unique_lock<boost::mutex> lock(cs_rpcConnections);
+        obj.push_back(Pair("connections", (int)setRPCConnections.size()));
+        obj.push_back(Pair("maxconnections", (int)nMaxRPCConnections));
+    }
+    return obj;
+}
+
 void ServiceConnection(AcceptedConnection *conn)
 {
     bool fRun = true;
@@ -783,43 +1080,30 @@ void ServiceConnection(AcceptedConnection *conn)
         if (mapHeaders["connection"] == "close")
             fRun = false;
 
-        JSONRequest jreq;
-        try
+        // Parse request
+        Value valRequest;
+        if (!read_string(strRequest, valRequest))
         {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
-
-            string strReply;
-
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
-
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
-
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
-
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, "Parse error"), Value::null);
+            break;
         }
-        catch (Object& objError)
+
+        // Run it on a worker, turning it away if too much is queued already
+        boost::shared_ptr<CRPCWorkItem> item(new CRPCWorkItem(valRequest));
+        if (!rpcWorkQueue.Enqueue(item))
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
+            LogPrint("rpc", "ThreadRPCServer work queue full, rejecting request from %s\n", conn->peer_address_to_string());
+            conn->stream() << HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", false) << std::flush;
             break;
         }
-        catch (std::exception& e)
+        item->Wait();
+
+        if (item->fError)
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+            conn->stream() << HTTPReply(item->nStatus, item->strReply, false) << std::flush;
             break;
         }
+        conn->stream() << HTTPReply(HTTP_OK, item->strReply, fRun) << std::flush;
     }
 }
 
@@ -845,22 +1129,18 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         // Execute
         Value result;
         {
-            if (pcmd->threadSafe)
+            if (pcmd->lockMode == RPC_LOCK_NONE)
                 result = pcmd->actor(params, false);
 #ifdef ENABLE_WALLET
-            else if (!pwalletMain) {
-                LOCK(cs_main);
-                result = pcmd->actor(params, false);
-            } else {
+            else if (pcmd->lockMode == RPC_LOCK_WALLET && pwalletMain) {
                 LOCK2(cs_main, pwalletMain->cs_wallet);
                 result = pcmd->actor(params, false);
             }
-#else // ENABLE_WALLET
+#endif // ENABLE_WALLET
             else {
                 LOCK(cs_main);
                 result = pcmd->actor(params, false);
             }
-#endif // !ENABLE_WALLET
         }
         return result;
     }
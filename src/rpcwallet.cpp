@@ -1027,6 +1027,116 @@ Value sendmany(const Array& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+Value sendbatch(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 5)
+        throw runtime_error(
+            "sendbatch \"fromaccount\" [{\"address\":\"address\",\"amount\":amount},...] ( minconf \"comment\" maxoutputs )\n"
+            "\nPay a list of payments with as few transactions as possible. The payments are split into transactions of\n"
+            "at most maxoutputs payments, which are funded, signed and recorded in the wallet together.\n"
+            "If the memory pool would refuse any of the transactions, none of them is recorded or sent.\n"
+            "Amounts are double-precision floating point numbers."
+            + HelpRequiringPassphrase() + "\n"
+            "\nArguments:\n"
+            "1. \"fromaccount\"         (string, required) The account to send the funds from, can be \"\" for the default account\n"
+            "2. \"payments\"            (string, required) A json array of payments, an address may appear more than once\n"
+            "    [\n"
+            "      {\n"
+            "        \"address\":\"address\", (string, required) The Transfer address to pay\n"
+            "        \"amount\":amount      (numeric, required) The amount in TX\n"
+            "      }\n"
+            "      ,...\n"
+            "    ]\n"
+            "3. minconf                 (numeric, optional, default=1) Only use the balance confirmed at least this many times.\n"
+            "4. \"comment\"             (string, optional) A comment\n"
+            "5. maxoutputs              (numeric, optional, default=500) The most payments to put in one transaction\n"
+            "\nResult:\n"
+            "[                          (json array of string)\n"
+            "  \"transactionid\"        (string) The transaction ids, in the order of the payments they carry\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            "\nPay two addresses:\n"
+            + HelpExampleCli("sendbatch", "\"\" \"[{\\\"address\\\":\\\"TfFxcTN7BJQp88cPJYRvFpUAAKefTib9uh\\\",\\\"amount\\\":0.01},{\\\"address\\\":\\\"ThiLpx7oYd5YuuhsJAUD5ZsEX2YHgU98Us\\\",\\\"amount\\\":0.02}]\"") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("sendbatch", "\"\", [{\"address\":\"TfFxcTN7BJQp88cPJYRvFpUAAKefTib9uh\",\"amount\":0.01},{\"address\":\"ThiLpx7oYd5YuuhsJAUD5ZsEX2YHgU98Us\",\"amount\":0.02}]")
+        );
+
+    string strAccount = AccountFromValue(params[0]);
+    Array payments = params[1].get_array();
+    int nMinDepth = 1;
+    if (params.size() > 2)
+        nMinDepth = params[2].get_int();
+    string strComment;
+    if (params.size() > 3 && params[3].type() != null_type)
+        strComment = params[3].get_str();
+    int nMaxOutputs = 500;
+    if (params.size() > 4)
+        nMaxOutputs = params[4].get_int();
+    if (nMaxOutputs < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, maxoutputs must be positive");
+
+    vector<pair<CScript, int64_t> > vecSend;
+    vecSend.reserve(payments.size());
+
+    int64_t totalAmount = 0;
+    BOOST_FOREACH(const Value& payment, payments)
+    {
+        const Object& o = payment.get_obj();
+
+        const Value& address_v = find_value(o, "address");
+        if (address_v.type() != str_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, missing address key");
+        CTransfercoinAddress address(address_v.get_str());
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid Transfer address: ")+address_v.get_str());
+
+        const Value& amount_v = find_value(o, "amount");
+        if (amount_v.type() == null_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, missing amount key");
+        CAmount nAmount = AmountFromValue(amount_v);
+
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(address.Get());
+
+        totalAmount += nAmount;
+
+        vecSend.push_back(make_pair(scriptPubKey, nAmount));
+    }
+
+    EnsureWalletIsUnlocked();
+
+    // Check funds
+    int64_t nBalance = GetAccountBalance(strAccount, nMinDepth, ISMINE_SPENDABLE);
+    if (totalAmount > nBalance)
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Account has insufficient funds");
+
+    // Send
+    vector<CWalletTx> vwtx;
+    list<CReserveKey> lChangeKeys;
+    int64_t nFeeRequired = 0;
+    std::string strFailReason;
+    if (!pwalletMain->CreateTransactionBatch(vecSend, nMaxOutputs, vwtx, lChangeKeys, nFeeRequired, strFailReason))
+    {
+        if (totalAmount + nFeeRequired > pwalletMain->GetBalance())
+            throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Insufficient funds");
+        throw JSONRPCError(RPC_WALLET_ERROR, "Transaction creation failed: " + strFailReason);
+    }
+    BOOST_FOREACH(CWalletTx& wtx, vwtx)
+    {
+        wtx.strFromAccount = strAccount;
+        if (!strComment.empty())
+            wtx.mapValue["comment"] = strComment;
+    }
+    if (!pwalletMain->CommitTransactionBatch(vwtx, lChangeKeys))
+        throw JSONRPCError(RPC_WALLET_ERROR, "Transaction commit failed, no transaction of the batch was sent");
+
+    Array ret;
+    BOOST_FOREACH(const CWalletTx& wtx, vwtx)
+        ret.push_back(wtx.GetHash().GetHex());
+    return ret;
+}
+
 // Defined in rpcmisc.cpp
 extern CScript _createmultisig_redeemScript(const Array& params);
 
@@ -1116,6 +1226,8 @@ Value addmultisigaddress(const Array& params, bool fHelp)
     CScriptID innerID = inner.GetID();
     if (!pwalletMain->AddCScript(inner))
         throw runtime_error("AddCScript() failed");
+    // the script can make wallet outputs spendable
+    pwalletMain->MarkDirty();
 
     pwalletMain->SetAddressBookName(innerID, strAccount);
     return CTransfercoinAddress(innerID).ToString();
@@ -1141,6 +1253,8 @@ Value addredeemscript(const Array& params, bool fHelp)
     CScriptID innerID = inner.GetID();
     if (!pwalletMain->AddCScript(inner))
         throw runtime_error("AddCScript() failed");
+    // the script can make wallet outputs spendable
+    pwalletMain->MarkDirty();
 
     pwalletMain->SetAddressBookName(innerID, strAccount);
     return CTransfercoinAddress(innerID).ToString();
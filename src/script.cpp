@@ -2082,6 +2082,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
+    txTo.InvalidateHash();
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
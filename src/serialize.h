@@ -1186,6 +1186,12 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Exchange the whole buffer with data, used to recycle network receive buffers
+    void swap(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
@@ -4,12 +4,15 @@
 
 #include "stealth.h"
 #include "base58.h"
-
+#include "hash.h"
 
 #include <openssl/rand.h>
-#include <openssl/ec.h>
-#include <openssl/ecdsa.h>
-#include <openssl/obj_mac.h>
+
+#include <secp256k1.h>
+#include <secp256k1_ecdh.h>
+
+// Verification context owned by pubkey.cpp, kept alive by the ECCVerifyHandle held in init
+extern secp256k1_context* secp256k1_context_verify;
 
 
 bool CStealthAddress::SetEncoded(const std::string& encodedAddress)
@@ -166,56 +169,45 @@ int GenerateRandomSecret(ec_secret& out)
 
 int SecretToPublicKey(const ec_secret& secret, ec_point& out)
 {
-    // -- public key = private * G
-    int rv = 0;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    // -- public key = private * G, through the constant time signing context
+    CKey key;
+    key.Set(&secret.e[0], &secret.e[ec_secret_size], true);
+    if (!key.IsValid())
     {
-        LogPrintf("SecretToPublicKey(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("SecretToPublicKey(): invalid secret.\n");
         return 1;
     };
-
-    BIGNUM* bnIn = BN_bin2bn(&secret.e[0], ec_secret_size, BN_new());
-    if (!bnIn)
-    {
-        EC_GROUP_free(ecgrp);
-        LogPrintf("SecretToPublicKey(): BN_bin2bn failed\n");
-        return 1;
-    };
-    
-    EC_POINT* pub = EC_POINT_new(ecgrp);
     
-    
-    EC_POINT_mul(ecgrp, pub, bnIn, NULL, NULL, NULL);
-    
-    BIGNUM* bnOut = EC_POINT_point2bn(ecgrp, pub, POINT_CONVERSION_COMPRESSED, BN_new(), NULL);
-    if (!bnOut)
-    {
-        LogPrintf("SecretToPublicKey(): point2bn failed\n");
-        rv = 1;
-    } else
+    CPubKey pubkey = key.GetPubKey();
+    if (pubkey.size() != ec_compressed_size)
     {
-        out.resize(ec_compressed_size);
-        if (BN_num_bytes(bnOut) != (int) ec_compressed_size
-            || BN_bn2bin(bnOut, &out[0]) != (int) ec_compressed_size)
-        {
-            LogPrintf("SecretToPublicKey(): bnOut incorrect length.\n");
-            rv = 1;
-        };
-        
-        BN_free(bnOut);
+        LogPrintf("SecretToPublicKey(): pubkey incorrect length.\n");
+        return 1;
     };
     
+    out.assign(pubkey.begin(), pubkey.end());
+    return 0;
+};
 
-    EC_POINT_free(pub);
-    BN_free(bnIn);
-    EC_GROUP_free(ecgrp);
-
-    return rv;
+// c = H(secret * point), point must already be parsed
+static bool StealthSharedSecret(const ec_secret& secret, const secp256k1_pubkey& point, ec_secret& sharedSOut)
+{
+    // -- constant time in the secret, the result is the sha256 of the compressed product point
+    return secp256k1_ecdh(secp256k1_context_verify, &sharedSOut.e[0], &point, &secret.e[0]);
 };
 
+// R' = R + cG, serialized compressed
+static bool StealthSpendPubkey(const secp256k1_pubkey& pkSpend, const ec_secret& sharedS, ec_point& pkOut)
+{
+    secp256k1_pubkey R = pkSpend;
+    if (!secp256k1_ec_pubkey_tweak_add(secp256k1_context_verify, &R, &sharedS.e[0]))
+        return false;
+    
+    pkOut.resize(ec_compressed_size);
+    size_t nSize = ec_compressed_size;
+    secp256k1_ec_pubkey_serialize(secp256k1_context_verify, &pkOut[0], &nSize, &R, SECP256K1_EC_COMPRESSED);
+    return nSize == ec_compressed_size;
+};
 
 int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend, ec_secret& sharedSOut, ec_point& pkOut)
 {
@@ -245,180 +237,69 @@ int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend,
     
     
     Recipient gets R' and P
-    
-    test 0 and infinity?
     */
     
-    int rv = 0;
-    std::vector<uint8_t> vchOutQ;
-    
-    BN_CTX* bnCtx   = NULL;
-    BIGNUM* bnEphem = NULL;
-    BIGNUM* bnQ     = NULL;
-    EC_POINT* Q     = NULL;
-    BIGNUM* bnOutQ  = NULL;
-    BIGNUM* bnc     = NULL;
-    EC_POINT* C     = NULL;
-    BIGNUM* bnR     = NULL;
-    EC_POINT* R     = NULL;
-    EC_POINT* Rout  = NULL;
-    BIGNUM* bnOutR  = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    secp256k1_pubkey Q, R;
     
-    if (!ecgrp)
+    if (pubkey.empty() || !secp256k1_ec_pubkey_parse(secp256k1_context_verify, &Q, &pubkey[0], pubkey.size()))
     {
-        LogPrintf("StealthSecret(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("StealthSecret(): Q secp256k1_ec_pubkey_parse failed\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        LogPrintf("StealthSecret(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnEphem = BN_bin2bn(&secret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecret(): bnEphem BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnQ = BN_bin2bn(&pubkey[0], pubkey.size(), BN_new())))
-    {
-        LogPrintf("StealthSecret(): bnQ BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(Q = EC_POINT_bn2point(ecgrp, bnQ, NULL, bnCtx)))
+    if (pkSpend.empty() || !secp256k1_ec_pubkey_parse(secp256k1_context_verify, &R, &pkSpend[0], pkSpend.size()))
     {
-        LogPrintf("StealthSecret(): Q EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    // -- eQ
-    // EC_POINT_mul(const EC_GROUP *group, EC_POINT *r, const BIGNUM *n, const EC_POINT *q, const BIGNUM *m, BN_CTX *ctx);
-    // EC_POINT_mul calculates the value generator * n + q * m and stores the result in r. The value n may be NULL in which case the result is just q * m. 
-    if (!EC_POINT_mul(ecgrp, Q, NULL, Q, bnEphem, bnCtx))
-    {
-        LogPrintf("StealthSecret(): eQ EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOutQ = EC_POINT_point2bn(ecgrp, Q, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
-    {
-        LogPrintf("StealthSecret(): Q EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    vchOutQ.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutQ) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutQ, &vchOutQ[0]) != (int) ec_compressed_size)
-    {
-        LogPrintf("StealthSecret(): bnOutQ incorrect length.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    SHA256(&vchOutQ[0], vchOutQ.size(), &sharedSOut.e[0]);
-    
-    if (!(bnc = BN_bin2bn(&sharedSOut.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecret(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    // -- cG
-    if (!(C = EC_POINT_new(ecgrp)))
-    {
-        LogPrintf("StealthSecret(): C EC_POINT_new failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!EC_POINT_mul(ecgrp, C, bnc, NULL, NULL, bnCtx))
-    {
-        LogPrintf("StealthSecret(): C EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnR = BN_bin2bn(&pkSpend[0], pkSpend.size(), BN_new())))
-    {
-        LogPrintf("StealthSecret(): bnR BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    if (!(R = EC_POINT_bn2point(ecgrp, bnR, NULL, bnCtx)))
-    {
-        LogPrintf("StealthSecret(): R EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecret(): R secp256k1_ec_pubkey_parse failed\n");
+        return 1;
     };
     
-    if (!EC_POINT_mul(ecgrp, C, bnc, NULL, NULL, bnCtx))
+    // -- c = H(eQ)
+    if (!StealthSharedSecret(secret, Q, sharedSOut))
     {
-        printf("StealthSecret(): C EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecret(): eQ secp256k1_ecdh failed\n");
+        return 1;
     };
     
-    if (!(Rout = EC_POINT_new(ecgrp)))
+    // -- R' = R + cG
+    if (!StealthSpendPubkey(R, sharedSOut, pkOut))
     {
-        printf("StealthSecret(): Rout EC_POINT_new failed\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecret(): Rout secp256k1_ec_pubkey_tweak_add failed\n");
+        return 1;
     };
     
-    if (!EC_POINT_add(ecgrp, Rout, R, C, bnCtx))
-    {
-        LogPrintf("StealthSecret(): Rout EC_POINT_add failed\n");
-        rv = 1;
-        goto End;
-    };
+    return 0;
+};
+
+int StealthSecretBatch(const ec_secret& scanSecret, const ec_point& pkSpend, const std::vector<ec_point>& vEphemPubkeys, std::vector<ec_secret>& vSharedOut, std::vector<CPubKey>& vPkOut)
+{
+    vSharedOut.resize(vEphemPubkeys.size());
+    vPkOut.assign(vEphemPubkeys.size(), CPubKey());
     
-    if (!(bnOutR = EC_POINT_point2bn(ecgrp, Rout, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
+    secp256k1_pubkey R;
+    if (pkSpend.empty() || !secp256k1_ec_pubkey_parse(secp256k1_context_verify, &R, &pkSpend[0], pkSpend.size()))
     {
-        LogPrintf("StealthSecret(): Rout EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecretBatch(): R secp256k1_ec_pubkey_parse failed\n");
+        return 1;
     };
     
-    
-    pkOut.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutR) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutR, &pkOut[0]) != (int) ec_compressed_size)
+    ec_point pkOut;
+    for (unsigned int i = 0; i < vEphemPubkeys.size(); ++i)
     {
-        LogPrintf("StealthSecret(): pkOut incorrect length.\n");
-        rv = 1;
-        goto End;
+        // -- a malformed ephemeral key only fails its own slot
+        const ec_point& vchEphem = vEphemPubkeys[i];
+        secp256k1_pubkey P;
+        if (vchEphem.empty() || !secp256k1_ec_pubkey_parse(secp256k1_context_verify, &P, &vchEphem[0], vchEphem.size()))
+            continue;
+        
+        // -- c = H(dP), R' = R + cG
+        if (!StealthSharedSecret(scanSecret, P, vSharedOut[i])
+            || !StealthSpendPubkey(R, vSharedOut[i], pkOut))
+            continue;
+        
+        vPkOut[i] = CPubKey(pkOut);
     };
     
-    End:
-    if (bnOutR)     BN_free(bnOutR);
-    if (Rout)       EC_POINT_free(Rout);
-    if (R)          EC_POINT_free(R);
-    if (bnR)        BN_free(bnR);
-    if (C)          EC_POINT_free(C);
-    if (bnc)        BN_free(bnc);
-    if (bnOutQ)     BN_free(bnOutQ);
-    if (Q)          EC_POINT_free(Q);
-    if (bnQ)        BN_free(bnQ);
-    if (bnEphem)    BN_free(bnEphem);
-    if (bnCtx)      BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return 0;
 };
 
 
@@ -429,230 +310,38 @@ int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret&
     c  = H(dP)
     R' = R + cG     [without decrypting wallet]
        = (f + c)G   [after decryption of wallet]
-         Remember: mod curve.order, pad with 0x00s where necessary?
     */
     
-    int rv = 0;
-    std::vector<uint8_t> vchOutP;
-    
-    BN_CTX* bnCtx           = NULL;
-    BIGNUM* bnScanSecret    = NULL;
-    BIGNUM* bnP             = NULL;
-    EC_POINT* P             = NULL;
-    BIGNUM* bnOutP          = NULL;
-    BIGNUM* bnc             = NULL;
-    BIGNUM* bnOrder         = NULL;
-    BIGNUM* bnSpend         = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    secp256k1_pubkey P;
+    if (ephemPubkey.empty() || !secp256k1_ec_pubkey_parse(secp256k1_context_verify, &P, &ephemPubkey[0], ephemPubkey.size()))
     {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("StealthSecretSpend(): P secp256k1_ec_pubkey_parse failed\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        LogPrintf("StealthSecretSpend(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnScanSecret = BN_bin2bn(&scanSecret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnScanSecret BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnP = BN_bin2bn(&ephemPubkey[0], ephemPubkey.size(), BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnP BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(P = EC_POINT_bn2point(ecgrp, bnP, NULL, bnCtx)))
-    {
-        LogPrintf("StealthSecretSpend(): P EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    // -- dP
-    if (!EC_POINT_mul(ecgrp, P, NULL, P, bnScanSecret, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): dP EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOutP = EC_POINT_point2bn(ecgrp, P, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
-    {
-        LogPrintf("StealthSecretSpend(): P EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    vchOutP.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutP) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutP, &vchOutP[0]) != (int) ec_compressed_size)
+    // -- c = H(dP)
+    ec_secret sharedS;
+    if (!StealthSharedSecret(scanSecret, P, sharedS))
     {
-        LogPrintf("StealthSecretSpend(): bnOutP incorrect length.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    uint8_t hash1[32];
-    SHA256(&vchOutP[0], vchOutP.size(), (uint8_t*)hash1);
-    
-    
-    if (!(bnc = BN_bin2bn(&hash1[0], 32, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOrder = BN_new())
-        || !EC_GROUP_get_order(ecgrp, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_get_order failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnSpend = BN_bin2bn(&spendSecret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    //if (!BN_add(r, a, b)) return 0;
-    //return BN_nnmod(r, r, m, ctx);
-    if (!BN_mod_add(bnSpend, bnSpend, bnc, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_mod_add failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (BN_is_zero(bnSpend)) // possible?
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend is zero.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    int nBytes;
-    memset(&secretOut.e[0], 0, ec_secret_size);
-    if ((nBytes = BN_num_bytes(bnSpend)) > (int)ec_secret_size
-        || BN_bn2bin(bnSpend, &secretOut.e[ec_secret_size-nBytes]) != nBytes)
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend incorrect length.\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecretSpend(): dP secp256k1_ecdh failed\n");
+        return 1;
     };
     
-    End:
-    if (bnSpend)        BN_free(bnSpend);
-    if (bnOrder)        BN_free(bnOrder);
-    if (bnc)            BN_free(bnc);
-    if (bnOutP)         BN_free(bnOutP);
-    if (P)              EC_POINT_free(P);
-    if (bnP)            BN_free(bnP);
-    if (bnScanSecret)   BN_free(bnScanSecret);
-    if (bnCtx)          BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return StealthSharedToSecretSpend(sharedS, spendSecret, secretOut);
 };
 
 
 int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_secret& secretOut)
 {
-    int rv = 0;
-    std::vector<uint8_t> vchOutP;
-    
-    BN_CTX* bnCtx           = NULL;
-    BIGNUM* bnc             = NULL;
-    BIGNUM* bnOrder         = NULL;
-    BIGNUM* bnSpend         = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    // -- f + c mod n, fails on a zero or out of range result
+    memcpy(&secretOut.e[0], &spendSecret.e[0], ec_secret_size);
+    if (!secp256k1_ec_privkey_tweak_add(secp256k1_context_verify, &secretOut.e[0], &sharedS.e[0]))
     {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("StealthSharedToSecretSpend(): secp256k1_ec_privkey_tweak_add failed.\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        LogPrintf("StealthSecretSpend(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnc = BN_bin2bn(&sharedS.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOrder = BN_new())
-        || !EC_GROUP_get_order(ecgrp, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_get_order failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnSpend = BN_bin2bn(&spendSecret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    //if (!BN_add(r, a, b)) return 0;
-    //return BN_nnmod(r, r, m, ctx);
-    if (!BN_mod_add(bnSpend, bnSpend, bnc, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_mod_add failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (BN_is_zero(bnSpend)) // possible?
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend is zero.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    int nBytes;
-    memset(&secretOut.e[0], 0, ec_secret_size);
-    if ((nBytes = BN_num_bytes(bnSpend)) > (int)ec_secret_size
-        || BN_bn2bin(bnSpend, &secretOut.e[ec_secret_size-nBytes]) != nBytes)
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend incorrect length.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    End:
-    if (bnSpend)        BN_free(bnSpend);
-    if (bnOrder)        BN_free(bnOrder);
-    if (bnc)            BN_free(bnc);
-    if (bnCtx)          BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return 0;
 };
 
 bool IsStealthAddress(const std::string& encodedAddress)
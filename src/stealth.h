@@ -110,6 +110,9 @@ int GenerateRandomSecret(ec_secret& out);
 int SecretToPublicKey(const ec_secret& secret, ec_point& out);
 
 int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend, ec_secret& sharedSOut, ec_point& pkOut);
+/** Receive side of StealthSecret for many ephemeral keys against one address, parsing the
+ *  spend key once. Slots whose ephemeral key is invalid are left as an invalid CPubKey. */
+int StealthSecretBatch(const ec_secret& scanSecret, const ec_point& pkSpend, const std::vector<ec_point>& vEphemPubkeys, std::vector<ec_secret>& vSharedOut, std::vector<CPubKey>& vPkOut);
 int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret& spendSecret, ec_secret& secretOut);
 int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_secret& secretOut);
 
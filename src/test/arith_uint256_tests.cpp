@@ -0,0 +1,123 @@
+#include <boost/test/unit_test.hpp>
+
+#include "arith_uint256.h"
+#include "bignum.h"
+#include "util.h"
+
+using namespace std;
+
+// Random value with a random number of significant bits, so small and
+// large magnitudes both get exercised
+static uint256 RandomUint256()
+{
+    uint256 n;
+    unsigned char* p = n.begin();
+    for (int i = 0; i < 32; i++)
+        p[i] = insecure_rand() & 0xff;
+    return n >> (insecure_rand() % 256);
+}
+
+static uint32_t RandomCompact()
+{
+    // exponents up to 35 to cover the overflow cases, sign bit included
+    return ((insecure_rand() % 36) << 24) | (insecure_rand() & 0x00ffffff);
+}
+
+BOOST_AUTO_TEST_SUITE(arith_uint256_tests)
+
+BOOST_AUTO_TEST_CASE(arith_uint256_conversions)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        uint256 n = RandomUint256();
+        BOOST_CHECK(ArithToUint256(UintToArith256(n)) == n);
+        BOOST_CHECK(UintToArith256(n).GetHex() == n.GetHex());
+        BOOST_CHECK(UintToArith256(n).GetLow64() == n.Get64());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_compact)
+{
+    seed_insecure_rand(true);
+    for (int i = 0; i < 10000; i++)
+    {
+        uint32_t nCompact = RandomCompact();
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+
+        bool fNegative, fOverflow;
+        arith_uint256 n;
+        n.SetCompact(nCompact, &fNegative, &fOverflow);
+
+        CBigNum bnAbs = bn < 0 ? -bn : bn;
+        BOOST_CHECK(fNegative == (bn < 0));
+        BOOST_CHECK(fOverflow == (bnAbs >= CBigNum(1) << 256));
+        if (!fOverflow)
+        {
+            BOOST_CHECK(ArithToUint256(n) == bnAbs.getuint256());
+            BOOST_CHECK(n.GetCompact(fNegative) == bn.GetCompact());
+        }
+    }
+
+    // values that are not in compact form to begin with
+    for (int i = 0; i < 10000; i++)
+    {
+        uint256 h = RandomUint256();
+        BOOST_CHECK(UintToArith256(h).GetCompact() == CBigNum(h).GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_arithmetic)
+{
+    seed_insecure_rand(true);
+    CBigNum bnMod = CBigNum(1) << 256;
+    for (int i = 0; i < 10000; i++)
+    {
+        uint256 a = RandomUint256();
+        uint256 b = RandomUint256();
+        arith_uint256 aa = UintToArith256(a);
+        arith_uint256 ab = UintToArith256(b);
+        CBigNum bna(a), bnb(b);
+
+        BOOST_CHECK((aa < ab) == (bna < bnb));
+        BOOST_CHECK((aa == ab) == (bna == bnb));
+        BOOST_CHECK(ArithToUint256(aa + ab) == ((bna + bnb) % bnMod).getuint256());
+        BOOST_CHECK(ArithToUint256(aa * ab) == ((bna * bnb) % bnMod).getuint256());
+        if (bnb != 0)
+            BOOST_CHECK(ArithToUint256(aa / ab) == (bna / bnb).getuint256());
+        if (bna >= bnb)
+            BOOST_CHECK(ArithToUint256(aa - ab) == (bna - bnb).getuint256());
+
+        uint32_t n32 = insecure_rand();
+        BOOST_CHECK(ArithToUint256(aa * n32) == ((bna * CBigNum(n32)) % bnMod).getuint256());
+
+        unsigned int nShift = insecure_rand() % 300;
+        BOOST_CHECK(ArithToUint256(aa >> nShift) == (bna >> nShift).getuint256());
+        BOOST_CHECK(ArithToUint256(aa << nShift) == ((bna << nShift) % bnMod).getuint256());
+
+        BOOST_CHECK(aa.bits() == (unsigned int)bna.bitSize());
+    }
+    BOOST_CHECK_THROW(arith_uint256(1) / arith_uint256(0), uint_error);
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_block_trust)
+{
+    // 2^256 / (target+1), the chain trust of a block, as computed with CBigNum
+    seed_insecure_rand(true);
+    for (int i = 0; i < 10000; i++)
+    {
+        uint32_t nBits = RandomCompact() & ~0x00800000;
+        CBigNum bnTarget;
+        bnTarget.SetCompact(nBits);
+        bool fOverflow;
+        arith_uint256 target;
+        target.SetCompact(nBits, NULL, &fOverflow);
+        if (fOverflow || bnTarget <= 0)
+            continue;
+
+        uint256 nExpected = ((CBigNum(1) << 256) / (bnTarget + 1)).getuint256();
+        BOOST_CHECK(ArithToUint256((~target / (target + 1)) + 1) == nExpected);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
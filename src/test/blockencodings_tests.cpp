@@ -0,0 +1,148 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+#include "txmempool.h"
+#include "util.h"
+
+using namespace std;
+
+static CTransaction MakeTx(unsigned int nLockTime)
+{
+    CTransaction tx;
+    tx.nLockTime = nLockTime; // so all transactions get different hashes
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1 * COIN;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    return tx;
+}
+
+static CBlock BuildBlock()
+{
+    CBlock block;
+    block.nVersion = 7;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1450000000;
+    block.nBits = 0x207fffff;
+
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig << 42 << OP_0;
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].SetEmpty();
+    block.vtx.push_back(txCoinbase);
+
+    for (unsigned int i = 1; i < 5; i++)
+        block.vtx.push_back(MakeTx(i));
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+BOOST_AUTO_TEST_CASE(shortid_roundtrip)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK(cmpctblock.vPrefilledTxn[0].tx.GetHash() == block.vtx[0].GetHash());
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    ss >> cmpctblock2;
+
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock2.nNonce, cmpctblock.nNonce);
+    BOOST_CHECK(cmpctblock2.vShortTxIds == cmpctblock.vShortTxIds);
+    BOOST_CHECK_EQUAL(cmpctblock2.vPrefilledTxn.size(), cmpctblock.vPrefilledTxn.size());
+
+    // the receiver derives the same short IDs from the header and nonce
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        uint64_t nShortId = cmpctblock2.GetShortID(block.vtx[i].GetHash());
+        BOOST_CHECK_EQUAL(nShortId, cmpctblock.vShortTxIds[i - 1]);
+        BOOST_CHECK(nShortId < (1ULL << (8 * SHORTTXID_BYTES)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(shortid_collision)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.vShortTxIds[1] = cmpctblock.vShortTxIds[0];
+
+    CTxMemPool pool;
+    CPartialBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == CPartialBlock::READ_FAILED);
+}
+
+BOOST_AUTO_TEST_CASE(fill_from_mempool_and_blocktxn)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+
+    // vtx[2] and vtx[4] are in the pool, vtx[1] and vtx[3] have to be asked for
+    CTxMemPool pool;
+    pool.addUnchecked(block.vtx[2].GetHash(), block.vtx[2]);
+    pool.addUnchecked(block.vtx[4].GetHash(), block.vtx[4]);
+    CTransaction txUnrelated = MakeTx(100);
+    pool.addUnchecked(txUnrelated.GetHash(), txUnrelated);
+
+    CPartialBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == CPartialBlock::READ_OK);
+    BOOST_CHECK(partialBlock.GetHash() == block.GetHash());
+
+    vector<unsigned int> vIndexes;
+    partialBlock.GetMissing(vIndexes);
+    BOOST_CHECK_EQUAL(vIndexes.size(), 2U);
+    BOOST_CHECK_EQUAL(vIndexes[0], 1U);
+    BOOST_CHECK_EQUAL(vIndexes[1], 3U);
+
+    vector<CTransaction> vMissing;
+    vMissing.push_back(block.vtx[1]);
+    vMissing.push_back(block.vtx[3]);
+
+    CBlock blockFilled;
+    BOOST_CHECK(partialBlock.FillBlock(blockFilled, vMissing) == CPartialBlock::READ_OK);
+    BOOST_CHECK(blockFilled.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(blockFilled.vtx.size(), block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(blockFilled.vtx[i].GetHash() == block.vtx[i].GetHash());
+
+    // too few or too many transactions is a malformed reply
+    vMissing.pop_back();
+    BOOST_CHECK(partialBlock.FillBlock(blockFilled, vMissing) == CPartialBlock::READ_INVALID);
+    vMissing.push_back(block.vtx[3]);
+    vMissing.push_back(block.vtx[3]);
+    BOOST_CHECK(partialBlock.FillBlock(blockFilled, vMissing) == CPartialBlock::READ_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(fill_merkle_mismatch)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+
+    CTxMemPool pool;
+    CPartialBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool) == CPartialBlock::READ_OK);
+
+    vector<unsigned int> vIndexes;
+    partialBlock.GetMissing(vIndexes);
+    BOOST_CHECK_EQUAL(vIndexes.size(), block.vtx.size() - 1);
+
+    // a blocktxn with one wrong transaction doesn't match the merkle root
+    vector<CTransaction> vMissing;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vMissing.push_back(block.vtx[i]);
+    vMissing[1] = MakeTx(200);
+
+    CBlock blockFilled;
+    BOOST_CHECK(partialBlock.FillBlock(blockFilled, vMissing) == CPartialBlock::READ_FAILED);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
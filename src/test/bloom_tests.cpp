@@ -0,0 +1,103 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+static CInv RandomInv()
+{
+    return CInv(MSG_TX, GetRandHash());
+}
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // last-100-entry, 1% false positive:
+    CRollingBloomFilter rb1(100, 0.01);
+
+    // Overfill:
+    static const int DATASIZE = 399;
+    CInv data[DATASIZE];
+    for (int i = 0; i < DATASIZE; i++) {
+        data[i] = RandomInv();
+        rb1.insert(data[i]);
+    }
+    // Last 100 guaranteed to be remembered:
+    for (int i = 299; i < DATASIZE; i++) {
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // false positive rate is 1%, so we should get about 100 hits if
+    // testing 10,000 random keys. We get worst-case false positive
+    // behavior when the filter is as full as possible, which is
+    // when we've inserted one minus an integer multiple of nElement*2.
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (rb1.contains(RandomInv()))
+            ++nHits;
+    }
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~100 expected)");
+
+    // Insanely unlikely to get a fp count outside this range:
+    BOOST_CHECK(nHits > 25);
+    BOOST_CHECK(nHits < 175);
+
+    // The same hash with another type is a different item
+    CInv invBlock(MSG_BLOCK, data[DATASIZE-1].hash);
+    BOOST_CHECK(rb1.contains(data[DATASIZE-1]));
+    rb1.reset();
+    BOOST_CHECK(!rb1.contains(data[DATASIZE-1]));
+    BOOST_CHECK(!rb1.contains(invBlock));
+    rb1.insert(invBlock);
+    BOOST_CHECK(rb1.contains(invBlock));
+    BOOST_CHECK(!rb1.contains(data[DATASIZE-1]));
+
+    // A filter big enough for the whole data set keeps all of it
+    CRollingBloomFilter rb2(1000, 0.001);
+    for (int i = 0; i < DATASIZE; i++)
+        rb2.insert(data[i]);
+    for (int i = 0; i < DATASIZE; i++)
+        BOOST_CHECK(rb2.contains(data[i]));
+}
+
+BOOST_AUTO_TEST_CASE(askfor_table)
+{
+    CAskForTable table(1000);
+
+    CInv inv = RandomInv();
+    CInv invBlock(MSG_BLOCK, inv.hash);
+    BOOST_CHECK(table.Get(inv) == 0);
+
+    table.Set(inv, 100);
+    BOOST_CHECK(table.Get(inv) == 100);
+    BOOST_CHECK(table.Get(invBlock) == 0);
+
+    // updating an item keeps a single entry for it
+    table.Set(inv, 200);
+    BOOST_CHECK(table.Get(inv) == 200);
+    table.erase(inv);
+    BOOST_CHECK(table.Get(inv) == 0);
+
+    // a single bucket holds two items, a third replaces the earliest request time
+    CAskForTable small(2);
+    CInv inv1 = RandomInv(), inv2 = RandomInv(), inv3 = RandomInv();
+    small.Set(inv1, 300);
+    small.Set(inv2, 100);
+    BOOST_CHECK(small.Get(inv1) == 300);
+    BOOST_CHECK(small.Get(inv2) == 100);
+    small.Set(inv3, 200);
+    BOOST_CHECK(small.Get(inv1) == 300);
+    BOOST_CHECK(small.Get(inv2) == 0);
+    BOOST_CHECK(small.Get(inv3) == 200);
+
+    // an erased slot is reused before any live entry
+    small.erase(inv1);
+    small.Set(inv2, 50);
+    BOOST_CHECK(small.Get(inv2) == 50);
+    BOOST_CHECK(small.Get(inv3) == 200);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
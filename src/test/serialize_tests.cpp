@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "serialize.h"
+#include "main.h"
 
 using namespace std;
 
@@ -42,4 +43,44 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(transaction_hash_cache)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1 * COIN;
+
+    // built in memory: nothing is remembered
+    uint256 hashBuilt = tx.GetHash();
+    tx.vout[0].nValue = 2 * COIN;
+    BOOST_CHECK(tx.GetHash() != hashBuilt);
+    BOOST_CHECK(!tx.fHashCached);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    CTransaction txRead;
+    ss >> txRead;
+    BOOST_CHECK(txRead.GetHash() == tx.GetHash());
+    BOOST_CHECK(txRead.fHashCached);
+
+    // copies share the cache, edits must drop it
+    CTransaction txCopy(txRead);
+    txCopy.vin[0].scriptSig = CScript() << OP_2;
+    txCopy.InvalidateHash();
+    BOOST_CHECK(txCopy.GetHash() != tx.GetHash());
+    BOOST_CHECK(txCopy.GetHash() == SerializeHash(txCopy));
+
+    CBlock block;
+    block.nBits = 0x1e0fffff;
+    block.vtx.push_back(tx);
+    CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+    ssBlock << block;
+    CBlock blockRead;
+    ssBlock >> blockRead;
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+    BOOST_CHECK(blockRead.fHashCached);
+    BOOST_CHECK(blockRead.vtx[0].GetHash() == tx.GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,131 @@
+#include <boost/test/unit_test.hpp>
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "main.h"
+#include "util.h"
+
+#include <openssl/sha.h>
+
+using namespace std;
+
+// Every check runs against OpenSSL, once with the portable code and once
+// with whatever SHA256AutoDetect picks for this CPU
+static void CheckSHA256(const vector<unsigned char>& data)
+{
+    for (size_t nChunk = 1; nChunk <= 128; nChunk *= 2)
+    {
+        CSHA256 sha;
+        for (size_t i = 0; i < data.size(); i += nChunk)
+            sha.Write(&data[i], min(nChunk, data.size() - i));
+        unsigned char hash[CSHA256::OUTPUT_SIZE];
+        unsigned char hashExpected[SHA256_DIGEST_LENGTH];
+        sha.Finalize(hash);
+        SHA256(data.empty() ? NULL : &data[0], data.size(), hashExpected);
+        BOOST_CHECK(memcmp(hash, hashExpected, sizeof(hash)) == 0);
+    }
+}
+
+static void CheckSHA256D64()
+{
+    vector<unsigned char> in(64 * 20);
+    for (unsigned int i = 0; i < in.size(); i++)
+        in[i] = insecure_rand() & 0xff;
+
+    for (size_t nBlocks = 0; nBlocks <= 20; nBlocks++)
+    {
+        vector<unsigned char> out(32 * 20);
+        SHA256D64(&out[0], &in[0], nBlocks);
+        for (size_t i = 0; i < nBlocks; i++)
+        {
+            uint256 hash = Hash(in.begin() + 64 * i, in.begin() + 64 * (i + 1));
+            BOOST_CHECK(memcmp(&out[32 * i], hash.begin(), 32) == 0);
+        }
+        // nothing written past the last block
+        for (size_t i = 32 * nBlocks; i < out.size(); i++)
+            BOOST_CHECK(out[i] == 0);
+    }
+
+    uint256 left = GetRandHash(), right = GetRandHash();
+    BOOST_CHECK(HashMerkleNode(left, right) == Hash(BEGIN(left), END(left), BEGIN(right), END(right)));
+}
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+BOOST_AUTO_TEST_CASE(sha256_implementations)
+{
+    seed_insecure_rand(true);
+    for (int nPass = 0; nPass < 2; nPass++)
+    {
+        if (nPass == 1)
+            BOOST_TEST_MESSAGE("SHA256 implementation: " << SHA256AutoDetect());
+
+        vector<unsigned char> data;
+        for (unsigned int nLen = 0; nLen < 300; nLen++)
+        {
+            CheckSHA256(data);
+            data.push_back(insecure_rand() & 0xff);
+        }
+        data.resize(100000, 0x5a);
+        CheckSHA256(data);
+
+        CheckSHA256D64();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_compress)
+{
+    // the getwork midstate: one compression of the first header chunk
+    unsigned char chunk[64];
+    for (int i = 0; i < 64; i++)
+        chunk[i] = i;
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    SHA256Compress(state, chunk);
+
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, chunk, sizeof(chunk));
+    for (int i = 0; i < 8; i++)
+        BOOST_CHECK(state[i] == ctx.h[i]);
+}
+
+BOOST_AUTO_TEST_CASE(sha256_merkle_tree)
+{
+    SHA256AutoDetect();
+    for (int nTx = 1; nTx < 40; nTx++)
+    {
+        CBlock block;
+        for (int i = 0; i < nTx; i++)
+        {
+            CTransaction tx;
+            tx.nLockTime = i;
+            block.vtx.push_back(tx);
+        }
+
+        // level by level with the pairwise Hash(), odd nodes paired with themselves
+        vector<uint256> vLevel;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            vLevel.push_back(tx.GetHash());
+        while (vLevel.size() > 1)
+        {
+            vector<uint256> vNext;
+            for (unsigned int i = 0; i < vLevel.size(); i += 2)
+            {
+                const uint256& right = vLevel[min(i + 1, (unsigned int)vLevel.size() - 1)];
+                vNext.push_back(Hash(BEGIN(vLevel[i]), END(vLevel[i]), BEGIN(right), END(right)));
+            }
+            vLevel.swap(vNext);
+        }
+
+        uint256 hashRoot = block.BuildMerkleTree();
+        BOOST_CHECK(hashRoot == vLevel[0]);
+        for (int i = 0; i < nTx; i++)
+        {
+            BOOST_CHECK(block.GetTxIndex(block.vtx[i].GetHash()) == i);
+            BOOST_CHECK(CBlock::CheckMerkleBranch(block.vtx[i].GetHash(), block.GetMerkleBranch(i), i) == hashRoot);
+        }
+        BOOST_CHECK(block.GetTxIndex(0) == -1);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
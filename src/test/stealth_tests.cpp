@@ -0,0 +1,120 @@
+#include <boost/test/unit_test.hpp>
+
+#include "stealth.h"
+#include "key.h"
+#include "util.h"
+
+using namespace std;
+
+static ec_secret RandomSecret()
+{
+    ec_secret secret;
+    BOOST_CHECK(GenerateRandomSecret(secret) == 0);
+    return secret;
+}
+
+BOOST_AUTO_TEST_SUITE(stealth_tests)
+
+BOOST_AUTO_TEST_CASE(stealth_roundtrip)
+{
+    ECCVerifyHandle verifyHandle;
+
+    ec_secret sScan = RandomSecret();
+    ec_secret sSpend = RandomSecret();
+    ec_point pkScan, pkSpend;
+    BOOST_CHECK(SecretToPublicKey(sScan, pkScan) == 0);
+    BOOST_CHECK(SecretToPublicKey(sSpend, pkSpend) == 0);
+
+    vector<ec_secret> vEphem;
+    vector<ec_point> vEphemPK;
+    vector<ec_point> vPkSent;
+    vector<ec_secret> vSharedSent;
+    for (int i = 0; i < 8; i++)
+    {
+        // -- sender: P = eG, c = H(eQ), R' = R + cG
+        ec_secret sEphem = RandomSecret();
+        ec_point pkEphem, pkOut;
+        ec_secret sShared;
+        BOOST_CHECK(SecretToPublicKey(sEphem, pkEphem) == 0);
+        BOOST_CHECK(StealthSecret(sEphem, pkScan, pkSpend, sShared, pkOut) == 0);
+        vEphem.push_back(sEphem);
+        vEphemPK.push_back(pkEphem);
+        vPkSent.push_back(pkOut);
+        vSharedSent.push_back(sShared);
+    }
+    // -- a malformed ephemeral key must not disturb the other slots
+    vEphemPK.push_back(ec_point(33, 0x05));
+
+    vector<ec_secret> vShared;
+    vector<CPubKey> vPk;
+    BOOST_CHECK(StealthSecretBatch(sScan, pkSpend, vEphemPK, vShared, vPk) == 0);
+    BOOST_CHECK(vPk.size() == vEphemPK.size());
+    BOOST_CHECK(!vPk.back().IsValid());
+
+    for (unsigned int i = 0; i < vPkSent.size(); i++)
+    {
+        // -- receiver sees the same one time key and shared secret, c = H(dP)
+        BOOST_CHECK(vPk[i] == CPubKey(vPkSent[i]));
+        BOOST_CHECK(memcmp(vShared[i].e, vSharedSent[i].e, ec_secret_size) == 0);
+
+        ec_secret sShared;
+        ec_point pkOut;
+        BOOST_CHECK(StealthSecret(sScan, vEphemPK[i], pkSpend, sShared, pkOut) == 0);
+        BOOST_CHECK(pkOut == vPkSent[i]);
+
+        // -- f + c is the private key of R'
+        ec_secret sSpendR;
+        ec_point pkSpendR;
+        BOOST_CHECK(StealthSecretSpend(sScan, vEphemPK[i], sSpend, sSpendR) == 0);
+        BOOST_CHECK(SecretToPublicKey(sSpendR, pkSpendR) == 0);
+        BOOST_CHECK(pkSpendR == vPkSent[i]);
+    }
+}
+
+static ec_secret SecretFromHex(const char* psz)
+{
+    ec_secret secret;
+    vector<unsigned char> vch = ParseHex(psz);
+    BOOST_CHECK(vch.size() == ec_secret_size);
+    memcpy(&secret.e[0], &vch[0], ec_secret_size);
+    return secret;
+}
+
+BOOST_AUTO_TEST_CASE(stealth_known_answer)
+{
+    ECCVerifyHandle verifyHandle;
+
+    // -- vector produced by the OpenSSL implementation this code replaced
+    ec_secret sScan = SecretFromHex("0a5e35ee3bb4f1e6a51c1b3d3b7c8a1a3f0d3c2e9b8f7a6b5c4d3e2f1a0b9c8d");
+    ec_secret sSpend = SecretFromHex("1b6f46ff4cc502f7b62d2c4e4c8d9b2b40e14d3fac90b7c6d5e4f3a2b1c0d9e8");
+    ec_secret sEphem = SecretFromHex("2c7057005dd613082c73e3d5d9eac3c51f25e4b0bda1c8d7e6f5a4b3c2d1e0f9");
+
+    ec_point pkScan, pkSpend, pkEphem;
+    BOOST_CHECK(SecretToPublicKey(sScan, pkScan) == 0);
+    BOOST_CHECK(SecretToPublicKey(sSpend, pkSpend) == 0);
+    BOOST_CHECK(SecretToPublicKey(sEphem, pkEphem) == 0);
+    BOOST_CHECK(HexStr(pkScan) == "030199a4e83f7adce28a683c67e7ec223da6657bfd46c3ebeb761c99201ed404a4");
+    BOOST_CHECK(HexStr(pkSpend) == "03727b767591b0199162c1783975b8aef81924c705faa83f11d69dc06c4aa41a56");
+    BOOST_CHECK(HexStr(pkEphem) == "03eec038431bc10c723c370e2fd275d321648e4048ccec74080871bb6f37430c8e");
+
+    const string strShared = "8a72098d961d86e7d45a70025de041952bb0b698173eb96083e79e5978336c55";
+    const string strPkOut = "0296201bedd2b1436f64a8fd03637ac4e01a4394dfa9411430b3903b6fc304540a";
+
+    // -- sender side, c = H(eQ)
+    ec_secret sShared;
+    ec_point pkOut;
+    BOOST_CHECK(StealthSecret(sEphem, pkScan, pkSpend, sShared, pkOut) == 0);
+    BOOST_CHECK(HexStr(sShared.e, sShared.e + ec_secret_size) == strShared);
+    BOOST_CHECK(HexStr(pkOut) == strPkOut);
+
+    // -- receiver side, c = H(dP)
+    BOOST_CHECK(StealthSecret(sScan, pkEphem, pkSpend, sShared, pkOut) == 0);
+    BOOST_CHECK(HexStr(sShared.e, sShared.e + ec_secret_size) == strShared);
+    BOOST_CHECK(HexStr(pkOut) == strPkOut);
+
+    ec_secret sSpendR;
+    BOOST_CHECK(StealthSecretSpend(sScan, pkEphem, sSpend, sSpendR) == 0);
+    BOOST_CHECK(HexStr(sSpendR.e, sSpendR.e + ec_secret_size) == "a5e1508ce2e289df8a879c50aa6ddcc06c9203d7c3cf712759cc91fc29f4463d");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
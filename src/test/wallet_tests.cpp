@@ -2,6 +2,9 @@
 
 #include "main.h"
 #include "wallet.h"
+#include "walletdb.h"
+
+#include <boost/filesystem.hpp>
 
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
 #define RUN_TESTS 100
@@ -292,4 +295,195 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+static bool less_value(const COutput& a, const COutput& b)
+{
+    return a.tx->vout[a.i].nValue < b.tx->vout[b.i].nValue;
+}
+
+// nOutputs coins of 0.00001 to 10 coins, a thousand outputs per transaction,
+// in order of value like AvailableCoins returns them
+static void make_synthetic_wallet(int nOutputs, vector<COutput>& vOutputs, vector<CWalletTx*>& vTx)
+{
+    for (int n = 0; n < nOutputs; n += 1000)
+    {
+        CTransaction tx;
+        tx.nLockTime = n;
+        tx.vout.resize(min(1000, nOutputs - n));
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+            tx.vout[i].nValue = (insecure_rand() % 1000000 + 1) * 1000;
+        CWalletTx* wtx = new CWalletTx(&wallet, tx);
+        vTx.push_back(wtx);
+        for (unsigned int i = 0; i < wtx->vout.size(); i++)
+            vOutputs.push_back(COutput(wtx, i, 6*24, true));
+    }
+    sort(vOutputs.begin(), vOutputs.end(), less_value);
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_large_wallets)
+{
+    CoinSet setCoinsRet;
+    int64_t nValueRet;
+    unsigned int nSpendTime = GetAdjustedTime();
+
+    // 0.4 + 0.6 is a shade over 1 coin, close enough that the change would be
+    // dust: take that rather than the 5 coin coin and a change output
+    {
+        vector<COutput> vOutputs;
+        vector<CWalletTx*> vTx;
+        CTransaction tx;
+        tx.vout.resize(3);
+        tx.vout[0].nValue = 0.4 * COIN;
+        tx.vout[1].nValue = 0.6 * COIN + 1000;
+        tx.vout[2].nValue = 5 * COIN;
+        vTx.push_back(new CWalletTx(&wallet, tx));
+        for (int i = 0; i < 3; i++)
+            vOutputs.push_back(COutput(vTx[0], i, 6*24, true));
+
+        BOOST_CHECK(wallet.SelectCoinsMinConf(1 * COIN, nSpendTime, 1, 6, vOutputs, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 1 * COIN + 1000);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
+
+        BOOST_FOREACH(CWalletTx* wtx, vTx)
+            delete wtx;
+    }
+
+    // timings for big wallets, run with --log_level=message to see them
+    for (int nOutputs = 10000; nOutputs <= 1000000; nOutputs *= 10)
+    {
+        vector<COutput> vOutputs;
+        vector<CWalletTx*> vTx;
+        make_synthetic_wallet(nOutputs, vOutputs, vTx);
+
+        int64_t vTargets[] = { 1 * COIN, 25 * COIN, 25050 * CENT };
+        BOOST_FOREACH(int64_t nTarget, vTargets)
+        {
+            int64_t nStart = GetTimeMicros();
+            BOOST_CHECK(wallet.SelectCoinsMinConf(nTarget, nSpendTime, 1, 6, vOutputs, setCoinsRet, nValueRet));
+            int64_t nElapsed = GetTimeMicros() - nStart;
+
+            int64_t nTotal = 0;
+            BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& coin, setCoinsRet)
+                nTotal += coin.first->vout[coin.second].nValue;
+            BOOST_CHECK_EQUAL(nTotal, nValueRet);
+            BOOST_CHECK(nValueRet >= nTarget);
+
+            BOOST_TEST_MESSAGE(strprintf("SelectCoinsMinConf: %d outputs, target %s: %u coins, excess %s, %.2fms",
+                nOutputs, FormatMoney(nTarget), setCoinsRet.size(), FormatMoney(nValueRet - nTarget), nElapsed * 0.001));
+        }
+
+        BOOST_FOREACH(CWalletTx* wtx, vTx)
+            delete wtx;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(batch_transaction_tests)
+{
+    // change keys come from the key pool, which needs a wallet file
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() /
+        strprintf("test_transfer_batch_%lu_%i", (unsigned long)GetTime(), GetRandInt(100000));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    mapArgs["-keypool"] = "10";
+    ClearDatadirCache();
+
+    CWallet batchwallet("wallet_batch.dat");
+    bool fFirstRun;
+    BOOST_CHECK(batchwallet.LoadWallet(fFirstRun) == DB_LOAD_OK);
+
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CScript scriptCoin;
+    scriptCoin.SetDestination(pubkey.GetID());
+
+    // 24 coins of 1 TX, a batch of 14 TX takes more than BATCH_SIGN_PARALLEL_MIN inputs
+    vector<COutput> vBatchCoins;
+    {
+        LOCK(batchwallet.cs_wallet);
+        BOOST_CHECK(batchwallet.AddKeyPubKey(key, pubkey));
+        for (int i = 0; i < 24; i++)
+        {
+            CTransaction tx;
+            tx.nTime = GetAdjustedTime() - 3600;
+            tx.nLockTime = i;       // so all transactions get different hashes
+            tx.vout.push_back(CTxOut(1 * COIN, scriptCoin));
+            CWalletTx wtx(&batchwallet, tx);
+            CWalletTx& wtxStored = batchwallet.mapWallet[wtx.GetHash()];
+            wtxStored = wtx;
+            vBatchCoins.push_back(COutput(&wtxStored, 0, 6*24, true));
+        }
+    }
+
+    // 7 payments of 2 TX, at most 3 to a transaction
+    vector<pair<CScript, int64_t> > vecSend;
+    set<CScript> setPayScripts;
+    for (int i = 0; i < 7; i++)
+    {
+        CKey keyPay;
+        keyPay.MakeNewKey(true);
+        CScript scriptPay;
+        scriptPay.SetDestination(keyPay.GetPubKey().GetID());
+        vecSend.push_back(make_pair(scriptPay, 2 * COIN));
+        setPayScripts.insert(scriptPay);
+    }
+
+    vector<CWalletTx> vwtx;
+    list<CReserveKey> lChangeKeys;
+    int64_t nFeeRet = 0;
+    string strFailReason;
+    BOOST_CHECK(batchwallet.CreateTransactionBatch(vecSend, 3, vwtx, lChangeKeys, nFeeRet, strFailReason, &vBatchCoins));
+
+    // split at maxoutputs
+    BOOST_CHECK_EQUAL(vwtx.size(), 3U);
+    BOOST_CHECK_EQUAL(lChangeKeys.size(), vwtx.size());
+
+    set<COutPoint> setSpent;
+    int64_t nFeeTotal = 0;
+    unsigned int nInputs = 0;
+    for (unsigned int nTx = 0; nTx < vwtx.size(); nTx++)
+    {
+        const CWalletTx& wtx = vwtx[nTx];
+        unsigned int nPayments = 0;
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            if (setPayScripts.count(txout.scriptPubKey))
+                nPayments++;
+        BOOST_CHECK_EQUAL(nPayments, nTx < 2 ? 3U : 1U);
+        BOOST_CHECK(wtx.vout.size() <= nPayments + 1);
+
+        int64_t nValueIn = 0;
+        for (unsigned int nIn = 0; nIn < wtx.vin.size(); nIn++)
+        {
+            const COutPoint& prevout = wtx.vin[nIn].prevout;
+
+            // no coin is spent twice across the batch
+            BOOST_CHECK(setSpent.insert(prevout).second);
+
+            const CWalletTx& wtxPrev = batchwallet.mapWallet[prevout.hash];
+            BOOST_CHECK(prevout.n < wtxPrev.vout.size());
+            nValueIn += wtxPrev.vout[prevout.n].nValue;
+
+            // signed, on either signing path
+            BOOST_CHECK(VerifySignature(wtxPrev, wtx, nIn, STANDARD_SCRIPT_VERIFY_FLAGS, 0));
+            nInputs++;
+        }
+
+        // the fee was set for the estimated size, which the signed transaction stays within
+        int64_t nFee = nValueIn - wtx.GetValueOut();
+        unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtx, SER_NETWORK, PROTOCOL_VERSION);
+        BOOST_CHECK(nFee >= nTransactionFee * (1 + (int64_t)nBytes / 1000));
+        BOOST_CHECK(nFee >= GetMinFee(wtx, nBytes, false, GMF_SEND));
+        nFeeTotal += nFee;
+    }
+    BOOST_CHECK_EQUAL(nFeeTotal, nFeeRet);
+    BOOST_CHECK(nInputs >= 16);
+
+    // more than the coins hold
+    vecSend.push_back(make_pair(*setPayScripts.begin(), 20 * COIN));
+    BOOST_CHECK(!batchwallet.CreateTransactionBatch(vecSend, 3, vwtx, lChangeKeys, nFeeRet, strFailReason, &vBatchCoins));
+
+    mapArgs.erase("-datadir");
+    mapArgs.erase("-keypool");
+    ClearDatadirCache();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -197,31 +197,156 @@ bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) cons
     return scanner.foundEntry;
 }
 
-bool CTxDB::WriteAddrIndex(uint160 addrHash, uint256 txHash)
+bool CTxDB::WriteAddrIndex(const CAddrIndexKey& key, const CAddrIndexValue& value)
 {
-    std::vector<uint256> txHashes;
-    if(!ReadAddrIndex(addrHash, txHashes))
+    return Write(make_pair(string("adi"), key), value);
+}
+
+bool CTxDB::EraseAddrIndex(const CAddrIndexKey& key)
+{
+    return Erase(make_pair(string("adi"), key));
+}
+
+// Range scan over the entries of one address, oldest first. The scan reads the
+// database directly, so entries still sitting in an uncommitted batch are not seen.
+bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<CAddrIndexEntry>& vEntries, int nStartHeight, int nEndHeight, unsigned int nMaxEntries)
+{
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("adi"), CAddrIndexKey(addrHash, std::max(nStartHeight, 0), 0));
+    iterator->Seek(ssStartKey.str());
+    while (iterator->Valid())
     {
-	txHashes.push_back(txHash);
-        return Write(make_pair(string("adr"), addrHash), txHashes);
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        CAddrIndexKey key;
+        ssKey >> strType;
+        if (strType != "adi")
+            break;
+        ssKey >> key;
+        if (key.addrHash != addrHash || key.nHeight > nEndHeight)
+            break;
+
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        CAddrIndexValue value;
+        ssValue >> value;
+        vEntries.push_back(make_pair(key, value));
+        if (nMaxEntries && vEntries.size() >= nMaxEntries)
+            break;
+
+        iterator->Next();
     }
-    else
+    bool fOk = iterator->status().ok();
+    delete iterator;
+    return fOk;
+}
+
+bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes)
+{
+    std::vector<CAddrIndexEntry> vEntries;
+    if (!ReadAddrIndex(addrHash, vEntries))
+        return false;
+    txHashes.reserve(txHashes.size() + vEntries.size());
+    BOOST_FOREACH(const CAddrIndexEntry& entry, vEntries)
+        txHashes.push_back(entry.second.txHash);
+    return !vEntries.empty();
+}
+
+bool CTxDB::WriteAddrUnspent(const CAddrUnspentKey& key, const CAddrUnspentValue& value)
+{
+    return Write(make_pair(string("adu"), key), value);
+}
+
+bool CTxDB::EraseAddrUnspent(const CAddrUnspentKey& key)
+{
+    return Erase(make_pair(string("adu"), key));
+}
+
+bool CTxDB::ReadAddrUnspent(uint160 addrHash, std::vector<CAddrUnspentEntry>& vEntries, unsigned int nMaxEntries)
+{
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("adu"), CAddrUnspentKey(addrHash, COutPoint(0, 0)));
+    iterator->Seek(ssStartKey.str());
+    while (iterator->Valid())
     {
-	if(std::find(txHashes.begin(), txHashes.end(), txHash) == txHashes.end()) 
-    	{
-    	    txHashes.push_back(txHash);
-            return Write(make_pair(string("adr"), addrHash), txHashes);
-	}
-	else
-	{
-	    return true; // already have this tx hash
-	}
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        CAddrUnspentKey key;
+        ssKey >> strType;
+        if (strType != "adu")
+            break;
+        ssKey >> key;
+        if (key.addrHash != addrHash)
+            break;
+
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        CAddrUnspentValue value;
+        ssValue >> value;
+        vEntries.push_back(make_pair(key, value));
+        if (nMaxEntries && vEntries.size() >= nMaxEntries)
+            break;
+
+        iterator->Next();
     }
+    bool fOk = iterator->status().ok();
+    delete iterator;
+    return fOk;
 }
 
-bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes)
+bool CTxDB::ReadAddrSummary(uint160 addrHash, CAddrSummary& summary)
+{
+    summary.SetNull();
+    return Read(make_pair(string("ads"), addrHash), summary);
+}
+
+bool CTxDB::WriteAddrSummary(uint160 addrHash, const CAddrSummary& summary)
+{
+    if (summary.nTxCount == 0)
+        return Erase(make_pair(string("ads"), addrHash));
+    return Write(make_pair(string("ads"), addrHash), summary);
+}
+
+// Drop every address index record, including the single value per address
+// layout ("adr") used by older versions.
+bool CTxDB::WipeAddrIndex()
 {
-    return Read(make_pair(string("adr"), addrHash), txHashes);
+    const char* pszPrefixes[] = {"adr", "adi", "ads", "adu"};
+    for (unsigned int i = 0; i < sizeof(pszPrefixes) / sizeof(pszPrefixes[0]); i++)
+    {
+        string strPrefix(pszPrefixes[i]);
+        CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+        ssStartKey << strPrefix;
+
+        leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+        leveldb::WriteBatch batch;
+        unsigned int nBatched = 0;
+        for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey.write(iterator->key().data(), iterator->key().size());
+            string strType;
+            ssKey >> strType;
+            if (strType != strPrefix)
+                break;
+            batch.Delete(iterator->key());
+            if (++nBatched % 10000 == 0)
+            {
+                pdb->Write(leveldb::WriteOptions(), &batch);
+                batch.Clear();
+            }
+        }
+        bool fOk = iterator->status().ok();
+        delete iterator;
+        leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+        if (!fOk || !status.ok())
+            return error("WipeAddrIndex() : failed to erase %s records", strPrefix);
+    }
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -8,6 +8,7 @@
 
 #include "main.h"
 
+#include <limits>
 #include <map>
 #include <string>
 #include <vector>
@@ -184,7 +185,29 @@ public:
     }
 
     bool ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes);
-    bool WriteAddrIndex(uint160 addrHash, uint256 txHash);
+    bool ReadAddrIndex(uint160 addrHash, std::vector<CAddrIndexEntry>& vEntries, int nStartHeight=0,
+                       int nEndHeight=std::numeric_limits<int>::max(), unsigned int nMaxEntries=0);
+    bool WriteAddrIndex(const CAddrIndexKey& key, const CAddrIndexValue& value);
+    bool EraseAddrIndex(const CAddrIndexKey& key);
+    bool ReadAddrUnspent(uint160 addrHash, std::vector<CAddrUnspentEntry>& vEntries, unsigned int nMaxEntries=0);
+    bool WriteAddrUnspent(const CAddrUnspentKey& key, const CAddrUnspentValue& value);
+    bool EraseAddrUnspent(const CAddrUnspentKey& key);
+    bool ReadAddrSummary(uint160 addrHash, CAddrSummary& summary);
+    bool WriteAddrSummary(uint160 addrHash, const CAddrSummary& summary);
+    bool WipeAddrIndex();
+    bool ReadAddrIndexVersion(int& nVersion)
+    {
+        nVersion = 0;
+        return Read(std::string("addrindexversion"), nVersion);
+    }
+    bool WriteAddrIndexVersion(int nVersion)
+    {
+        return Write(std::string("addrindexversion"), nVersion);
+    }
+    bool EraseAddrIndexVersion()
+    {
+        return Erase(std::string("addrindexversion"));
+    }
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -26,11 +26,14 @@ extern const std::string CLIENT_DATE;
 //
 static const int DATABASE_VERSION = 70509;
 
+// address index layout, rebuilt on startup when the stored version differs
+static const int ADDRESS_INDEX_VERSION = 2;
+
 //
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 61403;
+static const int PROTOCOL_VERSION = 61405;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -43,6 +46,12 @@ static const int MIN_POOL_PEER_PROTO_VERSION = 61403;
 
 static const int MIN_INSTANTX_PROTO_VERSION = 61403;
 
+// masternode list sync through mnlistget/mnlist instead of dseg, starting with this version
+static const int MIN_MASTERNODE_LIST_SYNC_PROTO_VERSION = 61404;
+
+// cmpctblock/getblocktxn/blocktxn block relay, starting with this version
+static const int COMPACT_BLOCKS_VERSION = 61405;
+
 //! minimum peer version that can receive masternode payments
 // V1 - Last protocol version before update
 // V2 - Newest protocol version
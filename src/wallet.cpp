@@ -459,6 +459,37 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+// Re-evaluate the outputs of wtx in mapAvailableCoins, after it was added,
+// its spent flags changed or (fErase) before it leaves mapWallet
+void CWallet::UpdateAvailableCoins(const CWalletTx& wtx, bool fErase)
+{
+    AssertLockHeld(cs_wallet);
+    const uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        const CTxOut& txout = wtx.vout[i];
+        pair<int64_t, COutPoint> key(txout.nValue, COutPoint(hash, i));
+        if (fErase || txout.nValue <= 0 || wtx.IsSpent(i))
+        {
+            mapAvailableCoins.erase(key);
+            continue;
+        }
+        isminetype mine = IsMine(txout);
+        if (mine == ISMINE_NO)
+            mapAvailableCoins.erase(key);
+        else
+            mapAvailableCoins[key] = mine;
+    }
+}
+
+void CWallet::RebuildAvailableCoins()
+{
+    AssertLockHeld(cs_wallet);
+    mapAvailableCoins.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateAvailableCoins((*it).second);
+}
+
 
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
@@ -588,10 +619,12 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // keys may have been added, which changes what IsMine says
+        RebuildAvailableCoins();
     }
 }
 
-bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
+bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
 {
     uint256 hash = wtxIn.GetHash();
     if (fFromLoadWallet)
@@ -613,7 +646,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         if (fInsertedNew)
         {
             wtx.nTimeReceived = GetAdjustedTime();
-            wtx.nOrderPos = IncOrderPosNext();
+            wtx.nOrderPos = IncOrderPosNext(pwalletdb);
             wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
@@ -690,11 +723,12 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Write to disk
         if (fInsertedNew || fUpdated)
-            if (!wtx.WriteToDisk())
+            if (!wtx.WriteToDisk(pwalletdb))
                 return false;
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        UpdateAvailableCoins(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -723,8 +757,10 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
         bool fExisted = mapWallet.count(hash);
         if (fExisted && !fUpdate) return false;
 
+        // -- most transactions carry no stealth metadata, skip the parse for those
         mapValue_t mapNarr;
-        FindStealthTransactions(tx, mapNarr);
+        if (tx.HasStealthMetadata())
+            FindStealthTransactions(tx, mapNarr);
 
         if (fExisted || IsMine(tx) || IsFromMe(tx))
         {
@@ -778,8 +814,13 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            UpdateAvailableCoins((*mi).second, true);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -1155,8 +1196,10 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
     reverse(vtxPrev.begin(), vtxPrev.end());
 }
 
-bool CWalletTx::WriteToDisk()
+bool CWalletTx::WriteToDisk(CWalletDB *pwalletdb)
 {
+    if (pwalletdb)
+        return pwalletdb->WriteTx(GetHash(), *this);
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
@@ -1246,6 +1289,7 @@ void CWallet::ReacceptWalletTransactions()
                     LogPrintf("ReacceptWalletTransactions found spent coin %s TX %s\n", FormatMoney(wtx.GetCredit(ISMINE_ALL)), wtx.GetHash().ToString());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdateAvailableCoins(wtx);
                 }
             }
             else
@@ -1609,60 +1653,83 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     return nTotal;
 }
 
-// populate vCoins with vector of available COutputs.
+// Depth of pcoin if its outputs may be spent under the AvailableCoins rules, 0 otherwise
+static int GetAvailableDepth(const CWalletTx* pcoin, bool fOnlyConfirmed, bool useIX)
+{
+    if (!IsFinalTx(*pcoin))
+        return 0;
+
+    if (fOnlyConfirmed && !pcoin->IsTrusted())
+        return 0;
+
+    if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+        return 0;
+
+    if(pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0)
+        return 0;
+
+    int nDepth = pcoin->GetDepthInMainChain(false);
+    if (nDepth <= 0) // TXNOTE: coincontrol fix / ignore 0 confirm
+        return 0;
+
+    // do not use IX for inputs that have less then 6 blockchain confirmations
+    if (useIX && nDepth < 10)
+        return 0;
+
+    return nDepth;
+}
+
+// populate vCoins with vector of available COutputs, in order of increasing value.
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, AvailableCoinsType coin_type, bool useIX) const
 {
     vCoins.clear();
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+        int64_t nMNCollateral = GetMNCollateral(pindexBest->nHeight)*COIN;
 
-            if (!IsFinalTx(*pcoin))
-                continue;
+        // the transaction checks are shared by all its outputs, only do them once
+        map<const CWalletTx*, int> mapDepth;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+        vCoins.reserve(mapAvailableCoins.size());
+        for (AvailableCoinsIndex::const_iterator it = mapAvailableCoins.begin(); it != mapAvailableCoins.end(); ++it)
+        {
+            int64_t nValue = (*it).first.first;
+            const COutPoint& outpoint = (*it).first.second;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+            bool found = false;
+            if(coin_type == ONLY_DENOMINATED) {
+                found = IsDenominatedAmount(nValue);
+            } else if(coin_type == ONLY_NOT10000IFMN) {
+                found = !(fMasterNode && nValue == nMNCollateral);
+            } else if (coin_type == ONLY_NONDENOMINATED_NOT10000IFMN){
+                if (IsCollateralAmount(nValue)) continue; // do not use collateral amounts
+                found = !IsDenominatedAmount(nValue);
+                if(found && fMasterNode) found = nValue != nMNCollateral; // do not use Hot MN funds
+            } else {
+                found = true;
+            }
+            if(!found) continue;
 
-            if(pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0)
+            if (IsLockedCoin(outpoint.hash, outpoint.n) ||
+                (coinControl && coinControl->HasSelected() && !coinControl->IsSelected(outpoint.hash, outpoint.n)))
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            if (nDepth <= 0) // TXNOTE: coincontrol fix / ignore 0 confirm
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+            if (mi == mapWallet.end())
                 continue;
-
-            // do not use IX for inputs that have less then 6 blockchain confirmations
-            if (useIX && nDepth < 10)
+            const CWalletTx* pcoin = &(*mi).second;
+            if (pcoin->IsSpent(outpoint.n))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if(coin_type == ONLY_DENOMINATED) {
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if(coin_type == ONLY_NOT10000IFMN) {
-                    found = !(fMasterNode && pcoin->vout[i].nValue == GetMNCollateral(pindexBest->nHeight)*COIN);
-                } else if (coin_type == ONLY_NONDENOMINATED_NOT10000IFMN){
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if(found && fMasterNode) found = pcoin->vout[i].nValue != GetMNCollateral(pindexBest->nHeight)*COIN; // do not use Hot MN funds
-                } else {
-                    found = true;
-                }
-                if(!found) continue;
+            map<const CWalletTx*, int>::iterator md = mapDepth.find(pcoin);
+            if (md == mapDepth.end())
+                md = mapDepth.insert(make_pair(pcoin, GetAvailableDepth(pcoin, fOnlyConfirmed, useIX))).first;
+            int nDepth = (*md).second;
+            if (nDepth <= 0)
+                continue;
 
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(pcoin->IsSpent(i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                {
-                    vCoins.push_back(COutput(pcoin, i, nDepth, mine & ISMINE_SPENDABLE));
-                }
-            }
+            vCoins.push_back(COutput(pcoin, outpoint.n, nDepth, (*it).second & ISMINE_SPENDABLE));
         }
     }
 }
@@ -1785,10 +1852,22 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
+// Upper bounds on coin selection effort: steps of the branch and bound search,
+// and coin visits per stochastic approximation run (iterations are scaled down
+// for big wallets, but never below 10)
+static const int SELECT_COINS_BNB_TRIES = 100000;
+static const int64_t SELECT_COINS_APPROX_EFFORT = 10000000;
+
+static int InsecureRandIndex(int n)
+{
+    return insecure_rand() % n;
+}
+
+static void ApproximateBestSubset(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTotalLower, int64_t nTargetValue,
                                   vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
+    vector<char> vfFirstPass;
 
     vfBest.assign(vValue.size(), true);
     nBest = nTotalLower;
@@ -1802,6 +1881,10 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
         bool fReachedTarget = false;
         for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
         {
+            // Copying vfIncluded at every improvement is quadratic on big
+            // wallets. Past the last improving coin nothing has changed
+            // since the start of the pass, so only note where it was.
+            int nBestIndex = -1;
             for (unsigned int i = 0; i < vValue.size(); i++)
             {
                 //The solver here uses a randomized algorithm,
@@ -1820,35 +1903,103 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
                         if (nTotal < nBest)
                         {
                             nBest = nTotal;
-                            vfBest = vfIncluded;
+                            nBestIndex = i;
                         }
                         nTotal -= vValue[i].first;
                         vfIncluded[i] = false;
                     }
                 }
             }
+            if (nBestIndex >= 0)
+            {
+                vfBest.assign(vfIncluded.begin(), vfIncluded.begin() + nBestIndex);
+                vfBest.push_back(true);
+                if (nPass == 0)
+                    vfBest.resize(vValue.size(), false);
+                else
+                    vfBest.insert(vfBest.end(), vfFirstPass.begin() + nBestIndex + 1, vfFirstPass.end());
+            }
+            if (nPass == 0 && !fReachedTarget)
+                vfFirstPass = vfIncluded;
         }
     }
 }
 
-// TODO: find appropriate place for this sort function
-// move denoms down
-bool less_then_denom (const COutput& out1, const COutput& out2)
+// Depth first branch and bound search for a subset of vValue (sorted by
+// decreasing value) adding up to at least nTargetValue but less than
+// nTargetValue + nCostOfChange, i.e. a selection that needs no change output.
+// Returns the closest such subset found within SELECT_COINS_BNB_TRIES steps.
+static bool SelectCoinsBnB(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTargetValue, int64_t nCostOfChange,
+                           vector<char>& vfBest, int64_t& nBest)
 {
-    const CWalletTx *pcoin1 = out1.tx;
-    const CWalletTx *pcoin2 = out2.tx;
+    // value of the coins not decided on yet
+    int64_t nAvailable = 0;
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        nAvailable += vValue[i].first;
+    if (nAvailable < nTargetValue)
+        return false;
+
+    // vfSelected[i] says whether vValue[i] is in the current selection
+    vector<char> vfSelected;
+    vfSelected.reserve(vValue.size());
+    int64_t nSelected = 0;
+    bool fFound = false;
 
-    bool found1 = false;
-    bool found2 = false;
-    BOOST_FOREACH(int64_t d, darkSendDenominations) // loop through predefined denoms
+    for (int nTries = 0; nTries < SELECT_COINS_BNB_TRIES; nTries++)
     {
-        if(pcoin1->vout[out1.i].nValue == d) found1 = true;
-        if(pcoin2->vout[out2.i].nValue == d) found2 = true;
+        bool fBacktrack = false;
+        if (nSelected + nAvailable < nTargetValue || nSelected >= nTargetValue + nCostOfChange)
+        {
+            // target out of reach, or overshot: nothing down this branch
+            fBacktrack = true;
+        }
+        else if (nSelected >= nTargetValue)
+        {
+            if (!fFound || nSelected < nBest)
+            {
+                fFound = true;
+                nBest = nSelected;
+                vfBest = vfSelected;
+                vfBest.resize(vValue.size(), false);
+                if (nBest == nTargetValue)
+                    break;
+            }
+            // any more coins would only add to the excess
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // undo the trailing omissions, then omit the last included coin instead
+            while (!vfSelected.empty() && !vfSelected.back())
+            {
+                vfSelected.pop_back();
+                nAvailable += vValue[vfSelected.size()].first;
+            }
+            if (vfSelected.empty())
+                break; // searched the whole tree
+            vfSelected.back() = false;
+            nSelected -= vValue[vfSelected.size() - 1].first;
+        }
+        else
+        {
+            unsigned int i = vfSelected.size();
+            nAvailable -= vValue[i].first;
+            // including a coin right after omitting one of the same value
+            // repeats a selection that has been tried already
+            if (i > 0 && !vfSelected.back() && vValue[i].first == vValue[i - 1].first)
+                vfSelected.push_back(false);
+            else
+            {
+                vfSelected.push_back(true);
+                nSelected += vValue[i].first;
+            }
+        }
     }
-    return (!found1 && found2);
+    return fFound;
 }
 
-bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
+bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -1857,13 +2008,15 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
     pair<int64_t, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<int64_t>::max();
     coinLowestLarger.second.first = NULL;
+    int nLowestLargerCount = 0;
     vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
     int64_t nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // Change below this is dust for a pay-to-pubkey-hash output (34 bytes),
+    // CreateTransaction would give it to the fee
+    int64_t nCostOfChange = MIN_RELAY_TX_FEE * 3 * (34 + 148) / 1000;
 
-    // move denoms down on the list
-    sort(vCoins.begin(), vCoins.end(), less_then_denom);
+    seed_insecure_rand();
 
     // try to find nondenom first to prevent unneeded spending of mixed coins
     for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++)
@@ -1872,6 +2025,11 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
         vValue.clear();
         nTotalLower = 0;
 
+        // vCoins isn't shuffled, so an exact match or the lowest larger coin
+        // is picked at random among coins of the same value as it goes
+        pair<int64_t, pair<const CWalletTx*,unsigned int> > coinExact;
+        int nExactCount = 0;
+
     BOOST_FOREACH(const COutput &output, vCoins)
     {
         if (!output.fSpendable)
@@ -1896,9 +2054,8 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
 
         if (n == nTargetValue)
         {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
+            if (InsecureRandIndex(++nExactCount) == 0)
+                coinExact = coin;
         }
         else if (n < nTargetValue + CENT)
         {
@@ -1906,11 +2063,23 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
             nTotalLower += n;
         }
         else if (n < coinLowestLarger.first)
+        {
+            coinLowestLarger = coin;
+            nLowestLargerCount = 1;
+        }
+        else if (n == coinLowestLarger.first && InsecureRandIndex(++nLowestLargerCount) == 0)
         {
             coinLowestLarger = coin;
         }
     }
 
+    if (nExactCount > 0)
+    {
+        setCoinsRet.insert(coinExact.second);
+        nValueRet += coinExact.first;
+        return true;
+    }
+
     if (nTotalLower == nTargetValue)
     {
         for (unsigned int i = 0; i < vValue.size(); ++i)
@@ -1930,38 +2099,64 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Largest first, coins of the same value in random order. Coins from
+    // AvailableCoins come sorted by value already, only ties need shuffling.
+    bool fAscending = true;
+    for (unsigned int i = 1; i < vValue.size() && fAscending; i++)
+        fAscending = vValue[i - 1].first <= vValue[i].first;
+    if (fAscending)
+    {
+        reverse(vValue.begin(), vValue.end());
+        unsigned int j;
+        for (unsigned int i = 0; i < vValue.size(); i = j)
+        {
+            j = i + 1;
+            while (j < vValue.size() && vValue[j].first == vValue[i].first)
+                j++;
+            random_shuffle(vValue.begin() + i, vValue.begin() + j, InsecureRandIndex);
+        }
+    }
+    else
+    {
+        random_shuffle(vValue.begin(), vValue.end(), InsecureRandIndex);
+        stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    }
     vector<char> vfBest;
     int64_t nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
-
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
-    //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
-        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
+    // Look for a subset that needs no change first
+    if (!SelectCoinsBnB(vValue, nTargetValue, nCostOfChange, vfBest, nBest))
     {
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-    }
-    else {
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-            {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-            }
+        // Solve subset sum by stochastic approximation
+        int nIterations = std::max((int64_t)10, std::min((int64_t)1000, SELECT_COINS_APPROX_EFFORT / (int64_t)vValue.size()));
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nIterations);
 
-        LogPrint("selectcoins", "SelectCoins() best subset: ");
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-                LogPrint("selectcoins", "%s ", FormatMoney(vValue[i].first));
-        LogPrint("selectcoins", "total %s\n", FormatMoney(nBest));
+        // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+        //                                   or the next bigger coin is closer), return the bigger coin
+        if (coinLowestLarger.second.first &&
+            ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
+        {
+            setCoinsRet.insert(coinLowestLarger.second);
+            nValueRet += coinLowestLarger.first;
+            return true;
+        }
     }
 
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        if (vfBest[i])
+        {
+            setCoinsRet.insert(vValue[i].second);
+            nValueRet += vValue[i].first;
+        }
+
+    LogPrint("selectcoins", "SelectCoins() best subset: ");
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        if (vfBest[i])
+            LogPrint("selectcoins", "%s ", FormatMoney(vValue[i].first));
+    LogPrint("selectcoins", "total %s\n", FormatMoney(nBest));
+
     return true;
     }
     return false;
@@ -2015,7 +2210,7 @@ bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pai
         return (nValueRet >= nTargetValue);
     }
 
-    boost::function<bool (const CWallet*, int64_t, unsigned int, int, int, std::vector<COutput>, std::set<std::pair<const CWalletTx*,unsigned int> >&, int64_t&)> f = &CWallet::SelectCoinsMinConf;
+    boost::function<bool (const CWallet*, int64_t, unsigned int, int, int, const std::vector<COutput>&, std::set<std::pair<const CWalletTx*,unsigned int> >&, int64_t&)> f = &CWallet::SelectCoinsMinConf;
 
     return (f(this, nTargetValue, nSpendTime, 1, 10, vCoins, setCoinsRet, nValueRet) ||
             f(this, nTargetValue, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet) ||
@@ -3113,21 +3308,24 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
     ec_secret sSpendR;
     ec_secret sSpend;
     ec_secret sScan;
-    ec_secret sShared;
-
-    ec_point pkExtracted;
 
     std::vector<uint8_t> vchEphemPK;
-    std::vector<uint8_t> vchDataB;
     std::vector<uint8_t> vchENarr;
     opcodetype opCode;
     char cbuf[256];
 
+    // -- collect the ephemeral keys and the outputs they could pay, so each owned
+    //    address costs one batch of point multiplications per tx instead of one per output pair
+    std::vector<ec_point> vEphemPK;
+    std::vector<std::vector<uint8_t> > vEncNarr;
+    std::vector<int32_t> vEphemOutputId;
+    // every output paying a key, a one time key may be paid more than once
+    std::map<CKeyID, std::vector<int32_t> > mapCandidates;
+
     int32_t nOutputIdOuter = -1;
     BOOST_FOREACH(const CTxOut& txout, tx.vout)
     {
         nOutputIdOuter++;
-        // -- for each OP_RETURN need to check all other valid outputs
 
         //printf("txout scriptPubKey %s\n",  txout.scriptPubKey.ToString().c_str());
         CScript::const_iterator itTxA = txout.scriptPubKey.begin();
@@ -3162,169 +3360,184 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
             continue;
         }
 
-        int32_t nOutputId = -1;
         nStealth++;
-        BOOST_FOREACH(const CTxOut& txoutB, tx.vout)
+        vEphemPK.push_back(vchEphemPK);
+        vEphemOutputId.push_back(nOutputIdOuter);
+
+        if (txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
+            && opCode == OP_RETURN
+            && txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
+            && vchENarr.size() > 0)
+            vEncNarr.push_back(vchENarr);
+        else
+            vEncNarr.push_back(std::vector<uint8_t>());
+    };
+
+    if (vEphemPK.empty())
+        return true;
+
+    int32_t nOutputId = -1;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        nOutputId++;
+
+        CTxDestination address;
+        if (!ExtractDestination(txout.scriptPubKey, address)
+            || address.type() != typeid(CKeyID))
+            continue;
+
+        CKeyID ckidMatch = boost::get<CKeyID>(address);
+        if (HaveKey(ckidMatch)) // no point checking if already have key
+            continue;
+
+        mapCandidates[ckidMatch].push_back(nOutputId);
+    };
+
+    if (mapCandidates.empty())
+        return true;
+
+    std::vector<bool> vMatched(vEphemPK.size(), false); // only 1 txn will match an ephem pk
+    std::vector<ec_secret> vShared;
+    std::vector<CPubKey> vPkExtracted;
+
+    std::set<CStealthAddress>::iterator it;
+    for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+    {
+        if (it->scan_secret.size() != ec_secret_size)
+            continue; // stealth address is not owned
+
+        //printf("it->Encodeded() %s\n",  it->Encoded().c_str());
+        memcpy(&sScan.e[0], &it->scan_secret[0], ec_secret_size);
+
+        if (StealthSecretBatch(sScan, it->spend_pubkey, vEphemPK, vShared, vPkExtracted) != 0)
         {
-            nOutputId++;
+            printf("StealthSecretBatch failed.\n");
+            continue;
+        };
 
-            if (&txoutB == &txout)
+        for (unsigned int i = 0; i < vEphemPK.size(); ++i)
+        {
+            if (vMatched[i])
                 continue;
 
-            bool txnMatch = false; // only 1 txn will match an ephem pk
-            //printf("txoutB scriptPubKey %s\n",  txoutB.scriptPubKey.ToString().c_str());
+            const CPubKey& cpkE = vPkExtracted[i];
+            if (!cpkE.IsValid())
+                continue;
 
-            CTxDestination address;
-            if (!ExtractDestination(txoutB.scriptPubKey, address))
+            std::map<CKeyID, std::vector<int32_t> >::const_iterator mi = mapCandidates.find(cpkE.GetID());
+            if (mi == mapCandidates.end())
                 continue;
 
-            if (address.type() != typeid(CKeyID))
+            if (HaveKey(mi->first)) // added for an earlier ephem pk
                 continue;
 
-            CKeyID ckidMatch = boost::get<CKeyID>(address);
+            // -- the narration belongs to the paying output right before the ephem pk output
+            nOutputId = mi->second.front();
+            BOOST_FOREACH(int32_t nId, mi->second)
+                if (nId < vEphemOutputId[i])
+                    nOutputId = nId;
+            ec_secret& sShared = vShared[i];
 
-            if (HaveKey(ckidMatch)) // no point checking if already have key
-                continue;
+            if (fDebug)
+                printf("Found stealth txn to address %s\n", it->Encoded().c_str());
 
-            std::set<CStealthAddress>::iterator it;
-            for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+            if (IsLocked())
             {
-                if (it->scan_secret.size() != ec_secret_size)
-                    continue; // stealth address is not owned
+                if (fDebug)
+                    printf("Wallet is locked, adding key without secret.\n");
 
-                //printf("it->Encodeded() %s\n",  it->Encoded().c_str());
-                memcpy(&sScan.e[0], &it->scan_secret[0], ec_secret_size);
+                // -- add key without secret
+                std::vector<uint8_t> vchEmpty;
+                AddCryptedKey(cpkE, vchEmpty);
+                CKeyID keyId = cpkE.GetID();
+                CTransfercoinAddress coinAddress(keyId);
+                std::string sLabel = it->Encoded();
+                SetAddressBookName(keyId, sLabel);
 
-                if (StealthSecret(sScan, vchEphemPK, it->spend_pubkey, sShared, pkExtracted) != 0)
-                {
-                    printf("StealthSecret failed.\n");
-                    continue;
-                };
-                //printf("pkExtracted %"PRIszu": %s\n", pkExtracted.size(), HexStr(pkExtracted).c_str());
+                CPubKey cpkEphem(vEphemPK[i]);
+                CPubKey cpkScan(it->scan_pubkey);
+                CStealthKeyMetadata lockedSkMeta(cpkEphem, cpkScan);
 
-                CPubKey cpkE(pkExtracted);
+                if (!CWalletDB(strWalletFile).WriteStealthKeyMeta(keyId, lockedSkMeta))
+                    printf("WriteStealthKeyMeta failed for %s\n", coinAddress.ToString().c_str());
 
-                if (!cpkE.IsValid())
-                    continue;
-                CKeyID ckidE = cpkE.GetID();
-
-                if (ckidMatch != ckidE)
+                mapStealthKeyMeta[keyId] = lockedSkMeta;
+                nFoundStealth++;
+            } else
+            {
+                if (it->spend_secret.size() != ec_secret_size)
                     continue;
+                memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
 
-                if (fDebug)
-                    printf("Found stealth txn to address %s\n", it->Encoded().c_str());
 
-                if (IsLocked())
+                if (StealthSharedToSecretSpend(sShared, sSpend, sSpendR) != 0)
                 {
-                    if (fDebug)
-                        printf("Wallet is locked, adding key without secret.\n");
-
-                    // -- add key without secret
-                    std::vector<uint8_t> vchEmpty;
-                    AddCryptedKey(cpkE, vchEmpty);
-                    CKeyID keyId = cpkE.GetID();
-                    CTransfercoinAddress coinAddress(keyId);
-                    std::string sLabel = it->Encoded();
-                    SetAddressBookName(keyId, sLabel);
-
-                    CPubKey cpkEphem(vchEphemPK);
-                    CPubKey cpkScan(it->scan_pubkey);
-                    CStealthKeyMetadata lockedSkMeta(cpkEphem, cpkScan);
-
-                    if (!CWalletDB(strWalletFile).WriteStealthKeyMeta(keyId, lockedSkMeta))
-                        printf("WriteStealthKeyMeta failed for %s\n", coinAddress.ToString().c_str());
-
-                    mapStealthKeyMeta[keyId] = lockedSkMeta;
-                    nFoundStealth++;
-                } else
-                {
-                    if (it->spend_secret.size() != ec_secret_size)
-                        continue;
-                    memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
-
-
-                    if (StealthSharedToSecretSpend(sShared, sSpend, sSpendR) != 0)
-                    {
-                        printf("StealthSharedToSecretSpend() failed.\n");
-                        continue;
-                    };
+                    printf("StealthSharedToSecretSpend() failed.\n");
+                    continue;
+                };
 
-                    ec_point pkTestSpendR;
-                    if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
-                    {
-                        printf("SecretToPublicKey() failed.\n");
-                        continue;
-                    };
+                CSecret vchSecret;
+                vchSecret.resize(ec_secret_size);
 
-                    CSecret vchSecret;
-                    vchSecret.resize(ec_secret_size);
+                memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
+                CKey ckey;
 
-                    memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
-                    CKey ckey;
+                try {
+                    ckey.Set(vchSecret.begin(), vchSecret.end(), true);
+                } catch (std::exception& e) {
+                    printf("ckey.SetSecret() threw: %s.\n", e.what());
+                    continue;
+                };
 
-                    try {
-            ckey.Set(vchSecret.begin(), vchSecret.end(), true);
-                        //ckey.SetSecret(vchSecret, true);
-                    } catch (std::exception& e) {
-                        printf("ckey.SetSecret() threw: %s.\n", e.what());
-                        continue;
-                    };
+                if (!ckey.IsValid())
+                {
+                    printf("Reconstructed key is invalid.\n");
+                    continue;
+                };
 
-                    CPubKey cpkT = ckey.GetPubKey();
-                    if (!cpkT.IsValid())
-                    {
-                        printf("cpkT is invalid.\n");
-                        continue;
-                    };
+                CPubKey cpkT = ckey.GetPubKey();
+                if (!cpkT.IsValid())
+                {
+                    printf("cpkT is invalid.\n");
+                    continue;
+                };
 
-                    if (!ckey.IsValid())
-                    {
-                        printf("Reconstructed key is invalid.\n");
-                        continue;
-                    };
+                CKeyID keyID = cpkT.GetID();
+                if (fDebug)
+                {
+                    CTransfercoinAddress coinAddress(keyID);
+                    printf("Adding key %s.\n", coinAddress.ToString().c_str());
+                };
 
-                    CKeyID keyID = cpkT.GetID();
-                    if (fDebug)
-                    {
-                        CTransfercoinAddress coinAddress(keyID);
-                        printf("Adding key %s.\n", coinAddress.ToString().c_str());
-                    };
+                if (!AddKey(ckey))
+                {
+                    printf("AddKey failed.\n");
+                    continue;
+                };
 
-                    if (!AddKey(ckey))
-                    {
-                        printf("AddKey failed.\n");
-                        continue;
-                    };
+                std::string sLabel = it->Encoded();
+                SetAddressBookName(keyID, sLabel);
+                nFoundStealth++;
+            };
 
-                    std::string sLabel = it->Encoded();
-                    SetAddressBookName(keyID, sLabel);
-                    nFoundStealth++;
-                };
+            vMatched[i] = true;
 
-                if (txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
-                    && opCode == OP_RETURN
-                    && txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
-                    && vchENarr.size() > 0)
+            std::vector<uint8_t>& vchNarrEnc = vEncNarr[i];
+            if (vchNarrEnc.size() > 0)
+            {
+                SecMsgCrypter crypter;
+                crypter.SetKey(&sShared.e[0], &vEphemPK[i][0]);
+                std::vector<uint8_t> vchNarr;
+                if (!crypter.Decrypt(&vchNarrEnc[0], vchNarrEnc.size(), vchNarr))
                 {
-                    SecMsgCrypter crypter;
-                    crypter.SetKey(&sShared.e[0], &vchEphemPK[0]);
-                    std::vector<uint8_t> vchNarr;
-                    if (!crypter.Decrypt(&vchENarr[0], vchENarr.size(), vchNarr))
-                    {
-                        printf("Decrypt narration failed.\n");
-                        continue;
-                    };
-                    std::string sNarr = std::string(vchNarr.begin(), vchNarr.end());
-
-                    snprintf(cbuf, sizeof(cbuf), "n_%d", nOutputId);
-                    mapNarr[cbuf] = sNarr;
+                    printf("Decrypt narration failed.\n");
+                    continue;
                 };
+                std::string sNarr = std::string(vchNarr.begin(), vchNarr.end());
 
-                txnMatch = true;
-                break;
+                snprintf(cbuf, sizeof(cbuf), "n_%d", nOutputId);
+                mapNarr[cbuf] = sNarr;
             };
-            if (txnMatch)
-                break;
         };
     };
 
@@ -3701,6 +3914,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateAvailableCoins(coin);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -3723,6 +3937,328 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
     return true;
 }
 
+// Signature script size of a pay-to-pubkey-hash input with an uncompressed
+// key, the most a single-key input of ours takes. Batch transactions are
+// sized with this before they are signed.
+static const unsigned int MAX_SINGLE_KEY_SCRIPTSIG_SIZE = 140;
+
+// batches with at least this many inputs are signed on several threads
+static const unsigned int BATCH_SIGN_PARALLEL_MIN = 16;
+
+// Sign vInputs[nBegin, nEnd) of a batch: (transaction, input) pairs with
+// the output they spend. SignatureHash reads every input of the transaction
+// being signed, so each thread signs its own copy and hands back the script.
+static void SignBatchInputs(const CKeyStore* pkeystore, const vector<CWalletTx>& vwtx,
+                            const vector<pair<unsigned int, unsigned int> >& vInputs, const vector<const CWalletTx*>& vPrev,
+                            vector<CScript>& vScriptSig, vector<char>& vfSigned, size_t nBegin, size_t nEnd)
+{
+    CTransaction txTmp;
+    unsigned int nTx = std::numeric_limits<unsigned int>::max();
+    for (size_t i = nBegin; i < nEnd; i++)
+    {
+        if (vInputs[i].first != nTx)
+        {
+            nTx = vInputs[i].first;
+            txTmp = vwtx[nTx];
+        }
+        vfSigned[i] = SignSignature(*pkeystore, *vPrev[i], txTmp, vInputs[i].second);
+        vScriptSig[i] = txTmp.vin[vInputs[i].second].scriptSig;
+    }
+}
+
+bool CWallet::CreateTransactionBatch(const vector<pair<CScript, int64_t> >& vecSend, unsigned int nMaxOutputs, vector<CWalletTx>& vwtxNew,
+                                     list<CReserveKey>& lChangeKeys, int64_t& nFeeRet, std::string& strFailReason,
+                                     const vector<COutput>* pvCoins)
+{
+    vwtxNew.clear();
+    lChangeKeys.clear();
+    nFeeRet = 0;
+
+    if (vecSend.empty() || nMaxOutputs == 0)
+    {
+        strFailReason = _("Transaction amounts must be positive");
+        return false;
+    }
+    BOOST_FOREACH (const PAIRTYPE(CScript, int64_t)& s, vecSend)
+    {
+        if (s.second <= 0)
+        {
+            strFailReason = _("Transaction amounts must be positive");
+            return false;
+        }
+        if (CTxOut(s.second, s.first).IsDust(MIN_RELAY_TX_FEE))
+        {
+            strFailReason = _("Transaction amount too small");
+            return false;
+        }
+    }
+
+    // txdb must be opened before the mapWallet lock
+    CTxDB txdb("r");
+    LOCK2(cs_main, cs_wallet);
+
+    // Coins for the whole batch come from one pass over the wallet, every
+    // transaction takes its inputs from what the ones before it left
+    vector<COutput> vCoins;
+    if (pvCoins)
+        vCoins = *pvCoins;
+    else
+        AvailableCoins(vCoins, true);
+
+    vector<unsigned int> vEstimatedBytes;
+    vwtxNew.reserve((vecSend.size() + nMaxOutputs - 1) / nMaxOutputs);
+    for (unsigned int nStart = 0; nStart < vecSend.size(); nStart += nMaxOutputs)
+    {
+        unsigned int nEnd = std::min((unsigned int)vecSend.size(), nStart + nMaxOutputs);
+        int64_t nValue = 0;
+        for (unsigned int i = nStart; i < nEnd; i++)
+            nValue += vecSend[i].second;
+
+        vwtxNew.push_back(CWalletTx());
+        CWalletTx& wtxNew = vwtxNew.back();
+        wtxNew.fTimeReceivedIsTxTime = true;
+        wtxNew.BindWallet(this);
+
+        // copying is only safe while the key holds nothing to return
+        lChangeKeys.push_back(CReserveKey(this));
+        CReserveKey& reservekey = lChangeKeys.back();
+
+        int64_t nFee = nTransactionFee;
+        unsigned int nBytes;
+        set<pair<const CWalletTx*,unsigned int> > setCoins;
+        while (true)
+        {
+            wtxNew.vin.clear();
+            wtxNew.vout.clear();
+            wtxNew.fFromMe = true;
+
+            for (unsigned int i = nStart; i < nEnd; i++)
+                wtxNew.vout.push_back(CTxOut(vecSend[i].second, vecSend[i].first));
+
+            int64_t nValueIn = 0;
+            int64_t nTotalValue = nValue + nFee;
+            if (!SelectCoinsMinConf(nTotalValue, wtxNew.nTime, 1, 10, vCoins, setCoins, nValueIn) &&
+                !SelectCoinsMinConf(nTotalValue, wtxNew.nTime, 1, 1, vCoins, setCoins, nValueIn) &&
+                !SelectCoinsMinConf(nTotalValue, wtxNew.nTime, 0, 1, vCoins, setCoins, nValueIn))
+            {
+                strFailReason = _("Insufficient funds");
+                return false;
+            }
+
+            double dPriority = 0;
+            BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+            {
+                int64_t nCredit = pcoin.first->vout[pcoin.second].nValue;
+                int age = pcoin.first->GetDepthInMainChain();
+                if (age != 0)
+                    age += 1;
+                dPriority += (double)nCredit * age;
+            }
+
+            int64_t nChange = nValueIn - nValue - nFee;
+            if (nChange > 0)
+            {
+                CPubKey vchPubKey;
+                bool ret;
+                ret = reservekey.GetReservedKey(vchPubKey);
+                assert(ret); // should never fail, as we just unlocked
+
+                CScript scriptChange;
+                scriptChange.SetDestination(vchPubKey.GetID());
+                CTxOut newTxOut(nChange, scriptChange);
+
+                // Never create dust outputs; if we would, just
+                // add the dust to the fee.
+                if (newTxOut.IsDust(MIN_RELAY_TX_FEE))
+                {
+                    nFee += nChange;
+                    reservekey.ReturnKey();
+                }
+                else
+                {
+                    // Insert change txn at random position:
+                    vector<CTxOut>::iterator position = wtxNew.vout.begin()+GetRandInt(wtxNew.vout.size()+1);
+                    wtxNew.vout.insert(position, newTxOut);
+                }
+            }
+            else
+                reservekey.ReturnKey();
+
+            BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
+                wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
+
+            // Limit size, counting the signatures still to come
+            nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION) +
+                     wtxNew.vin.size() * MAX_SINGLE_KEY_SCRIPTSIG_SIZE;
+            if (nBytes >= MAX_STANDARD_TX_SIZE)
+            {
+                strFailReason = _("Transaction too large");
+                return false;
+            }
+            dPriority = wtxNew.ComputePriority(dPriority, nBytes);
+
+            // Check that enough fee is included
+            int64_t nPayFee = nTransactionFee * (1 + (int64_t)nBytes / 1000);
+            bool fAllowFree = AllowFree(dPriority);
+            int64_t nMinFee = GetMinFee(wtxNew, nBytes, fAllowFree, GMF_SEND);
+            if (nFee < max(nPayFee, nMinFee))
+            {
+                nFee = max(nPayFee, nMinFee);
+                continue;
+            }
+            break;
+        }
+
+        // the rest of the batch can't spend these again
+        vector<COutput>::iterator it = vCoins.begin();
+        for (vector<COutput>::iterator mi = vCoins.begin(); mi != vCoins.end(); ++mi)
+            if (!setCoins.count(make_pair(mi->tx, (unsigned int)mi->i)))
+                *it++ = *mi;
+        vCoins.erase(it, vCoins.end());
+
+        vEstimatedBytes.push_back(nBytes);
+        nFeeRet += nFee;
+    }
+
+    // Sign every input of the batch
+    vector<pair<unsigned int, unsigned int> > vInputs;
+    vector<const CWalletTx*> vPrev;
+    for (unsigned int nTx = 0; nTx < vwtxNew.size(); nTx++)
+        for (unsigned int nIn = 0; nIn < vwtxNew[nTx].vin.size(); nIn++)
+        {
+            vInputs.push_back(make_pair(nTx, nIn));
+            vPrev.push_back(&mapWallet[vwtxNew[nTx].vin[nIn].prevout.hash]);
+        }
+    vector<CScript> vScriptSig(vInputs.size());
+    vector<char> vfSigned(vInputs.size(), false);
+
+    unsigned int nThreads = boost::thread::hardware_concurrency();
+    if (vInputs.size() >= BATCH_SIGN_PARALLEL_MIN && nThreads > 1)
+    {
+        boost::thread_group threadGroup;
+        size_t nChunk = (vInputs.size() + nThreads - 1) / nThreads;
+        for (size_t nBegin = 0; nBegin < vInputs.size(); nBegin += nChunk)
+        {
+            size_t nEnd = std::min(nBegin + nChunk, vInputs.size());
+            threadGroup.create_thread(boost::bind(&SignBatchInputs, (const CKeyStore*)this, boost::cref(vwtxNew), boost::cref(vInputs),
+                                                  boost::cref(vPrev), boost::ref(vScriptSig), boost::ref(vfSigned), nBegin, nEnd));
+        }
+        threadGroup.join_all();
+    }
+    else
+        SignBatchInputs(this, vwtxNew, vInputs, vPrev, vScriptSig, vfSigned, 0, vInputs.size());
+
+    for (unsigned int i = 0; i < vInputs.size(); i++)
+    {
+        if (!vfSigned[i])
+        {
+            strFailReason = _("Signing transaction failed");
+            return false;
+        }
+        vwtxNew[vInputs[i].first].vin[vInputs[i].second].scriptSig = vScriptSig[i];
+    }
+
+    for (unsigned int nTx = 0; nTx < vwtxNew.size(); nTx++)
+    {
+        CWalletTx& wtxNew = vwtxNew[nTx];
+        wtxNew.InvalidateHash();
+
+        // the fee was worked out for the estimated size, an input with a
+        // bigger signature than that (multisig, say) would leave it short
+        if (::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION) > vEstimatedBytes[nTx])
+        {
+            strFailReason = _("Signing transaction failed");
+            return false;
+        }
+
+        // Fill vtxPrev by copying from previous transactions vtxPrev
+        wtxNew.AddSupportingTransactions(txdb);
+    }
+    return true;
+}
+
+// Call after CreateTransactionBatch unless you want to abort
+bool CWallet::CommitTransactionBatch(vector<CWalletTx>& vwtxNew, list<CReserveKey>& lChangeKeys)
+{
+    LOCK2(cs_main, cs_wallet);
+
+    // Nothing is recorded or relayed unless the memory pool takes the whole
+    // batch; the transactions spend disjoint confirmed coins, so checking each
+    // one on its own is enough
+    BOOST_FOREACH(const CWalletTx& wtxNew, vwtxNew)
+    {
+        if (!AcceptableInputs(mempool, wtxNew, false, NULL, true))
+        {
+            LogPrintf("CommitTransactionBatch() : Error: Transaction %s not valid, batch not sent\n", wtxNew.GetHash().ToString());
+            return false;
+        }
+    }
+
+    // Take the change keys from the key pool first, KeepKey writes through
+    // a database handle of its own
+    BOOST_FOREACH(CReserveKey& reservekey, lChangeKeys)
+        reservekey.KeepKey();
+
+    // All the wallet records of the batch go in one database transaction
+    // rather than one flushed write each
+    CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile, "r+") : NULL;
+    if (pwalletdb && !pwalletdb->TxnBegin())
+    {
+        delete pwalletdb;
+        LogPrintf("CommitTransactionBatch() : Error: TxnBegin failed\n");
+        return false;
+    }
+
+    BOOST_FOREACH(CWalletTx& wtxNew, vwtxNew)
+    {
+        LogPrintf("CommitTransactionBatch: %s, %u inputs, %u outputs\n", wtxNew.GetHash().ToString(), wtxNew.vin.size(), wtxNew.vout.size());
+
+        // Add tx to wallet, because if it has change it's also ours,
+        // otherwise just for transaction history.
+        AddToWallet(wtxNew, false, pwalletdb);
+
+        // Mark old coins as spent
+        BOOST_FOREACH(const CTxIn& txin, wtxNew.vin)
+        {
+            CWalletTx &coin = mapWallet[txin.prevout.hash];
+            coin.BindWallet(this);
+            coin.MarkSpent(txin.prevout.n);
+            coin.WriteToDisk(pwalletdb);
+            UpdateAvailableCoins(coin);
+            NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
+        }
+    }
+
+    if (pwalletdb)
+    {
+        bool fCommitted = pwalletdb->TxnCommit();
+        delete pwalletdb;
+        if (!fCommitted)
+        {
+            LogPrintf("CommitTransactionBatch() : Error: TxnCommit failed\n");
+            return false;
+        }
+    }
+
+    // Broadcast
+    bool fAccepted = true;
+    BOOST_FOREACH(CWalletTx& wtxNew, vwtxNew)
+    {
+        // Track how many getdata requests our transaction gets
+        mapRequestCount[wtxNew.GetHash()] = 0;
+
+        if (!wtxNew.AcceptToMemoryPool(false))
+        {
+            // This must not fail. The transaction has already been signed and recorded.
+            LogPrintf("CommitTransactionBatch() : Error: Transaction %s not valid\n", wtxNew.GetHash().ToString());
+            fAccepted = false;
+            continue;
+        }
+        wtxNew.RelayWalletTransaction();
+    }
+    return fAccepted;
+}
+
 bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB & pwalletdb)
 {
     if (!pwalletdb.WriteAccountingEntry_Backend(acentry))
@@ -3953,6 +4489,15 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         }
     }
 
+    if (nLoadWalletRet == DB_LOAD_OK || nLoadWalletRet == DB_NONCRITICAL_ERROR)
+    {
+        // transactions are read before the keys, so IsMine only answers
+        // correctly once the whole file is in; a noncritical error still
+        // leaves a usable wallet
+        LOCK(cs_wallet);
+        RebuildAvailableCoins();
+    }
+
     if (nLoadWalletRet != DB_LOAD_OK)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
@@ -4353,6 +4898,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateAvailableCoins(*pcoin);
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -4365,6 +4911,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateAvailableCoins(*pcoin);
                 }
             }
         }
@@ -4388,6 +4935,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateAvailableCoins(prev);
             }
         }
     }
@@ -111,6 +111,14 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Unspent outputs of ours with a non-zero value, ordered by value, so
+    // AvailableCoins doesn't have to run IsMine over the whole of mapWallet.
+    // Kept in step with vfSpent by UpdateAvailableCoins.
+    typedef std::map<std::pair<int64_t, COutPoint>, isminetype> AvailableCoinsIndex;
+    AvailableCoinsIndex mapAvailableCoins;
+    void UpdateAvailableCoins(const CWalletTx& wtx, bool fErase = false);
+    void RebuildAvailableCoins();
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -200,7 +208,7 @@ public:
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins, unsigned int nSpendTime) const;
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = false) const;
     void AvailableCoinsMN(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = false) const;
-    bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
+    bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -250,7 +258,7 @@ public:
     int64_t IncOrderPosNext(CWalletDB *pwalletdb = NULL);
 
     void MarkDirty();
-    bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false);
+    bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false, CWalletDB* pwalletdb=NULL);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect = true);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
@@ -277,6 +285,18 @@ public:
     bool CreateTransaction(CScript scriptPubKey, int64_t nValue, std::string& sNarr, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std::string strCommand="tx");
 
+    /** Pay many recipients at once: vecSend is split into transactions of at
+     * most nMaxOutputs payments, funded from a single AvailableCoins pass and
+     * signed together, or from pvCoins when given. lChangeKeys gets the change
+     * key of each transaction; CommitTransactionBatch checks that the memory
+     * pool takes every one of them before it records anything, then records
+     * them in one database transaction.
+     */
+    bool CreateTransactionBatch(const std::vector<std::pair<CScript, int64_t> >& vecSend, unsigned int nMaxOutputs, std::vector<CWalletTx>& vwtxNew,
+                                std::list<CReserveKey>& lChangeKeys, int64_t& nFeeRet, std::string& strFailReason,
+                                const std::vector<COutput>* pvCoins=NULL);
+    bool CommitTransactionBatch(std::vector<CWalletTx>& vwtxNew, std::list<CReserveKey>& lChangeKeys);
+
     bool AddAccountingEntry(const CAccountingEntry&, CWalletDB & pwalletdb);
 
     uint64_t GetStakeWeight() const;
@@ -1054,7 +1074,7 @@ public:
         return true;
     }
 
-    bool WriteToDisk();
+    bool WriteToDisk(CWalletDB *pwalletdb = NULL);
 
     int64_t GetTxTime() const;
     int GetRequestCount() const;